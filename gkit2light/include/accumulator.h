@@ -0,0 +1,122 @@
+
+#ifndef _ACCUMULATOR_H
+#define _ACCUMULATOR_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "color.h"
+#include "image.h"
+
+#include "tiles.h"
+
+
+/*! accumule les echantillons de chaque pixel, pour un rendu progressif.
+    la moyenne et la variance sont mises a jour a chaque echantillon, cf "Welford's online algorithm",
+    https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Welford's_online_algorithm
+    sans sommer les carres des echantillons, qui perdent en precision quand le nombre d'echantillons augmente.
+
+    mean(x, y) : moyenne des echantillons du pixel, alpha : nombre d'echantillons.
+    la variance n'est estimee que sur la luminance, cf Color::power().
+ */
+struct Accumulator
+{
+    Image mean;                 //!< moyenne des echantillons de chaque pixel, alpha : nombre d'echantillons
+    std::vector<float> m2;      //!< somme des carres des ecarts a la moyenne de chaque pixel
+
+    Accumulator( const int width, const int height ) : mean(width, height, Color(0, 0, 0, 0)), m2(width * height, 0) {}
+
+    int width( ) const { return mean.width(); }
+    int height( ) const { return mean.height(); }
+
+    //! ajoute un echantillon au pixel (x, y).
+    void add( const int x, const int y, const Color& sample )
+    {
+        Color& m= mean(x, y);
+        float n= m.a + 1;
+        float old= m.power();
+        m= Color(m + (sample - m) / n, n);
+        m2[y * width() + x]+= (sample.power() - old) * (sample.power() - m.power());
+    }
+
+    //! renvoie le nombre d'echantillons du pixel (x, y).
+    int samples( const int x, const int y ) const { return int(mean(x, y).a); }
+
+    //! renvoie la variance des echantillons du pixel (x, y).
+    float variance( const int x, const int y ) const
+    {
+        float n= mean(x, y).a;
+        if(n < 2)
+            return 0;
+        return m2[y * width() + x] / (n - 1);
+    }
+
+    /*! renvoie l'erreur relative estimee de la moyenne du pixel (x, y) : ecart type de la moyenne / luminance, au moins floor.
+        prior : variance a priori, comptee comme un echantillon de plus. sans prior, un pixel dont les premiers echantillons sont identiques
+        a une erreur nulle, meme si la variance reelle ne l'est pas.
+     */
+    float error( const int x, const int y, const float floor= 0.1f, const float prior= 0 ) const
+    {
+        float n= mean(x, y).a;
+        if(n < 1 || (n < 2 && prior == 0))
+            return 0;
+        float v= (m2[y * width() + x] + prior) / (prior > 0 ? n : n - 1);
+        return std::sqrt(v / n) / std::max(mean(x, y).power(), floor);
+    }
+
+    /*! renvoie l'erreur relative estimee de la moyenne des pixels d'un bloc : ecart type de la moyenne des pixels / luminance moyenne du bloc.
+        les blocs sombres utilisent une luminance d'au moins floor, pour ne pas exiger une precision relative impossible a atteindre sur du noir.
+     */
+    float error( const Tile& tile, const float floor= 0.1f ) const
+    {
+        double variance_mean= 0;
+        double luminance= 0;
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
+        {
+            float n= mean(px, py).a;
+            if(n > 1)
+                variance_mean+= variance(px, py) / n;
+            luminance+= mean(px, py).power();
+        }
+
+        int count= tile.width() * tile.height();
+        return float(std::sqrt(variance_mean / count) / std::max(luminance / count, double(floor)));
+    }
+
+    /*! renvoie une image du nombre d'echantillons de chaque pixel : bleu pour peu d'echantillons, vert, puis rouge pour max_samples.
+        max_samples= 0 utilise le nombre d'echantillons le plus grand de l'image.
+     */
+    Image heatmap( int max_samples= 0 ) const
+    {
+        if(max_samples == 0)
+            for(int py= 0; py < height(); py++)
+            for(int px= 0; px < width(); px++)
+                max_samples= std::max(max_samples, samples(px, py));
+
+        Image result(width(), height());
+        for(int py= 0; py < height(); py++)
+        for(int px= 0; px < width(); px++)
+        {
+            float t= std::min(1.f, float(samples(px, py)) / float(std::max(max_samples, 1)));
+            if(t < .5f)
+                result(px, py)= Color(0, 2*t, 1 - 2*t);
+            else
+                result(px, py)= Color(2*t - 1, 2 - 2*t, 0);
+        }
+        return result;
+    }
+
+    //! renvoie l'image moyenne, alpha= 1.
+    Image image( ) const
+    {
+        Image result(width(), height());
+        for(int py= 0; py < height(); py++)
+        for(int px= 0; px < width(); px++)
+            result(px, py)= Color(mean(px, py), 1);
+        return result;
+    }
+};
+
+#endif
@@ -0,0 +1,149 @@
+
+#ifndef _IRRADIANCE_CACHE_H
+#define _IRRADIANCE_CACHE_H
+
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+
+#include "vec.h"
+
+
+/*! valeur integree sur l'hemisphere de normale n au point p, et ses gradients, cf IrradianceCache.
+    "Irradiance Gradients", G. Ward, P. Heckbert, 1992
+ */
+struct IrradianceRecord
+{
+    Point p;
+    Vector n;
+    float e;                //!< valeur integree, eclairement ou occultation ambiante
+    float radius;           //!< distance moyenne aux objets visibles, limitee par le gradient de translation
+    Vector rotation;        //!< variation de e quand la normale tourne
+    Vector translation;     //!< variation de e quand le point se deplace
+};
+
+/*! cache d'eclairement : les valeurs calculees sur quelques points sont interpolees sur les points voisins, de normales proches.
+    cf "A Ray Tracing Solution for Diffuse Interreflection", G. Ward, F. Rubinstein, R. Clear, 1988
+
+    un echantillon i est utilisable au point p de normale n si son poids w_i(p, n)= 1 / (|p - p_i| / R_i + sqrt(1 - n.n_i)) depasse 1 / accuracy,
+    les echantillons sont ranges dans un octree, au niveau dont la taille correspond a leur rayon de validite accuracy * R_i.
+
+    insert() modifie l'octree, lookup() ne fait que le lire : les threads peuvent interpoler en parallele, entre 2 insertions.
+ */
+struct IrradianceCache
+{
+    struct Node
+    {
+        Point center;
+        float size;             //!< demi cote du cube
+        int children[8];        //!< -1 si le fils n'existe pas
+        std::vector<int> records;
+
+        Node( const Point& _center, const float _size ) : center(_center), size(_size), records()
+        {
+            for(int i= 0; i < 8; i++)
+                children[i]= -1;
+        }
+    };
+
+    std::vector<IrradianceRecord> records;
+    std::vector<Node> nodes;
+    float accuracy;             //!< erreur acceptable, a dans l'article de Ward
+
+    //! cache vide sur le cube englobant [pmin pmax].
+    IrradianceCache( const Point& pmin, const Point& pmax, const float _accuracy= 0.2f ) : records(), nodes(), accuracy(_accuracy)
+    {
+        Point center= Point((pmin.x + pmax.x) / 2, (pmin.y + pmax.y) / 2, (pmin.z + pmax.z) / 2);
+        float size= std::max(pmax.x - pmin.x, std::max(pmax.y - pmin.y, pmax.z - pmin.z)) / 2;
+        nodes.push_back(Node(center, size * 1.01f + FLT_EPSILON));
+    }
+
+    //! ajoute un echantillon, dans le plus petit noeud qui contient sa sphere de validite.
+    void insert( const IrradianceRecord& record )
+    {
+        int id= int(records.size());
+        records.push_back(record);
+
+        float r= accuracy * record.radius;
+        int node= 0;
+        for(int depth= 0; depth < 20 && nodes[node].size / 2 >= r; depth++)
+        {
+            const Point& center= nodes[node].center;
+            int child= (record.p.x > center.x ? 1 : 0) | (record.p.y > center.y ? 2 : 0) | (record.p.z > center.z ? 4 : 0);
+            if(nodes[node].children[child] < 0)
+            {
+                float size= nodes[node].size / 2;
+                Point c= Point(center.x + ((child & 1) ? size : -size), center.y + ((child & 2) ? size : -size), center.z + ((child & 4) ? size : -size));
+                nodes[node].children[child]= int(nodes.size());
+                nodes.push_back(Node(c, size));     // nodes[node] peut etre deplace...
+            }
+            node= nodes[node].children[child];
+        }
+
+        nodes[node].records.push_back(id);
+    }
+
+    //! renvoie le poids de l'echantillon au point p de normale n, 0 s'il n'est pas utilisable.
+    float weight( const IrradianceRecord& record, const Point& p, const Vector& n ) const
+    {
+        // l'echantillon est devant p : le point est cache de l'echantillon, cf Ward 1988
+        Vector d= p - record.p;
+        if(dot(d, n + record.n) < -0.1f * accuracy * record.radius)
+            return 0;
+
+        float cos_n= std::min(1.f, dot(n, record.n));
+        float error= length(d) / record.radius + std::sqrt(1 - cos_n);
+        if(error >= accuracy)
+            return 0;
+        return 1 / std::max(error, 1e-6f);
+    }
+
+    //! interpole les echantillons utilisables au point p de normale n, renvoie faux s'il n'y en a pas.
+    bool lookup( const Point& p, const Vector& n, float& e ) const
+    {
+        float sum= 0;
+        float sum_weights= 0;
+
+        int stack[256];     // 7 noeuds en attente par niveau, au plus
+        int top= 0;
+        stack[top++]= 0;
+        while(top > 0)
+        {
+            const Node& node= nodes[stack[--top]];
+            for(int id : node.records)
+            {
+                const IrradianceRecord& record= records[id];
+                float w= weight(record, p, n);
+                if(w > 0)
+                {
+                    // extrapolation au premier ordre, cf Ward, Heckbert 1992
+                    float ei= record.e + dot(cross(record.n, n), record.rotation) + dot(p - record.p, record.translation);
+                    sum+= w * ei;
+                    sum_weights+= w;
+                }
+            }
+
+            // les echantillons d'un fils sont valides a moins d'un demi cote de ses bords
+            for(int i= 0; i < 8; i++)
+            {
+                int child= node.children[i];
+                if(child < 0)
+                    continue;
+
+                const Node& c= nodes[child];
+                float extent= 2 * c.size;
+                if(std::abs(p.x - c.center.x) <= extent && std::abs(p.y - c.center.y) <= extent && std::abs(p.z - c.center.z) <= extent)
+                    stack[top++]= child;
+            }
+        }
+
+        if(sum_weights == 0)
+            return false;
+
+        e= std::max(0.f, sum / sum_weights);
+        return true;
+    }
+};
+
+#endif
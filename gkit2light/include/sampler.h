@@ -0,0 +1,220 @@
+
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include <cstdint>
+
+#include "vec.h"
+
+
+//! melange les bits de x, cf "hash prospector", https://nullprogram.com/blog/2018/07/31/
+inline uint32_t hash32( uint32_t x )
+{
+    x^= x >> 16;
+    x*= 0x7feb352dU;
+    x^= x >> 15;
+    x*= 0x846ca68bU;
+    x^= x >> 16;
+    return x;
+}
+
+//! combine 2 valeurs, pour construire une graine a partir de plusieurs indices.
+inline uint32_t hash32( const uint32_t a, const uint32_t b )
+{
+    return hash32(a ^ (hash32(b) + 0x9e3779b9U + (a << 6) + (a >> 2)));
+}
+
+//! renvoie un reel [0 1[ construit avec les 24 bits de poids fort de x.
+inline float uniform_float( const uint32_t x )
+{
+    return float(x >> 8) * (1.f / float(1u << 24));
+}
+
+/*! generateur aleatoire pcg32, cf https://www.pcg-random.org/
+    16 octets d'etat, beaucoup plus rapide a initialiser et a utiliser que std::mt19937 (5Ko d'etat) et std::random_device.
+ */
+struct PCG32
+{
+    uint64_t state;
+    uint64_t inc;
+
+    PCG32( const uint64_t seed= 0x853c49e6748fea9bULL, const uint64_t stream= 0xda3e39cb94b95bdbULL ) { seed_sequence(seed, stream); }
+
+    void seed_sequence( const uint64_t seed, const uint64_t stream )
+    {
+        state= 0;
+        inc= (stream << 1) | 1;
+        next();
+        state+= seed;
+        next();
+    }
+
+    uint32_t next( )
+    {
+        uint64_t old= state;
+        state= old * 6364136223846793005ULL + inc;
+        uint32_t shifted= uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot= uint32_t(old >> 59);
+        return (shifted >> rot) | (shifted << ((-rot) & 31));
+    }
+
+    //! renvoie un reel uniforme [0 1[.
+    float uniform( ) { return uniform_float(next()); }
+};
+
+
+//! inverse l'ordre des bits de x.
+inline uint32_t reverse_bits( uint32_t x )
+{
+    x= (x << 16) | (x >> 16);
+    x= ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+    x= ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+    x= ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+    x= ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+    return x;
+}
+
+/*! brouillage d'owen des bits de x, cf "Practical Hash-based Owen Scrambling", B. Burley, 2020
+    https://jcgt.org/published/0009/04/01/
+    chaque bit est inverse ou pas en fonction des bits de poids plus fort, la stratification de la sequence est conservee.
+ */
+inline uint32_t owen_scramble( uint32_t x, const uint32_t seed )
+{
+    x= reverse_bits(x);
+    // permutation de laine-karras, amelioree
+    x^= x * 0x3d20adeaU;
+    x+= seed;
+    x*= (seed >> 16) | 1;
+    x^= x * 0x05526c56U;
+    x^= x * 0x53a22864U;
+    return reverse_bits(x);
+}
+
+//! 1ere dimension de la sequence de sobol, van der corput en base 2.
+inline uint32_t sobol0( const uint32_t index ) { return reverse_bits(index); }
+
+//! 2ieme dimension de la sequence de sobol.
+inline uint32_t sobol1( uint32_t index )
+{
+    uint32_t x= 0;
+    for(uint32_t v= 1U << 31; index; index>>= 1, v^= v >> 1)
+        if(index & 1)
+            x^= v;
+    return x;
+}
+
+
+//! choix des nombres aleatoires, cf Sampler.
+enum SamplerType
+{
+    SAMPLER_RANDOM= 0,      //!< nombres pseudo aleatoires independants, pcg32
+    SAMPLER_FIBONACCI,      //!< spirale de fibonacci, decalee pour chaque pixel (rotation de cranley-patterson)
+    SAMPLER_SOBOL           //!< sequence de sobol, avec un brouillage d'owen pour chaque pixel et chaque dimension
+};
+
+/*! genere les nombres aleatoires des echantillons d'un pixel.
+    les valeurs ne dependent que de (pixel, echantillon, dimension) et de la graine de l'image : une image est reproductible,
+    quel que soit l'ordre de calcul des pixels ou le nombre de threads.
+
+    utilisation :
+    \code
+    Sampler sampler(SAMPLER_SOBOL);
+    for(int i= 0; i < n; i++)
+    {
+        sampler.start(px, py, i, n);        // echantillon i sur n du pixel
+        vec2 u= sampler.sample2();          // dimensions 0 et 1
+        float u3= sampler.sample1();        // dimension 2
+        ...
+    }
+    \endcode
+    sobol et fibonacci sont stratifies : n echantillons couvrent le domaine plus regulierement que n nombres aleatoires independants,
+    et l'estimateur converge plus vite. la graine de chaque pixel decorrele les pixels voisins.
+ */
+struct Sampler
+{
+    SamplerType type;
+    uint32_t seed;          //!< graine de l'image
+    uint32_t pixel;         //!< graine du pixel
+    uint32_t index;         //!< indice de l'echantillon
+    uint32_t count;         //!< nombre d'echantillons du pixel, pour fibonacci
+    uint32_t dimension;     //!< prochaine dimension
+    PCG32 rng;
+
+    Sampler( const SamplerType _type= SAMPLER_SOBOL, const uint32_t _seed= 0 ) : type(_type), seed(_seed), pixel(0), index(0), count(1), dimension(0), rng() {}
+
+    //! commence l'echantillon index sur count du pixel (x, y).
+    void start( const int x, const int y, const int _index, const int _count )
+    {
+        pixel= hash32(hash32(seed, uint32_t(x)), uint32_t(y));
+        index= uint32_t(_index);
+        count= uint32_t(_count);
+        dimension= 0;
+        if(type == SAMPLER_RANDOM)
+            rng.seed_sequence(hash32(pixel, index), pixel);
+    }
+
+    //! renvoie la prochaine dimension de l'echantillon.
+    float sample1( )
+    {
+        uint32_t d= dimension++;
+        switch(type)
+        {
+            case SAMPLER_RANDOM:
+                return rng.uniform();
+
+            case SAMPLER_FIBONACCI:
+                return rotate(float(index) / float(count) + .5f / float(count), d);
+
+            case SAMPLER_SOBOL:
+            default:
+                // chaque dimension utilise une permutation differente des echantillons, cf Burley 2020, section 4
+                uint32_t s= hash32(pixel, d);
+                return uniform_float(owen_scramble(sobol0(owen_scramble(index, s)), hash32(s, 0)));
+        }
+    }
+
+    //! renvoie les 2 prochaines dimensions de l'echantillon.
+    vec2 sample2( )
+    {
+        uint32_t d= dimension;
+        dimension+= 2;
+        switch(type)
+        {
+            case SAMPLER_RANDOM:
+            {
+                float u1= rng.uniform();
+                float u2= rng.uniform();
+                return vec2(u1, u2);
+            }
+
+            case SAMPLER_FIBONACCI:
+            {
+                // spirale de fibonacci : u1 stratifie, u2= index / nombre d'or
+                const float phi= 1.61803398874989484820f;
+                float u1= float(index) / float(count) + .5f / float(count);
+                float u2= float(index) / phi;
+                return vec2(rotate(u1, d), rotate(u2 - float(int(u2)), d +1));
+            }
+
+            case SAMPLER_SOBOL:
+            default:
+            {
+                // les 2 premieres dimensions de sobol sont stratifiees en 2d, l'ordre des echantillons est permute par paire de dimensions
+                uint32_t s= hash32(pixel, d);
+                uint32_t i= owen_scramble(index, s);
+                return vec2(uniform_float(owen_scramble(sobol0(i), hash32(s, 0))), uniform_float(owen_scramble(sobol1(i), hash32(s, 1))));
+            }
+        }
+    }
+
+protected:
+    //! rotation de cranley-patterson : decale u d'une valeur aleatoire, fixe pour le pixel et la dimension, modulo 1.
+    float rotate( const float u, const uint32_t d ) const
+    {
+        float x= u + uniform_float(hash32(pixel, d));
+        x= (x < 1) ? x : x - 1;
+        return (x < 1) ? x : 0;
+    }
+};
+
+#endif
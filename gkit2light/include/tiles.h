@@ -0,0 +1,235 @@
+
+#ifndef _TILES_H
+#define _TILES_H
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+//! donnees de travail vides, pour TileScheduler::run().
+struct NoScratch {};
+
+//! bloc de pixels [x0 x1[ x [y0 y1[ de l'image, unite de travail des rendus, cf TileScheduler.
+struct Tile
+{
+    int x0, y0;
+    int x1, y1;
+    int index;      //!< indice du bloc dans l'ordre de parcours
+
+    int width( ) const { return x1 - x0; }
+    int height( ) const { return y1 - y0; }
+};
+
+//! renvoie le code de morton 2d de (x, y), les bits de x et y sont entrelaces.
+inline uint32_t morton2( const uint32_t x, const uint32_t y )
+{
+    auto part= []( uint32_t v )
+    {
+        v&= 0xffff;
+        v= (v | (v << 8)) & 0x00ff00ff;
+        v= (v | (v << 4)) & 0x0f0f0f0f;
+        v= (v | (v << 2)) & 0x33333333;
+        v= (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return part(x) | (part(y) << 1);
+}
+
+/*! decoupe une image width x height en blocs de size x size pixels, renvoie les blocs dans l'ordre de morton :
+    2 blocs consecutifs sont proches dans l'image, et leurs rayons visitent les memes parties de l'arbre.
+ */
+inline std::vector<Tile> morton_tiles( const int width, const int height, const int size= 16 )
+{
+    int w= (width + size -1) / size;
+    int h= (height + size -1) / size;
+
+    std::vector< std::pair<uint32_t, Tile> > sorted;
+    sorted.reserve(w * h);
+    for(int ty= 0; ty < h; ty++)
+    for(int tx= 0; tx < w; tx++)
+    {
+        Tile tile= { tx * size, ty * size, std::min(width, (tx +1) * size), std::min(height, (ty +1) * size), 0 };
+        sorted.push_back( std::make_pair(morton2(tx, ty), tile) );
+    }
+    std::sort(sorted.begin(), sorted.end(),
+        []( const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b ) { return a.first < b.first; });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(sorted.size());
+    for(int i= 0; i < int(sorted.size()); i++)
+    {
+        tiles.push_back(sorted[i].second);
+        tiles.back().index= i;
+    }
+    return tiles;
+}
+
+/*! repartition des blocs entre les threads, avec vol de travail.
+    chaque thread recoit une sequence de blocs consecutifs dans l'ordre de morton, une region compacte de l'image, et les traite dans l'ordre.
+    un thread qui a termine sa sequence vole les derniers blocs du thread qui a le plus de travail en attente.
+    les threads sont ceux d'openMP, crees une seule fois et reutilises par chaque appel de run().
+
+    utilisation :
+    \code
+    TileScheduler scheduler(morton_tiles(image.width(), image.height(), 16));
+    scheduler.run<Scratch>( [&]( const Tile& tile, Scratch& scratch )
+        {
+            for(int py= tile.y0; py < tile.y1; py++)
+            for(int px= tile.x0; px < tile.x1; px++)
+                ...
+        } );
+    scheduler.print_times();
+    \endcode
+    Scratch est construit une fois par thread, pour conserver des donnees de travail (generateur aleatoire, tableaux temporaires, etc.)
+    sans synchronisation.
+ */
+struct TileScheduler
+{
+    std::vector<Tile> tiles;
+    std::vector<float> times;       //!< duree de calcul de chaque bloc, en millisecondes
+    std::vector<int> threads;       //!< thread qui a calcule chaque bloc
+    int steals;                     //!< nombre de blocs voles par run()
+
+    TileScheduler( const std::vector<Tile>& _tiles ) : tiles(_tiles), times(_tiles.size(), 0), threads(_tiles.size(), 0), steals(0) {}
+
+    template< typename Scratch, typename Function >
+    void run( Function function )
+    {
+        run<Scratch>(function, []( Scratch& ) {});
+    }
+
+    //! meme chose, et appelle finish(scratch) pour chaque thread, un seul a la fois, pour recuperer ses resultats.
+    template< typename Scratch, typename Function, typename Finish >
+    void run( Function function, Finish finish )
+    {
+        int n= 1;
+    #ifdef _OPENMP
+        n= omp_get_max_threads();
+    #endif
+
+        // sequences initiales, de tailles egales
+        std::vector<Queue> queues(n);
+        for(int i= 0; i < n; i++)
+            queues[i].range= pack(int(size_t(i) * tiles.size() / n), int(size_t(i +1) * tiles.size() / n));
+
+        std::atomic<int> stolen(0);
+    #pragma omp parallel num_threads(n)
+        {
+            int id= 0;
+        #ifdef _OPENMP
+            id= omp_get_thread_num();
+        #endif
+            Scratch scratch;
+
+            for(;;)
+            {
+                // prend le prochain bloc de la sequence du thread, sinon vole un bloc a la fin de la sequence la plus longue
+                int index= pop_front(queues[id]);
+                if(index < 0)
+                {
+                    int victim= -1;
+                    int remaining= 0;
+                    for(int i= 0; i < n; i++)
+                    {
+                        int count= size(queues[i]);
+                        if(count > remaining)
+                        {
+                            victim= i;
+                            remaining= count;
+                        }
+                    }
+                    if(victim < 0)
+                        break;  // plus de travail
+
+                    index= pop_back(queues[victim]);
+                    if(index < 0)
+                        continue;   // un autre thread a pris le dernier bloc, recommence
+                    stolen++;
+                }
+
+                auto start= std::chrono::high_resolution_clock::now();
+                function(tiles[index], scratch);
+                auto stop= std::chrono::high_resolution_clock::now();
+
+                times[index]= std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count() / 1000.f;
+                threads[index]= id;
+            }
+
+        #pragma omp critical
+            finish(scratch);
+        }
+
+        steals= stolen;
+    }
+
+    //! affiche les durees des blocs : moyenne, ecart entre le plus rapide et le plus lent, et les blocs les plus lents.
+    void print_times( const int slowest= 4 ) const
+    {
+        if(tiles.empty())
+            return;
+
+        float total= 0;
+        for(float t : times)
+            total+= t;
+
+        std::vector<int> order(tiles.size());
+        for(int i= 0; i < int(order.size()); i++)
+            order[i]= i;
+        std::sort(order.begin(), order.end(), [&]( const int a, const int b ) { return times[a] > times[b]; });
+
+        printf("tiles: %d tiles, %d stolen, %.2fms avg, %.2fms min, %.2fms max\n", int(tiles.size()), steals,
+            total / tiles.size(), times[order.back()], times[order.front()]);
+        for(int i= 0; i < slowest && i < int(order.size()); i++)
+        {
+            const Tile& tile= tiles[order[i]];
+            printf("  tile %d [%d %d]x[%d %d]: %.2fms, thread %d\n", tile.index, tile.x0, tile.x1, tile.y0, tile.y1, times[order[i]], threads[order[i]]);
+        }
+    }
+
+protected:
+    //! sequence de blocs [begin end[ d'un thread, les 2 indices sont modifies ensemble.
+    struct Queue
+    {
+        std::atomic<uint64_t> range;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];     // 1 ligne de cache par sequence
+
+        Queue( ) : range(0) {}
+        Queue( const Queue& q ) : range(q.range.load()) {}
+    };
+
+    static uint64_t pack( const int begin, const int end ) { return uint64_t(uint32_t(begin)) << 32 | uint32_t(end); }
+    static int begin( const uint64_t range ) { return int(range >> 32); }
+    static int end( const uint64_t range ) { return int(range & 0xffffffff); }
+
+    static int size( const Queue& queue ) { uint64_t range= queue.range.load(); return std::max(0, end(range) - begin(range)); }
+
+    //! renvoie le premier bloc de la sequence, ou -1 si elle est vide.
+    static int pop_front( Queue& queue )
+    {
+        uint64_t range= queue.range.load();
+        while(begin(range) < end(range))
+            if(queue.range.compare_exchange_weak(range, pack(begin(range) +1, end(range))))
+                return begin(range);
+        return -1;
+    }
+
+    //! renvoie le dernier bloc de la sequence, ou -1 si elle est vide.
+    static int pop_back( Queue& queue )
+    {
+        uint64_t range= queue.range.load();
+        while(begin(range) < end(range))
+            if(queue.range.compare_exchange_weak(range, pack(begin(range), end(range) -1)))
+                return end(range) -1;
+        return -1;
+    }
+};
+
+#endif
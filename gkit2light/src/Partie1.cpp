@@ -14,6 +14,8 @@
 #include "image_io.h"
 #include "image_hdr.h"
 
+#include "../include/tiles.h"
+
 
 Vector normal( const Hit& hit, const TriangleData& triangle )
 {
@@ -52,6 +54,7 @@ struct Triangle
     {
         Vector pvec= cross(ray.d, e2);
         float det= dot(e1, pvec);
+        if(det == 0) return Hit();      // rayon parallele au triangle
 
         float inv_det= 1 / det;
         Vector tvec(p, ray.o);
@@ -175,11 +178,12 @@ int main( const int argc, const char **argv )
     auto cpu_start= std::chrono::high_resolution_clock::now();
 
     // parcourir tous les pixels de l'image
-    // en parallele avec openMP, un thread par bloc de 16 lignes
-#pragma omp parallel for schedule(dynamic, 16)
-    for(int py= 0; py < image.height(); py++)
+    // en parallele, un bloc de 16x16 pixels a la fois, cf TileScheduler
+    TileScheduler scheduler(morton_tiles(image.width(), image.height(), 16));
+    scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& scratch )
     {
-        for(int px= 0; px < image.width(); px++)
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
         {
             // generer le rayon pour le pixel (x, y)
             float x= px + .5f;          // centre du pixel
@@ -218,11 +222,12 @@ int main( const int argc, const char **argv )
                 //std::cout<<"Not Hit" <<std::endl;
             }
         }
-    }
+    } );
 
     auto cpu_stop= std::chrono::high_resolution_clock::now();
     int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
     printf("cpu  %ds %03dms\n", int(cpu_time / 1000), int(cpu_time % 1000));
+    scheduler.print_times();
 
     // enregistrer l'image resultat
     write_image(image, "partie_1_shadow.png");
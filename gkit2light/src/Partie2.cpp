@@ -2,6 +2,7 @@
 #include <cfloat>
 #include <random>
 #include <chrono>
+#include <string>
 
 #include "vec.h"
 #include "mesh.h"
@@ -14,6 +15,9 @@
 #include "image_io.h"
 #include "image_hdr.h"
 
+#include "../include/tiles.h"
+#include "../include/sampler.h"
+
 
 Vector normal( const Hit& hit, const TriangleData& triangle )
 {
@@ -52,6 +56,7 @@ struct Triangle
     {
         Vector pvec= cross(ray.d, e2);
         float det= dot(e1, pvec);
+        if(det == 0) return Hit();      // rayon parallele au triangle
 
         float inv_det= 1 / det;
         Vector tvec(p, ray.o);
@@ -184,11 +189,29 @@ int main( const int argc, const char **argv )
 {
     const char *mesh_filename= "cornell.obj";
     const char *orbiter_filename= "orbiter.txt";
+    SamplerType sampler_type= SAMPLER_SOBOL;
 
-    if(argc > 1) mesh_filename= argv[1];
-    if(argc > 2) orbiter_filename= argv[2];
+    // Partie2 [options] [mesh.obj] [orbiter.txt]
+    //  -sampler random | fibonacci | sobol : directions d'occultation de chaque pixel, sobol par defaut, cf Sampler
+    int files= 0;
+    for(int i= 1; i < argc; i++)
+    {
+        std::string option= argv[i];
+        if(option == "-sampler" && i +1 < argc)
+        {
+            std::string name= argv[++i];
+            if(name == "random") sampler_type= SAMPLER_RANDOM;
+            else if(name == "fibonacci") sampler_type= SAMPLER_FIBONACCI;
+            else if(name == "sobol") sampler_type= SAMPLER_SOBOL;
+            else printf("[error] unknown sampler '%s', using sobol...\n", name.c_str());
+        }
+        else if(option[0] != '-' && files == 0) { mesh_filename= argv[i]; files++; }
+        else if(option[0] != '-' && files == 1) { orbiter_filename= argv[i]; files++; }
+        else printf("[error] unknown option '%s'...\n", argv[i]);
+    }
 
-    printf("%s: '%s' '%s'\n", argv[0], mesh_filename, orbiter_filename);
+    const char *sampler_names[]= { "random", "fibonacci", "sobol" };
+    printf("%s: '%s' '%s', sampler %s\n", argv[0], mesh_filename, orbiter_filename, sampler_names[sampler_type]);
 
     // creer l'image resultat
     Image image(1024, 640);
@@ -218,17 +241,15 @@ int main( const int argc, const char **argv )
     auto cpu_start= std::chrono::high_resolution_clock::now();
 
     // parcourir tous les pixels de l'image
-    // en parallele avec openMP, un thread par bloc de 16 lignes
-#pragma omp parallel for schedule(dynamic, 16)
-    for(int py= 0; py < image.height(); py++)
+    // en parallele, un bloc de 16x16 pixels a la fois, cf TileScheduler
+    TileScheduler scheduler(morton_tiles(image.width(), image.height(), 16));
+    scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
     {
-        // nombres aleatoires, version c++11
-        std::random_device seed;
-        // un generateur par thread... pas de synchronisation
-        std::mt19937 rng(seed());
-        std::uniform_real_distribution<float> u01(0.f, 1.f);
+        // nombres aleatoires, reproductibles, cf Sampler
+        Sampler sampler(sampler_type);
 
-        for(int px= 0; px < image.width(); px++)
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
         {
             // generer le rayon pour le pixel (x, y)
             float x= px + .5f;          // centre du pixel
@@ -270,7 +291,9 @@ int main( const int argc, const char **argv )
 
                 //******************Directions aléatoires*************************
                     // genere une direction
-                    Vector w= directions(u01(rng), u01(rng)); //
+                    sampler.start(px, py, i, n);
+                    vec2 u= sampler.sample2();
+                    Vector w= directions(u.x, u.y);
                 //*******************************************
 
                 //****************Directions Spirale de Fibonacci***************************
@@ -292,14 +315,16 @@ int main( const int argc, const char **argv )
                 image(px, py)= Color(color, 1);
             }
         }
-    }
+    } );
 
     auto cpu_stop= std::chrono::high_resolution_clock::now();
     int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
     printf("cpu  %ds %03dms\n", int(cpu_time / 1000), int(cpu_time % 1000));
+    scheduler.print_times();
 
     // enregistrer l'image resultat
-    write_image(image, "partie_2_cornell_random_256.png");
+    std::string image_filename= std::string("partie_2_cornell_") + sampler_names[sampler_type] + "_256.png";
+    write_image(image, image_filename.c_str());
     //write_image_hdr(image, "partie_2_shadow.hdr");
 
     return 0;
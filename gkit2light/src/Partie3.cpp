@@ -1,23 +1,39 @@
 #include <cfloat>
 #include <cassert>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 
 
 #include <random>
 #include <chrono>
 
 #include <vector>
+#include <string>
 #include <algorithm>
+#include <tuple>
 #include <chrono>
 
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 #include "vec.h"
 #include "mesh.h"
 #include "wavefront.h"
+#include "mapped_file.h"
 #include "orbiter.h"
 
 #include "image.h"
 #include "image_io.h"
 #include "image_hdr.h"
 
+#include "../include/tiles.h"
+#include "../include/sampler.h"
+#include "../include/accumulator.h"
+#include "../include/irradiance_cache.h"
+
 
 struct Ray
 {
@@ -33,7 +49,7 @@ struct Ray
 
 struct Hit
 {
-    int triangle_id;
+    int triangle_id;        //!< indice du triangle dans l'arbre, cf BVH::triangles, Triangle::id est l'indice du triangle dans le mesh
     float t;
     float u, v;
 
@@ -69,6 +85,12 @@ struct NodeHit
     operator bool( ) const { return (tmin <= tmax); }      // renvoie vrai si l'intersection est initialisee...
 };
 
+/*! les distances de sortie des englobants sont augmentees de quelques erreurs d'arrondis, pour que le test rayon / englobant soit conservatif,
+    cf "Robust BVH Ray Traversal", T. Ize, 2013, http://jcgt.org/published/0002/02/02/
+    sinon un rayon qui touche un triangle sur le bord de l'englobant peut le rater, meme avec TEST_WATERTIGHT.
+ */
+const float box_margin= 1 + 4 * FLT_EPSILON;
+
 struct Node
 {
     Point pmin;
@@ -86,7 +108,7 @@ struct Node
         Vector dmax= (rmax - ray.o) * invd;
 
         float tmin= std::max(dmin.z, std::max(dmin.y, std::max(dmin.x, 0.f)));
-        float tmax= std::min(dmax.z, std::min(dmax.y, std::min(dmax.x, htmax)));
+        float tmax= std::min(std::min(dmax.z, std::min(dmax.y, dmax.x)) * box_margin, htmax);
         return NodeHit(tmin, tmax);
     }
 };
@@ -95,24 +117,20 @@ struct Node
 inline Point min( const Point& a, const Point& b ) { return Point( std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) ); }
 inline Point max( const Point& a, const Point& b ) { return Point( std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) ); }
 
+//! triangle abc. les sommets sont conserves tels quels : les aretes partagees par 2 triangles sont identiques, cf TEST_WATERTIGHT.
 struct Triangle
 {
-    Point p;
-    Vector e1, e2;
+    Point a, b, c;
     int id;
 
-    Triangle( const Point& _a, const Point& _b, const Point& _c, const int _id ) : p(_a), e1(Vector(_a, _b)), e2(Vector(_a, _c)), id(_id) {}
+    Triangle( ) : a(), b(), c(), id(-1) {}
+    Triangle( const Point& _a, const Point& _b, const Point& _c, const int _id ) : a(_a), b(_b), c(_c), id(_id) {}
 
     //! renvoie l'englobant du triangle.
     void bounds( Point& pmin, Point& pmax ) const
     {
-        pmin= p;
-        pmin= min(pmin, p+e1);
-        pmin= min(pmin, p+e2);
-
-        pmax= p;
-        pmax= max(pmax, p+e1);
-        pmax= max(pmax, p+e2);
+        pmin= min(a, min(b, c));
+        pmax= max(a, max(b, c));
     }
 
     //! renvoye le centre de l'englobant du tiangle.
@@ -122,429 +140,4690 @@ struct Triangle
         bounds(pmin, pmax);
         return (pmin+pmax)/2;
     }
+};
 
-    /* calcule l'intersection ray/triangle
-        cf "fast, minimum storage ray-triangle intersection"
-        http://www.graphics.cornell.edu/pubs/1997/MT97.pdf
-
-        renvoie faux s'il n'y a pas d'intersection valide (une intersection peut exister mais peut ne pas se trouver dans l'intervalle [0 htmax] du rayon.)
-        renvoie vrai + les coordonnees barycentriques (u, v) du point d'intersection + sa position le long du rayon (t).
-        convention barycentrique : p(u, v)= (1 - u - v) * a + u * b + v * c
-    */
-    Hit intersect( const Ray &ray, const float htmax ) const
-    {
-        Vector pvec= cross(ray.d, e2);
-        float det= dot(e1, pvec);
-
-        float inv_det= 1 / det;
-        Vector tvec(p, ray.o);
-
-        float u= dot(tvec, pvec) * inv_det;
-        if(u < 0 || u > 1) return Hit();
-
-        Vector qvec= cross(tvec, e1);
-        float v= dot(ray.d, qvec) * inv_det;
-        if(v < 0 || u + v > 1) return Hit();
 
-        float t= dot(e2, qvec) * inv_det;
-        if(t > htmax || t < 0) return Hit();
+//! nombre de triangles testes ensemble dans une feuille, cf TriangleBlocks. nombre maximum de triangles par feuille.
+const int leaf_lanes= 8;
 
-        return Hit(id, t, u, v);           // p(u, v)= (1 - u - v) * a + u * b + v * c
-    }
+//! tests d'intersection rayon / triangle des feuilles, cf TriangleBlocks.
+enum TriangleTest
+{
+    TEST_MOLLER,        //!< moller-trumbore, a partir d'un sommet et des 2 aretes du triangle.
+    TEST_WATERTIGHT,    //!< test "etanche", pas de fissures entre les triangles qui partagent une arete, cf TriangleBlocks::intersect_watertight().
+    TEST_PLANE          //!< plans precalcules, cf TriangleBlocks::intersect_plane().
 };
 
+//! donnees de shading d'un triangle, 40 octets, cf ShadingTable.
+struct ShadingTriangle
+{
+    vec3 na, nb, nc;            //!< normales des sommets
+    int material;               //!< indice de la matiere, cf ShadingTable::materials
+};
 
-struct BVH
+/*! donnees de shading des triangles, comme Mesh::triangle() et Mesh::triangle_material(),
+    mais sans reconstruire les 96 octets de TriangleData, ni recalculer la normale geometrique des objets sans normales, a chaque intersection.
+    les triangles sont ranges dans l'ordre de l'arbre et indexes par Hit::triangle_id : les triangles d'une feuille, et des feuilles voisines,
+    sont proches dans la table, comme dans TriangleBlocks.
+    les coordonnees de texture sont rangees a part et ne sont lues que par les shaders qui les utilisent.
+ */
+struct ShadingTable
 {
-    std::vector<Triangle> triangles;
-    std::vector<Node> nodes;
-    int root;
+    std::vector<ShadingTriangle> triangles;
+    std::vector<vec2> texcoords;            //!< 3 par triangle
+    std::vector<vec4> colors;               //!< 3 par triangle, couleurs des sommets, vide si le mesh n'en a pas
+    std::vector<Material> materials;        //!< matieres du mesh, + une matiere par defaut pour les triangles sans matiere
 
-    BVH( ) : triangles(), nodes(), root(-1) {}
+    ShadingTable( ) = default;
+    ShadingTable( const Mesh& mesh, const std::vector<Triangle>& order ) { build(mesh, order); }
 
-    //! construit l'arbre avec les triangles de mesh.
-    void build( const Mesh& mesh )
+    //! construit la table, order : triangles de l'arbre, cf BVH::triangles.
+    void build( const Mesh& mesh, const std::vector<Triangle>& order )
     {
-        auto cpu_start= std::chrono::high_resolution_clock::now();
+        int n= int(order.size());
+        triangles.resize(n);
+        texcoords.resize(3 * n);
 
-        // recupere les triangles
-        for(int i= 0; i < mesh.triangle_count(); i++)
-        {
-            TriangleData triangle= mesh.triangle(i);
-            triangles.push_back( Triangle(triangle.a, triangle.b, triangle.c, i) );
-        }
+        materials= mesh.mesh_materials();
+        materials.push_back(Material());
+        const std::vector<unsigned int>& ids= mesh.materials();
 
-        // construit l'arbre
-        //~ root= build_node(0, triangles.size());
-        root= build_node_centroids(0, triangles.size());
+        const std::vector<vec4>& vertex_colors= mesh.colors();
+        const std::vector<unsigned int>& indices= mesh.indices();
+        bool use_colors= vertex_colors.size() > 0 && vertex_colors.size() == mesh.positions().size();
+        colors.resize(use_colors ? 3 * n : 0);
 
-        auto cpu_stop= std::chrono::high_resolution_clock::now();
-        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
-        printf("cpu  %ds %03dms\n", int(cpu_time / 1000), int(cpu_time % 1000));
+    #pragma omp parallel for schedule(static)
+        for(int i= 0; i < n; i++)
+        {
+            int id= order[i].id;        // indice du triangle dans le mesh
+            TriangleData data= mesh.triangle(id);
+            triangles[i].na= data.na;
+            triangles[i].nb= data.nb;
+            triangles[i].nc= data.nc;
+            triangles[i].material= (id < int(ids.size())) ? int(ids[id]) : int(materials.size()) -1;
+
+            texcoords[3*i]= data.ta;
+            texcoords[3*i +1]= data.tb;
+            texcoords[3*i +2]= data.tc;
+
+            if(use_colors)
+                for(int k= 0; k < 3; k++)
+                    colors[3*i + k]= vertex_colors[indices.size() > 0 ? indices[3*id + k] : 3*id + k];
+        }
     }
 
-    //! renvoie vrai si une intersection valide existe. la position de l'intersection *la plus proche* de l'origine du rayon est renvoyee dans hit.
-    Hit intersect( const Ray& ray ) const
+    //! renvoie la normale interpolee au point d'intersection, cf normal( hit, triangle ).
+    Vector normal( const Hit& hit ) const
     {
-        assert(root != -1);
+        const ShadingTriangle& triangle= triangles[hit.triangle_id];
+        return normalize((1 - hit.u - hit.v) * Vector(triangle.na) + hit.u * Vector(triangle.nb) + hit.v * Vector(triangle.nc));
+    }
 
-        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
-        Hit hit;
-        hit.t= ray.tmax;
-        intersect(root, ray, invd, hit);
-        return hit;
+    //! renvoie les coordonnees de texture interpolees au point d'intersection.
+    vec2 texcoord( const Hit& hit ) const
+    {
+        const vec2 *t= &texcoords[3 * hit.triangle_id];
+        float w= 1 - hit.u - hit.v;
+        return vec2(w * t[0].x + hit.u * t[1].x + hit.v * t[2].x, w * t[0].y + hit.u * t[1].y + hit.v * t[2].y);
     }
 
-     bool visible( const Ray& ray ) const
+    //! renvoie la matiere du triangle.
+    const Material& material( const Hit& hit ) const { return materials[triangles[hit.triangle_id].material]; }
+
+    //! renvoie la couleur des sommets interpolee au point d'intersection, ou blanc si le mesh n'a pas de couleurs.
+    Color color( const Hit& hit ) const
     {
+        if(colors.empty())
+            return White();
 
-            if(Hit hit= intersect(ray))
-                return false;
+        const vec4 *c= &colors[3 * hit.triangle_id];
+        float w= 1 - hit.u - hit.v;
+        return Color(w * c[0].x + hit.u * c[1].x + hit.v * c[2].x, w * c[0].y + hit.u * c[1].y + hit.v * c[2].y,
+            w * c[0].z + hit.u * c[1].z + hit.v * c[2].z, w * c[0].w + hit.u * c[1].w + hit.v * c[2].w);
+    }
+};
 
-        return true;
+/*! rayon prepare pour les tests des triangles des feuilles, une seule fois par rayon, cf BVH::intersect().
+    pour le test etanche : axe dominant de la direction (kz), et cisaillement qui transforme la direction en (0, 0, 1).
+ */
+struct LeafRay
+{
+    Point o;
+    Vector d;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    explicit LeafRay( const Ray& ray ) : o(ray.o), d(ray.d)
+    {
+        Vector a= Vector(std::abs(d.x), std::abs(d.y), std::abs(d.z));
+        kz= (a.x > a.y && a.x > a.z) ? 0 : (a.y > a.z) ? 1 : 2;
+        kx= (kz + 1) % 3;
+        ky= (kx + 1) % 3;
+        sx= d(kx) / d(kz);
+        sy= d(ky) / d(kz);
+        sz= 1 / d(kz);
     }
+};
 
-protected:
-    void intersect( const int index, const Ray& ray, const Vector& invd, Hit& hit ) const
+/*! triangles des feuilles, stockes par composantes (structure of arrays), dans l'ordre des triangles de l'arbre.
+    les triangles d'une feuille sont consecutifs et sont testes ensemble, leaf_lanes a la fois, sans branchement, ce que le compilateur vectorise.
+    les tableaux sont completes par leaf_lanes triangles degeneres, pour pouvoir lire leaf_lanes triangles a partir de n'importe quelle feuille.
+    seuls les tableaux utilises par le test choisi sont construits, cf TriangleTest.
+ */
+struct TriangleBlocks
+{
+    TriangleTest test;
+    std::vector<float> px, py, pz;          //!< sommet a
+    std::vector<float> e1x, e1y, e1z;       //!< aretes ab, ac, TEST_MOLLER
+    std::vector<float> e2x, e2y, e2z;
+    std::vector<float> bx, by, bz;          //!< sommets b, c, TEST_WATERTIGHT
+    std::vector<float> cx, cy, cz;
+    std::vector<float> nx, ny, nz, nd;      //!< plan du triangle, TEST_PLANE
+    std::vector<float> ux, uy, uz, ud;      //!< plans des coordonnees barycentriques u et v, TEST_PLANE
+    std::vector<float> vx, vy, vz, vd;
+
+    TriangleBlocks( ) : test(TEST_MOLLER) {}
+
+    //! recopie les triangles, dans le meme ordre, pour le test _test.
+    void build( const std::vector<Triangle>& triangles, const TriangleTest _test= TEST_MOLLER )
     {
-        const Node& node= nodes[index];
-        if(node.right < 0)
+        test= _test;
+        int n= int(triangles.size()) + leaf_lanes;
+        std::vector<float> *arrays[]= { &px, &py, &pz, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &bx, &by, &bz, &cx, &cy, &cz,
+            &nx, &ny, &nz, &nd, &ux, &uy, &uz, &ud, &vx, &vy, &vz, &vd };
+        for(std::vector<float> *array : arrays)
+            std::vector<float>().swap(*array);
+
+        px.assign(n, 0); py.assign(n, 0); pz.assign(n, 0);
+        if(test == TEST_MOLLER)
         {
-            // feuille
-            int begin= -node.left;
-            int end= -node.right;
-            for(int i= begin; i < end; i++)
-            {
-                // ne renvoie vrai que si l'intersection existe dans l'intervalle [0 tmax]
-                if(Hit h= triangles[i].intersect(ray, hit.t))
-                    hit= h;
-            }
+            e1x.assign(n, 0); e1y.assign(n, 0); e1z.assign(n, 0);
+            e2x.assign(n, 0); e2y.assign(n, 0); e2z.assign(n, 0);
+        }
+        else if(test == TEST_WATERTIGHT)
+        {
+            bx.assign(n, 0); by.assign(n, 0); bz.assign(n, 0);
+            cx.assign(n, 0); cy.assign(n, 0); cz.assign(n, 0);
         }
         else
-            // noeud interne
-            if(node.intersect(ray, invd, hit.t))
-            {
-            #if 0
-                // parcours simple
-                intersect(node.left, ray, invd, hit);
-                intersect(node.right, ray, invd, hit);
-            #else
-                // parcours ordonne
-                NodeHit left= nodes[node.left].intersect(ray, invd, hit.t);
-                NodeHit right= nodes[node.right].intersect(ray, invd, hit.t);
-
-                if(left && right)
-                {
-                    // les 2 fils sont touches par le rayon
-                    // rappel: visiter les feuilles en s'eloignant de l'origine du rayon.
-                    if(left.tmin < right.tmin)
-                    {
-                        // le fils gauche est plus pres
-                        intersect(node.left, ray, invd, hit);
-                        if(hit.t >= right.tmin)
-                            // pacourir le fils droit, si necessaire
-                            intersect(node.right, ray, invd, hit);
-                    }
-                    else
-                    {
-                        intersect(node.right, ray, invd, hit);
-                        if(hit.t >= left.tmin)
-                            intersect(node.left, ray, invd, hit);
-                    }
-                }
+        {
+            // les triangles de remplissage ont un plan nul, ils ne sont jamais touches
+            nx.assign(n, 0); ny.assign(n, 0); nz.assign(n, 0); nd.assign(n, 0);
+            ux.assign(n, 0); uy.assign(n, 0); uz.assign(n, 0); ud.assign(n, 0);
+            vx.assign(n, 0); vy.assign(n, 0); vz.assign(n, 0); vd.assign(n, 0);
+        }
+
+        #pragma omp parallel for schedule(static)
+        for(int i= 0; i < int(triangles.size()); i++)
+        {
+            const Triangle& triangle= triangles[i];
+            const Point& a= triangle.a;
+            px[i]= a.x; py[i]= a.y; pz[i]= a.z;
 
-                // 1 seul fils est touche par le rayon
-                else if(left)
-                    intersect(node.left, ray, invd, hit);
-                else if(right)
-                    intersect(node.right, ray, invd, hit);
-            #endif
+            Vector e1(a, triangle.b);
+            Vector e2(a, triangle.c);
+            if(test == TEST_MOLLER)
+            {
+                e1x[i]= e1.x; e1y[i]= e1.y; e1z[i]= e1.z;
+                e2x[i]= e2.x; e2y[i]= e2.y; e2z[i]= e2.z;
+            }
+            else if(test == TEST_WATERTIGHT)
+            {
+                bx[i]= triangle.b.x; by[i]= triangle.b.y; bz[i]= triangle.b.z;
+                cx[i]= triangle.c.x; cy[i]= triangle.c.y; cz[i]= triangle.c.z;
             }
+            else
+            {
+                // plan du triangle, et plans qui donnent u et v, distance signee au plan divisee par la hauteur du triangle
+                Vector n= cross(e1, e2);
+                float n2= dot(n, n);
+                if(n2 == 0)
+                    continue;   // triangle degenere, garde des plans nuls
+
+                Vector u= cross(e2, n) / n2;
+                Vector v= cross(n, e1) / n2;
+                nx[i]= n.x; ny[i]= n.y; nz[i]= n.z; nd[i]= dot(n, Vector(a));
+                ux[i]= u.x; uy[i]= u.y; uz[i]= u.z; ud[i]= -dot(u, Vector(a));
+                vx[i]= v.x; vy[i]= v.y; vz[i]= v.z; vd[i]= -dot(v, Vector(a));
+            }
+        }
     }
 
-    int build_node( const int begin, const int end )
+    /*! teste les leaf_lanes triangles a partir de begin, avec le test choisi par build().
+        renvoie t[k] >= 0 si le rayon touche le triangle begin+k dans l'intervalle [0 htmax], et ses coordonnees barycentriques u[k], v[k]. t[k] < 0 sinon.
+        convention barycentrique : p(u, v)= (1 - u - v) * a + u * b + v * c, pour tous les tests.
+     */
+    void intersect( const int begin, const int end, const LeafRay& ray, const float htmax, float *t, float *u, float *v ) const
     {
-        // solution 2 : trier les triangles sur l'axe le plus etire de l'englobant
-            // construire l'englobant des 2 moities des triangles
-            // 1. construire l'englobant
-            // 2. trouver l'axe le plus etire de l'englobant
-            // 3. trier les triangles sur l'axe
-            // 4. fils gauche = 1ere moitiee des triangles et fils droit = 2ieme moitiee des triangles
-            // 5. construire les 2 fils
+        if(test == TEST_WATERTIGHT)
+            intersect_watertight(begin, end, ray, htmax, t, u, v);
+        else if(test == TEST_PLANE)
+            intersect_plane(begin, end, ray, htmax, t, u, v);
+        else
+            intersect_moller(begin, end, ray, htmax, t, u, v);
+    }
 
-        // construire l'englobant des triangles
-        Point bmin, bmax;
-        bounds(begin, end, bmin, bmax);
+    /*! moller-trumbore, cf "fast, minimum storage ray-triangle intersection"
+        http://www.graphics.cornell.edu/pubs/1997/MT97.pdf
+        convention barycentrique : p(u, v)= (1 - u - v) * a + u * b + v * c
+     */
+    void intersect_moller( const int begin, const int end, const LeafRay& ray, const float htmax, float *t, float *u, float *v ) const
+    {
+        const int n= end - begin;
+        assert(n <= leaf_lanes);
 
-        // construire une feuille, s'il ne reste plus qu'un triangle
-        if(end - begin < 2)
+        const float ox= ray.o.x, oy= ray.o.y, oz= ray.o.z;
+        const float dx= ray.d.x, dy= ray.d.y, dz= ray.d.z;
+        const float *ppx= px.data() + begin, *ppy= py.data() + begin, *ppz= pz.data() + begin;
+        const float *pe1x= e1x.data() + begin, *pe1y= e1y.data() + begin, *pe1z= e1z.data() + begin;
+        const float *pe2x= e2x.data() + begin, *pe2y= e2y.data() + begin, *pe2z= e2z.data() + begin;
+
+        for(int k= 0; k < leaf_lanes; k++)
         {
-            int index= int(nodes.size());
-            nodes.push_back( {bmin, bmax, -begin, -end} );
+            // pvec= cross(ray.d, e2)
+            float pvx= dy * pe2z[k] - dz * pe2y[k];
+            float pvy= dz * pe2x[k] - dx * pe2z[k];
+            float pvz= dx * pe2y[k] - dy * pe2x[k];
+            float det= pe1x[k] * pvx + pe1y[k] * pvy + pe1z[k] * pvz;
+            float inv_det= 1 / det;
+
+            // tvec= ray.o - p
+            float tx= ox - ppx[k];
+            float ty= oy - ppy[k];
+            float tz= oz - ppz[k];
+            float uk= (tx * pvx + ty * pvy + tz * pvz) * inv_det;
+
+            // qvec= cross(tvec, e1)
+            float qx= ty * pe1z[k] - tz * pe1y[k];
+            float qy= tz * pe1x[k] - tx * pe1z[k];
+            float qz= tx * pe1y[k] - ty * pe1x[k];
+            float vk= (dx * qx + dy * qy + dz * qz) * inv_det;
+            float tk= (pe2x[k] * qx + pe2y[k] * qy + pe2z[k] * qz) * inv_det;
+
+            // les triangles degeneres, paralleles au rayon, et les triangles apres end sont rejetes, les comparaisons avec nan sont fausses
+            bool valid= (k < n) & (det != 0) & (uk >= 0) & (uk <= 1) & (vk >= 0) & (uk + vk <= 1) & (tk >= 0) & (tk <= htmax);
+            t[k]= valid ? tk : -1;
+            u[k]= uk;
+            v[k]= vk;
+        }
+    }
 
-            /* triche un peu avec la representation du noeud pour stocker une feuille
-                au lieu de declarer begin et end dans la structure noeud (ou utiliser 2 structures differentes ?), reutilise left et right,
+    /*! test etanche, cf "Watertight Ray/Triangle Intersection", S. Woop, C. Benthin, I. Wald, 2013
+        http://jcgt.org/published/0002/01/05/
+        les sommets sont translates sur l'origine du rayon et cisailles pour que le rayon soit l'axe z, les coordonnees barycentriques sont
+        les aires signees des aretes, calculees exactement de la meme maniere pour les 2 triangles qui partagent une arete : un rayon qui passe
+        sur l'arete touche au moins un des 2 triangles.
+        (le test complet recalcule les aires nulles en double precision, ce n'est pas necessaire ici : une aire nulle est consideree a l'interieur.)
+        les aires doivent etre calculees sans fma : fma(cx, by, -cy*bx) n'est pas l'oppose de fma(bx, cy, -by*cx), ce qui suffit a creer des fissures.
+     */
+#if defined(__GNUC__) && !defined(__clang__)
+    __attribute__((optimize("fp-contract=off")))
+#endif
+    void intersect_watertight( const int begin, const int end, const LeafRay& ray, const float htmax, float *t, float *u, float *v ) const
+    {
+    #ifdef __clang__
+        #pragma clang fp contract(off)
+    #endif
+        const int n= end - begin;
+        assert(n <= leaf_lanes);
+
+        // composantes des sommets dans l'ordre kx, ky, kz du rayon
+        const std::vector<float> *a[3]= { &px, &py, &pz };
+        const std::vector<float> *b[3]= { &bx, &by, &bz };
+        const std::vector<float> *c[3]= { &cx, &cy, &cz };
+        const float *pax= a[ray.kx]->data() + begin, *pay= a[ray.ky]->data() + begin, *paz= a[ray.kz]->data() + begin;
+        const float *pbx= b[ray.kx]->data() + begin, *pby= b[ray.ky]->data() + begin, *pbz= b[ray.kz]->data() + begin;
+        const float *pcx= c[ray.kx]->data() + begin, *pcy= c[ray.ky]->data() + begin, *pcz= c[ray.kz]->data() + begin;
+        const float ox= ray.o(ray.kx), oy= ray.o(ray.ky), oz= ray.o(ray.kz);
+        const float sx= ray.sx, sy= ray.sy, sz= ray.sz;
+
+        for(int k= 0; k < leaf_lanes; k++)
+        {
+            // sommets dans le repere du rayon
+            float az= paz[k] - oz;
+            float bz= pbz[k] - oz;
+            float cz= pcz[k] - oz;
+            float ax= (pax[k] - ox) - sx * az;
+            float ay= (pay[k] - oy) - sy * az;
+            float bx= (pbx[k] - ox) - sx * bz;
+            float by= (pby[k] - oy) - sy * bz;
+            float cx= (pcx[k] - ox) - sx * cz;
+            float cy= (pcy[k] - oy) - sy * cz;
+
+            // aires signees des aretes, le rayon est a l'interieur si elles sont toutes de meme signe
+            float U= cx * by - cy * bx;
+            float V= ax * cy - ay * cx;
+            float W= bx * ay - by * ax;
+            bool inside= ((U >= 0) & (V >= 0) & (W >= 0)) | ((U <= 0) & (V <= 0) & (W <= 0));
+
+            float det= U + V + W;
+            float T= (U * az + V * bz + W * cz) * sz;
+            float inv_det= 1 / det;
+            float tk= T * inv_det;
+
+            bool valid= (k < n) & inside & (det != 0) & (tk >= 0) & (tk <= htmax);
+            t[k]= valid ? tk : -1;
+            u[k]= V * inv_det;
+            v[k]= W * inv_det;
+        }
+    }
 
-                mais il faut pourvoir faire la difference entre les 2 cas (noeud / feuille) :
-                if(node.right < 0)
-                    // feuille
-                else
-                    // noeud
+    /*! plans precalcules, cf "Yet Faster Ray-Triangle Intersection (Using SSE4)", J. Havel, A. Herout, 2010
+        https://ieeexplore.ieee.org/document/5159348
+        intersection avec le plan du triangle, puis u et v sont les distances signees du point aux plans des aretes ac et ab, pas de produits vectoriels.
+        12 floats par triangle au lieu de 9, mais moins de calculs.
+     */
+    void intersect_plane( const int begin, const int end, const LeafRay& ray, const float htmax, float *t, float *u, float *v ) const
+    {
+        const int n= end - begin;
+        assert(n <= leaf_lanes);
 
-                question: if(node.left < 0) ne fonctionne pas pour detecter une feuille, pourquoi ?
-             */
+        const float ox= ray.o.x, oy= ray.o.y, oz= ray.o.z;
+        const float dx= ray.d.x, dy= ray.d.y, dz= ray.d.z;
+        const float *pnx= nx.data() + begin, *pny= ny.data() + begin, *pnz= nz.data() + begin, *pnd= nd.data() + begin;
+        const float *pux= ux.data() + begin, *puy= uy.data() + begin, *puz= uz.data() + begin, *pud= ud.data() + begin;
+        const float *pvx= vx.data() + begin, *pvy= vy.data() + begin, *pvz= vz.data() + begin, *pvd= vd.data() + begin;
 
-            return index;
+        for(int k= 0; k < leaf_lanes; k++)
+        {
+            float det= pnx[k] * dx + pny[k] * dy + pnz[k] * dz;
+            float dist= pnd[k] - (pnx[k] * ox + pny[k] * oy + pnz[k] * oz);
+            float tk= dist / det;
+
+            // point d'intersection avec le plan
+            float hx= ox + tk * dx;
+            float hy= oy + tk * dy;
+            float hz= oz + tk * dz;
+            float uk= pux[k] * hx + puy[k] * hy + puz[k] * hz + pud[k];
+            float vk= pvx[k] * hx + pvy[k] * hy + pvz[k] * hz + pvd[k];
+
+            bool valid= (k < n) & (uk >= 0) & (vk >= 0) & (uk + vk <= 1) & (tk >= 0) & (tk <= htmax);
+            t[k]= valid ? tk : -1;
+            u[k]= uk;
+            v[k]= vk;
         }
+    }
 
-        // axe le plus etire de l'englobant
-        int axis= bounds_max(bmin, bmax);
+    //! renvoie l'intersection la plus proche avec les triangles [begin .. end[ dans l'intervalle [0 htmax].
+    Hit intersect( const int begin, const int end, const LeafRay& ray, const float htmax ) const
+    {
+        float t[leaf_lanes], u[leaf_lanes], v[leaf_lanes];
+        intersect(begin, end, ray, htmax, t, u, v);
 
-        // trier les triangles sur l'axe
-        std::sort(triangles.data() + begin, triangles.data() + end, triangle_less(axis));
+        Hit hit;
+        float tmax= htmax;
+        for(int k= 0; k < leaf_lanes; k++)
+            if(t[k] >= 0 && t[k] <= tmax)
+            {
+                hit= Hit(begin + k, t[k], u[k], v[k]);
+                tmax= t[k];
+            }
+        return hit;
+    }
 
-        // construire les fils du noeud
-        int left= build_node(begin, (begin+end) / 2);
-        int right= build_node((begin+end) / 2, end);
+    //! renvoie vrai si un des triangles [begin .. end[ est sur le rayon, dans l'intervalle [0 htmax].
+    bool occluded( const int begin, const int end, const LeafRay& ray, const float htmax ) const
+    {
+        float t[leaf_lanes], u[leaf_lanes], v[leaf_lanes];
+        intersect(begin, end, ray, htmax, t, u, v);
 
-        // construire le noeud
-        int index= nodes.size();
-        nodes.push_back( {bmin, bmax, left, right} );
-        return index;
+        bool occluded= false;
+        for(int k= 0; k < leaf_lanes; k++)
+            occluded= occluded | (t[k] >= 0);
+        return occluded;
     }
+};
 
-    int build_node_centroids( const int begin, const int end )
-    {
-        // solution 1 : couper l'englobant en 2 sur l'axe le plus etire
-            // 1. construire l'englobant
-            // 2. trouver l'axe le plus etire
-            // 3. repartir les triangles dans chaque moitiee de l'englobant
-            // 4. fils gauche = triangles dans la 1ere moitiee de l'englobant et fils droit = triangles dans la 2ieme moitiee de l'englobant
-            // 5. construire les 2 fils
 
-            // comment repartir les triangles a cheval sur les 2 boites ?
-            // solution : un seul point des triangles est teste pour la repartition, le centre de l'englobant, ce qui elimine l'ambiguite.
+//! aire de l'englobant pmin, pmax, cf evaluation du cout SAH de l'arbre.
+float node_area( const Point& pmin, const Point& pmax )
+{
+    Vector d(pmin, pmax);
+    return 2 * d.x*d.y + 2 * d.x*d.z + 2 * d.y*d.z;
+}
 
-            // consequence indirecte : il n'est plus necessaire de trier les triangles / centres pour les repartir entre les 2 moitiees de l'englobant
-            // on aurait pu ecrire :
-                // trier les centres des triangles (sur un axe)
-                // trouver les n premiers triangles dont les centres sont dans la moitiee gauche de l'englobant
-            // mais on peut obtenir le meme resultat directement en parcourant 1 fois l'ensemble de triangles, sans faire le tri
-            // c'est ce que fait std::partition()
-            // et cette solution est plus rapide : partiton en O(n), tri en O(n log n)
+//! strategies de construction de l'arbre, cf BVH::build().
+enum BVHBuilder
+{
+    BUILD_SORT,         //!< tri des triangles sur l'axe le plus etire, coupe au milieu des triangles.
+    BUILD_CENTROIDS,    //!< coupe l'englobant des centres au milieu de l'axe le plus etire.
+    BUILD_SAH,          //!< repartition de cout minimal (SAH), evaluee sur quelques cellules par axe.
+    BUILD_LBVH,         //!< tri des centres sur une courbe de morton, codes 63 bits, construction lineaire.
+    BUILD_LBVH30        //!< idem, codes 30 bits, tri plus rapide, mais plus de centres confondus.
+};
 
-        // construire l'englobant des triangles, pour initialiser le noeud / la feuille
-        Point bmin, bmax;
-        bounds(begin, end, bmin, bmax);
+/*! profondeur maximum des arbres, cf BVH::tree_depth(). les parcours utilisent des piles de taille fixe, dimensionnees pour cette profondeur,
+    un arbre plus profond est reconstruit, cf BVH::build(), ou n'est pas relu, cf BVH::read_cache().
+ */
+const int max_tree_depth= 48;
 
-        // construire l'englobant des centres des triangles, pour repartir les triangles
-        Point cmin, cmax;
-        centroid_bounds(begin, end, cmin, cmax);
+//! taille de la pile utilisee par BVH::intersect() et BVH::visible() : au plus 1 noeud en attente par niveau, + les 2 fils du noeud courant.
+const int visible_stack_size= max_tree_depth + 2;
 
-        // construire une feuille, s'il ne reste plus qu'un triangle
-        if(end - begin < 2)
-        {
-            int index= int(nodes.size());
-            nodes.push_back( {bmin, bmax, -begin, -end} );
-            return index;
-        }
+//! compteurs de tests, cf BVH::intersect() et BVH::visible().
+struct TraversalStats
+{
+    long long nodes;        //!< nombre de tests rayon / englobant
+    long long triangles;    //!< nombre de tests rayon / triangle
+    long long bytes;        //!< nombre d'octets de noeuds lus
 
-        // axe le plus etire de l'englobant des centres
-        int axis= bounds_max(cmin, cmax);
+    TraversalStats( ) : nodes(0), triangles(0), bytes(0) {}
+};
 
-        // repartir les triangles par rapport au milieu de l'englobant des centres
-        auto *p= std::partition(triangles.data() + begin, triangles.data() + end, centroid_less1(axis, (cmax(axis)+cmin(axis)) / 2));
-        int m= std::distance(triangles.data(), p);
-        assert(m != begin);
-        assert(m != end);
+//! nombre de cellules par axe utilisees par build_node_sah() pour evaluer les repartitions.
+const int sah_bins= 16;
+//! nombre de feuilles des treelets, cf BVH::optimize_treelets().
+const int treelet_size= 7;
+//! profondeur des sous arbres optimises en parallele, cf BVH::optimize_treelets().
+const int treelet_parallel_depth= 8;
+//! nombre minimum de triangles d'un noeud pour le construire en parallele, cf BVH::build_node_sah().
+const int parallel_build_min= 16 * 1024;
+//! cout du test d'un triangle, relatif au cout du test d'un englobant. les triangles d'une feuille sont testes ensemble, cf TriangleBlocks.
+const float sah_triangle_cost= 0.2f;
+
+//! cellule utilisee par build_node_sah() : nombre de triangles et englobant des triangles.
+struct Bin
+{
+    Point bmin, bmax;
+    int n;
 
-        // construire les fils du noeud
-        int left= build_node(begin, m);
-        int right= build_node(m, end);
+    Bin( ) : bmin(FLT_MAX, FLT_MAX, FLT_MAX), bmax(-FLT_MAX, -FLT_MAX, -FLT_MAX), n(0) {}
 
-        // construire le noeud
-        int index= int(nodes.size());
-        nodes.push_back( {bmin, bmax, left, right} );
-        return index;
+    void insert( const Point& pmin, const Point& pmax )
+    {
+        bmin= min(bmin, pmin);
+        bmax= max(bmax, pmax);
+        n++;
     }
 
-// utilitaires
-    //! renvoie l'englobant des triangles[begin .. end[
-    void bounds( const int begin, const int end, Point& bmin, Point& bmax )
+    void insert( const Bin& bin )
     {
-        triangles[begin].bounds(bmin, bmax);
-        for(int i= begin +1; i < end; i++)
-        {
-            Point pmin, pmax;
-            triangles[i].bounds(pmin, pmax);
+        if(bin.n == 0) return;
+        bmin= min(bmin, bin.bmin);
+        bmax= max(bmax, bin.bmax);
+        n+= bin.n;
+    }
 
-            bmin= min(bmin, pmin);
-            bmax= max(bmax, pmax);
-        }
+    float area( ) const { return (n > 0) ? node_area(bmin, bmax) : 0; }
+};
+
+//! hash FNV-1a 64 bits de size octets, a partir de hash, pour identifier le contenu d'un fichier, cf BVH::read_cache().
+uint64_t hash_bytes( const void *data, const size_t size, uint64_t hash= 0xcbf29ce484222325ull )
+{
+    const unsigned char *bytes= (const unsigned char *) data;
+    for(size_t i= 0; i < size; i++)
+    {
+        hash^= bytes[i];
+        hash*= 0x100000001b3ull;
     }
+    return hash;
+}
 
-    //! renvoie l'englobant des centres des triangles[begin .. end[
-    void centroid_bounds( const int begin, const int end, Point& bmin, Point& bmax )
+//! renvoie le hash du contenu d'un fichier, ou 0 si le fichier n'existe pas.
+uint64_t hash_file( const char *filename )
+{
+    MappedFile file(filename);
+    if(!file)
+        return 0;
+
+    // 8 sequences independantes, plus rapide qu'une seule longue chaine de multiplications
+    const size_t n= file.size / 8;
+    uint64_t lanes[8];
+    #pragma omp parallel for schedule(static)
+    for(int k= 0; k < 8; k++)
+        lanes[k]= hash_bytes(file.data + k * n, n, 0xcbf29ce484222325ull + k);
+
+    uint64_t hash= hash_bytes(lanes, sizeof(lanes));
+    hash= hash_bytes(file.data + 8 * n, file.size - 8 * n, hash);    // derniers octets
+    return hash_bytes(&file.size, sizeof(file.size), hash);
+}
+
+/*! paquet de N rayons, N= 4, 8 ou 16, stockes par composantes, cf BVH::intersect(RayPacket&) et BVH::visible(RayPacket&).
+    les rayons d'un paquet doivent etre coherents (meme origine, directions proches) pour que le parcours en paquet soit efficace.
+ */
+template< int N >
+struct RayPacket
+{
+    float ox[N], oy[N], oz[N];
+    float dx[N], dy[N], dz[N];
+    float ix[N], iy[N], iz[N];  //!< inverses des directions
+    float tmax[N];
+    int count;                  //!< nombre de rayons du paquet
+    Hit hits[N];                //!< intersections, cf BVH::intersect(RayPacket&)
+    int occluded;               //!< masque des rayons occultes, cf BVH::visible(RayPacket&)
+
+    RayPacket( ) : count(0), occluded(0)
     {
-        Point pm= triangles[begin].centroid();
-        bmin= pm;
-        bmax= pm;
-        for(int i= begin +1; i < end; i++)
+        // les rayons absents ne touchent rien
+        for(int k= 0; k < N; k++)
         {
-            Point pm= triangles[i].centroid();
-            bmin= min(bmin, pm);
-            bmax= max(bmax, pm);
+            ox[k]= 0; oy[k]= 0; oz[k]= 0;
+            dx[k]= 1; dy[k]= 1; dz[k]= 1;
+            ix[k]= 1; iy[k]= 1; iz[k]= 1;
+            tmax[k]= -1;
         }
     }
 
-    //! renvoie l'axe le plus etire d'un englobant
-    int bounds_max( const Point& pmin, const Point& pmax )
+    //! ajoute un rayon au paquet.
+    void push( const Ray& ray )
     {
-        Vector d= pmax - pmin;
-        if(d.x > d.y && d.x > d.z) return 0;
-        else if(d.y > d.z) return 1;
-        else  return 2;
+        assert(count < N);
+        int k= count++;
+        ox[k]= ray.o.x; oy[k]= ray.o.y; oz[k]= ray.o.z;
+        dx[k]= ray.d.x; dy[k]= ray.d.y; dz[k]= ray.d.z;
+        ix[k]= 1 / ray.d.x; iy[k]= 1 / ray.d.y; iz[k]= 1 / ray.d.z;
+        tmax[k]= ray.tmax;
     }
 
-    //! comparaison de 2 triangles, cf build_node, std::sort
-    struct triangle_less
+    //! renvoie le rayon k.
+    Ray ray( const int k ) const
     {
-        int axis;
-        triangle_less( const int _axis ) : axis(_axis) {}
-
-        bool operator() ( const Triangle& a, const Triangle& b ) const
-        {
-            Point apmin, apmax;
-            a.bounds(apmin, apmax);
+        Ray ray(Point(ox[k], oy[k], oz[k]), Vector(dx[k], dy[k], dz[k]));
+        ray.tmax= tmax[k];
+        return ray;
+    }
 
-            Point bpmin, bpmax;
-            b.bounds(bpmin, bpmax);
+    float direction( const int k, const int axis ) const { return (axis == 0) ? dx[k] : (axis == 1) ? dy[k] : dz[k]; }
+};
 
-            if(apmin(axis) < bpmin(axis)) return true;
-            else if(apmin(axis) == bpmin(axis)) return apmax(axis) < bpmax(axis);
-            return false;
-        }
-    };
+//! compteurs des parcours de paquets : noeuds visites, rayons actifs dans ces noeuds, sous arbres termines rayon par rayon.
+struct PacketStats
+{
+    long long packets;
+    long long nodes;
+    long long active;
+    long long fallbacks;
 
-    //! position d'un triangle, cf build_centroids, std::partition
-    struct centroid_less1
-    {
-        int axis;
-        float cut;
+    PacketStats( ) : packets(0), nodes(0), active(0), fallbacks(0) {}
+};
 
-        centroid_less1( const int _axis, const float _cut ) : axis(_axis), cut(_cut) {}
+//! debut de l'entete des fichiers cache, .bvh et .ao, cf read_cache_file() et write_cache_file().
+struct CacheHeader
+{
+    char magic[8];              //!< type du fichier, "gkitbvh" ou "gkitao"
+    uint32_t version;           //!< version du format, et de la representation des donnees
+    uint32_t header_size;       //!< taille de l'entete complete
+    uint64_t key;               //!< identifiant du contenu du fichier obj et des parametres du calcul
+};
+
+//! bloc de donnees d'un fichier cache, cf write_cache_file().
+struct CacheBlock
+{
+    const void *data;
+    size_t size;                //!< taille en octets
+};
+
+/*! verifie l'entete d'un fichier cache projete en memoire et la copie dans header. Header commence par un CacheHeader.
+    renvoie les data_size octets qui suivent l'entete, ou nullptr si le fichier ne correspond pas a magic, version et key.
+ */
+template< typename Header >
+const unsigned char *read_cache_file( const MappedFile& file, const char (&magic)[8], const uint32_t version, const uint64_t key,
+    Header& header, size_t& data_size )
+{
+    if(!file || file.size < sizeof(Header))
+        return nullptr;
+
+    memcpy(&header, file.data, sizeof(Header));
+    const CacheHeader& cache= header.cache;
+    if(memcmp(cache.magic, magic, sizeof(cache.magic)) != 0 || cache.version != version || cache.header_size != sizeof(Header) || cache.key != key)
+        return nullptr;
+
+    data_size= file.size - sizeof(Header);
+    return file.data + sizeof(Header);
+}
+
+/*! ecrit un fichier cache : l'entete, completee par magic, version et key, puis les blocs de donnees.
+    le fichier est ecrit dans un fichier temporaire, puis renomme : un fichier incomplet ne peut pas etre relu.
+ */
+template< typename Header >
+bool write_cache_file( const char *filename, Header header, const char (&magic)[8], const uint32_t version, const uint64_t key,
+    const std::vector<CacheBlock>& blocks )
+{
+    CacheHeader& cache= header.cache;
+    memcpy(cache.magic, magic, sizeof(cache.magic));
+    cache.version= version;
+    cache.header_size= sizeof(Header);
+    cache.key= key;
+
+    std::string tmp= std::string(filename) + ".tmp";
+    FILE *out= fopen(tmp.c_str(), "wb");
+    if(out == nullptr)
+    {
+        printf("[cache] can't write '%s'...\n", filename);
+        return false;
+    }
+
+    bool ok= fwrite(&header, sizeof(header), 1, out) == 1;
+    for(const CacheBlock& block : blocks)
+        ok= ok && (block.size == 0 || fwrite(block.data, block.size, 1, out) == 1);
+    ok= (fclose(out) == 0) && ok;
+
+    remove(filename);
+    if(!ok || rename(tmp.c_str(), filename) != 0)
+    {
+        remove(tmp.c_str());
+        printf("[cache] can't write '%s'...\n", filename);
+        return false;
+    }
+
+    printf("[cache] wrote '%s'\n", filename);
+    return true;
+}
+
+//! entete des fichiers .bvh, cf BVH::write_cache().
+struct BVHCacheHeader
+{
+    CacheHeader cache;          //!< "gkitbvh", et cle du fichier obj et des parametres de construction
+    uint32_t node_size;
+    uint32_t triangle_size;
+    int32_t root;
+    uint64_t node_count;
+    uint64_t triangle_count;
+};
+
+const char bvh_cache_magic[8]= "gkitbvh";
+const uint32_t bvh_cache_version= 3;
+
+
+struct BVH
+{
+    std::vector<Triangle> triangles;
+    std::vector<Node> nodes;
+    TriangleBlocks blocks;      //!< triangles des feuilles, par composantes, cf intersect() et visible().
+    int root;
+    int depth;                  //!< profondeur de l'arbre, au plus max_tree_depth, cf tree_depth().
+    int max_leaf;               //!< nombre maximum de triangles par feuille, entre 1 et leaf_lanes, cf build_node_sah().
+    int treelet_passes;         //!< nombre de passes d'optimisation des treelets apres une construction lbvh, cf optimize_treelets().
+    TriangleTest triangle_test; //!< test rayon / triangle des feuilles, cf TriangleBlocks.
+
+    BVH( const int _max_leaf= leaf_lanes ) : triangles(), nodes(), blocks(), root(-1), depth(-1), max_leaf(std::max(1, std::min(_max_leaf, leaf_lanes))), treelet_passes(0), triangle_test(TEST_MOLLER) {}
+
+    //! construit l'arbre avec les triangles de mesh.
+    void build( const Mesh& mesh, const BVHBuilder builder= BUILD_SAH )
+    {
+        auto cpu_start= std::chrono::high_resolution_clock::now();
+
+        // recupere les triangles
+        triangles.resize(mesh.triangle_count());
+        #pragma omp parallel for schedule(static)
+        for(int i= 0; i < mesh.triangle_count(); i++)
+        {
+            TriangleData triangle= mesh.triangle(i);
+            triangles[i]= Triangle(triangle.a, triangle.b, triangle.c, i);
+        }
+
+        // un arbre sans triangles reste vide, root= -1 : il ne peut pas etre parcouru
+        nodes.clear();
+        root= -1;
+        depth= -1;
+        if(triangles.empty())
+        {
+            printf("[error] no triangles, empty tree...\n");
+            return;
+        }
+
+        // construit l'arbre
+        if(builder == BUILD_SORT)
+            root= build_node(0, triangles.size());
+        else if(builder == BUILD_CENTROIDS)
+            root= build_node_centroids(0, triangles.size());
+        else if(builder == BUILD_LBVH || builder == BUILD_LBVH30)
+        {
+            root= build_lbvh(builder == BUILD_LBVH30 ? 10 : 21);
+            for(int i= 0; i < treelet_passes; i++)
+                optimize_treelets();
+        }
+        else
+        {
+            // les taches openMP de build_node_sah() sont executees par les threads de la region parallele
+            std::vector<Node> tree;
+            #pragma omp parallel
+            #pragma omp single
+            root= build_node_sah(0, triangles.size(), tree);
+            nodes.swap(tree);
+        }
+
+        // les parcours utilisent des piles de taille fixe, cf max_tree_depth. un arbre trop profond est reconstruit en coupant
+        // au milieu des triangles, sa profondeur est log2(n)
+        depth= tree_depth();
+        if(depth < 0 || depth > max_tree_depth)
+        {
+            printf("[warning] tree depth %d > %d, rebuilding with sort...\n", depth, max_tree_depth);
+            nodes.clear();
+            root= build_node(0, triangles.size());
+            depth= tree_depth();
+        }
+        assert(depth >= 0 && depth <= max_tree_depth);
+
+        // range les triangles des feuilles par composantes
+        blocks.build(triangles, triangle_test);
+        build_links();
+
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("cpu  %ds %03dms\n", int(cpu_time / 1000), int(cpu_time % 1000));
+    }
+
+    /*! verifie la structure de l'arbre : indices des fils et des triangles des feuilles, chaque noeud n'est visite qu'une fois.
+        renvoie la profondeur de l'arbre, le nombre de noeuds internes entre la racine et la feuille la plus profonde, ou -1 si l'arbre n'est pas valide.
+     */
+    int tree_depth( ) const
+    {
+        if(root < 0 || root >= int(nodes.size()))
+            return -1;
+
+        int depth= 0;
+        int visits= 0;
+        std::vector<std::pair<int, int>> stack;     // indice du noeud, profondeur
+        stack.push_back( std::make_pair(root, 0) );
+        while(!stack.empty())
+        {
+            std::pair<int, int> entry= stack.back();
+            stack.pop_back();
+            if(++visits > int(nodes.size()))
+                return -1;      // noeud partage par plusieurs parents, ou cycle
+
+            const Node& node= nodes[entry.first];
+            if(node.right < 0)
+            {
+                // feuille
+                int begin= -node.left;
+                int end= -node.right;
+                if(begin < 0 || begin > end || end > int(triangles.size()) || end - begin > leaf_lanes)
+                    return -1;
+                depth= std::max(depth, entry.second);
+            }
+            else
+            {
+                if(node.left < 0 || node.left >= int(nodes.size()) || node.right >= int(nodes.size()))
+                    return -1;
+                stack.push_back( std::make_pair(node.left, entry.second +1) );
+                stack.push_back( std::make_pair(node.right, entry.second +1) );
+            }
+        }
+
+        return depth;
+    }
+
+    /*! relit un arbre sauvegarde par write_cache(), renvoie faux si le fichier n'existe pas ou s'il ne correspond pas a key.
+        key identifie le contenu du fichier obj et les parametres de construction, cf main().
+     */
+    bool read_cache( const char *filename, const uint64_t key, const int triangle_count )
+    {
+        auto cpu_start= std::chrono::high_resolution_clock::now();
+
+        MappedFile file(filename);
+        if(!file)
+            return false;
+
+        BVHCacheHeader header;
+        size_t size= 0;
+        const unsigned char *data= read_cache_file(file, bvh_cache_magic, bvh_cache_version, key, header, size);
+        if(data == nullptr
+        || header.node_size != sizeof(Node) || header.triangle_size != sizeof(Triangle)
+        || header.triangle_count != uint64_t(triangle_count)
+        || header.node_count == 0 || header.root < 0 || uint64_t(header.root) >= header.node_count
+        || size != header.node_count * sizeof(Node) + header.triangle_count * sizeof(Triangle))
+        {
+            printf("[cache] '%s' is stale, rebuilding...\n", filename);
+            return false;
+        }
+
+        nodes.resize(header.node_count);
+        memcpy(nodes.data(), data, header.node_count * sizeof(Node));
+        data+= header.node_count * sizeof(Node);
+        triangles.resize(header.triangle_count);
+        memcpy((void *) triangles.data(), data, header.triangle_count * sizeof(Triangle));
+        root= header.root;
+
+        // le fichier peut etre corrompu : verifie les indices et la profondeur de l'arbre avant de le parcourir
+        bool valid= true;
+        for(int i= 0; i < int(triangles.size()); i++)
+            valid= valid && triangles[i].id >= 0 && triangles[i].id < triangle_count;
+        depth= tree_depth();
+        if(!valid || depth < 0 || depth > max_tree_depth)
+        {
+            printf("[cache] '%s' is invalid, rebuilding...\n", filename);
+            nodes.clear();
+            triangles.clear();
+            root= -1;
+            depth= -1;
+            return false;
+        }
+
+        blocks.build(triangles, triangle_test);
+        build_links();
+
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("[cache] read '%s', cpu  %ds %03dms\n", filename, int(cpu_time / 1000), int(cpu_time % 1000));
+        return true;
+    }
+
+    //! sauvegarde les noeuds et les triangles de l'arbre, cf read_cache().
+    bool write_cache( const char *filename, const uint64_t key ) const
+    {
+        BVHCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        header.node_size= sizeof(Node);
+        header.triangle_size= sizeof(Triangle);
+        header.root= root;
+        header.node_count= nodes.size();
+        header.triangle_count= triangles.size();
+
+        return write_cache_file(filename, header, bvh_cache_magic, bvh_cache_version, key,
+            { { nodes.data(), nodes.size() * sizeof(Node) }, { (const void *) triangles.data(), triangles.size() * sizeof(Triangle) } });
+    }
+
+    //! evalue le cout SAH de l'arbre : 1 par visite de noeud interne, sah_triangle_cost par triangle teste dans une feuille, comme les constructions.
+    double cost( ) const
+    {
+        const Node& node= nodes[root];
+        double root_area= node_area(node.pmin, node.pmax);    // aire de l'englobant de la racine
+
+        double cost= 0;
+        for(const Node& node : nodes)
+        {
+            if(node.right < 0)
+            {
+                // feuille
+                int begin= -node.left;
+                int end= -node.right;
+                int n= end - begin;
+                cost+= node_area(node.pmin, node.pmax) / root_area * sah_triangle_cost * n;  // n intersections rayon / triangles par visite
+            }
+            else
+            {
+                // noeud interne
+                cost+= node_area(node.pmin, node.pmax) / root_area * 1;  // 1 intersection rayon / bbox par visite
+            }
+        }
+        return cost;
+    }
+
+    //! renvoie vrai si une intersection valide existe. la position de l'intersection *la plus proche* de l'origine du rayon est renvoyee dans hit.
+    //! stats, si non nul, compte les tests rayon / englobant et rayon / triangle.
+    //! parcours ordonne iteratif : les 2 fils d'un noeud sont testes ensemble, le plus proche est visite en premier, le plus loin est conserve
+    //! dans une pile explicite de taille fixe, avec sa distance d'entree, et il n'est visite que s'il est plus pres que l'intersection trouvee.
+    Hit intersect( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        LeafRay lray(ray);
+        Hit hit;
+        hit.t= ray.tmax;
+
+        if(stats) { stats->nodes++; stats->bytes+= sizeof(Node); }
+        NodeHit box= nodes[root].intersect(ray, invd, hit.t);
+        if(box)
+            intersect(root, box.tmin, ray, invd, lray, hit, stats);
+        return hit;
+    }
+
+    /*! parcours d'un paquet de N rayons coherents (N= 4, 8 ou 16), cf RayPacket : les rayons descendent ensemble dans l'arbre,
+        chaque noeud est lu une seule fois pour tous les rayons, et teste pour tous les rayons ensemble.
+        si les rayons ont tous le meme signe de direction sur chaque axe, un test conservatif de l'englobant (arithmetique d'intervalles)
+        elimine les noeuds que le paquet ne touche pas, sans tester chaque rayon.
+        lorsque trop peu de rayons restent actifs dans un sous arbre, ils le parcourent un par un, cf packet_min_rays.
+        renvoie les intersections dans packet.hits.
+     */
+    template< int N >
+    void intersect( RayPacket<N>& packet, PacketStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+
+        PacketState<N> state(packet);
+        if(stats) stats->packets++;
+
+        PacketEntry stack[visible_stack_size];
+        int top= 0;
+        stack[top++]= PacketEntry(root, state.all);
+        while(top > 0)
+        {
+            PacketEntry entry= stack[--top];
+            const Node& node= nodes[entry.index];
+            int mask= intersect_box(node, packet, state, state.t, entry.mask);
+            if(stats) { stats->nodes++; stats->active+= popcount(mask); }
+            if(mask == 0)
+                continue;
+
+            if(node.right < 0)
+            {
+                // feuille
+                intersect_leaf(-node.left, -node.right, packet, state, mask, false);
+                continue;
+            }
+
+            if(popcount(mask) < packet_min_rays(N))
+            {
+                // le paquet est trop disperse, termine le sous arbre rayon par rayon
+                if(stats) stats->fallbacks++;
+                for(int k= 0; k < N; k++)
+                {
+                    if((mask & (1 << k)) == 0)
+                        continue;
+
+                    Ray ray= packet.ray(k);
+                    Vector invd= Vector(packet.ix[k], packet.iy[k], packet.iz[k]);
+                    Hit hit= state.hit(k);
+                    intersect(entry.index, 0, ray, invd, LeafRay(ray), hit, nullptr);
+                    state.set(k, hit);
+                }
+                continue;
+            }
+
+            // visite le fils le plus proche en premier, selon la direction du premier rayon actif sur l'axe de separation
+            int first= ctz(mask);
+            bool neg= packet.direction(first, links[entry.index] & 3) < 0;
+            assert(top +2 <= visible_stack_size);
+            stack[top++]= PacketEntry(neg ? node.left : node.right, mask);
+            stack[top++]= PacketEntry(neg ? node.right : node.left, mask);
+        }
+
+        for(int k= 0; k < packet.count; k++)
+            packet.hits[k]= state.hit(k);
+    }
+
+    //! renvoie dans packet.occluded les rayons qui touchent un triangle dans l'intervalle [0 tmax], cf visible() et intersect(RayPacket&).
+    template< int N >
+    void visible( RayPacket<N>& packet, PacketStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+
+        PacketState<N> state(packet);
+        if(stats) stats->packets++;
+
+        PacketEntry stack[visible_stack_size];
+        int top= 0;
+        stack[top++]= PacketEntry(root, state.all);
+        while(top > 0 && state.alive)
+        {
+            PacketEntry entry= stack[--top];
+            const Node& node= nodes[entry.index];
+            int mask= intersect_box(node, packet, state, packet.tmax, entry.mask & state.alive);
+            if(stats) { stats->nodes++; stats->active+= popcount(mask); }
+            if(mask == 0)
+                continue;
+
+            if(node.right < 0)
+            {
+                intersect_leaf(-node.left, -node.right, packet, state, mask, true);
+                continue;
+            }
+
+            if(popcount(mask) < packet_min_rays(N))
+            {
+                if(stats) stats->fallbacks++;
+                for(int k= 0; k < N; k++)
+                {
+                    if((mask & (1 << k)) == 0)
+                        continue;
+
+                    Ray ray= packet.ray(k);
+                    Vector invd= Vector(packet.ix[k], packet.iy[k], packet.iz[k]);
+                    if(!visible(entry.index, ray, invd, LeafRay(ray), nullptr))
+                        state.alive&= ~(1 << k);
+                }
+                continue;
+            }
+
+            assert(top +2 <= visible_stack_size);
+            stack[top++]= PacketEntry(node.right, mask);
+            stack[top++]= PacketEntry(node.left, mask);
+        }
+
+        packet.occluded= state.all & ~state.alive;
+    }
+
+protected:
+    //! parcours ordonne du sous arbre index, pour un rayon, l'englobant du noeud est deja teste, cf intersect().
+    void intersect( const int index, const float tmin, const Ray& ray, const Vector& invd, const LeafRay& lray, Hit& hit, TraversalStats *stats ) const
+    {
+        StackEntry stack[visible_stack_size];
+        int top= 0;
+        stack[top++]= StackEntry(index, tmin);
+        while(top > 0)
+        {
+            StackEntry entry= stack[--top];
+            if(entry.t > hit.t)
+                continue;       // le noeud est plus loin que l'intersection deja trouvee
+
+            const Node& node= nodes[entry.index];
+            if(node.right < 0)
+            {
+                // feuille
+                int begin= -node.left;
+                int end= -node.right;
+                if(stats) stats->triangles+= end - begin;
+                // teste tous les triangles de la feuille ensemble, ne renvoie vrai que si l'intersection existe dans l'intervalle [0 tmax]
+                if(Hit h= blocks.intersect(begin, end, lray, hit.t))
+                    hit= h;
+                continue;
+            }
+
+            // noeud interne, teste les 2 fils
+            if(stats) { stats->nodes+= 2; stats->bytes+= 2 * sizeof(Node); }
+            NodeHit left= nodes[node.left].intersect(ray, invd, hit.t);
+            NodeHit right= nodes[node.right].intersect(ray, invd, hit.t);
+
+            // rappel: visiter les feuilles en s'eloignant de l'origine du rayon, le fils le plus proche est empile en dernier
+            assert(top +2 <= visible_stack_size);
+            if(left && right)
+            {
+                if(left.tmin < right.tmin)
+                {
+                    stack[top++]= StackEntry(node.right, right.tmin);
+                    stack[top++]= StackEntry(node.left, left.tmin);
+                }
+                else
+                {
+                    stack[top++]= StackEntry(node.left, left.tmin);
+                    stack[top++]= StackEntry(node.right, right.tmin);
+                }
+            }
+            else if(left)
+                stack[top++]= StackEntry(node.left, left.tmin);
+            else if(right)
+                stack[top++]= StackEntry(node.right, right.tmin);
+        }
+    }
+
+public:
+    /*! parcours sans pile, cf "Efficient Stack-less BVH Traversal for Ray Tracing", M. Hapala, T. Davidovic, I. Wald, V. Havran, P. Slusallek, 2011
+        https://dl.acm.org/doi/10.1145/2461217.2461222
+        le parcours remonte vers le parent d'un noeud au lieu de depiler, cf links : pas de pile, memoire constante par rayon, pas de recursion.
+        l'ordre de visite des fils ne depend que de la direction du rayon sur l'axe de separation du noeud, pour pouvoir savoir,
+        en remontant d'un fils, si son frere a deja ete visite. meme resultat que intersect(), avec plus de tests rayon / englobant.
+        n'utilise que des indices, la meme representation peut etre utilisee sur gpu, dans un shader.
+     */
+    Hit intersect_stackless( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+        assert(links.size() == nodes.size());
+
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        Hit hit;
+        hit.t= ray.tmax;
+        traverse_stackless(ray, invd, hit, false, stats);
+        return hit;
+    }
+
+    //! renvoie vrai si aucun triangle ne se trouve sur le rayon dans l'intervalle [0 tmax], parcours sans pile, cf intersect_stackless().
+    bool visible_stackless( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+        assert(links.size() == nodes.size());
+
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        Hit hit;
+        hit.t= ray.tmax;
+        return !traverse_stackless(ray, invd, hit, true, stats);
+    }
+
+    //! construit links, le parent et l'axe de separation de chaque noeud, pour intersect_stackless(). appele par build() et read_cache().
+    void build_links( )
+    {
+        links.assign(nodes.size(), ~3);     // parent -1, axe 0
+        for(int i= 0; i < int(nodes.size()); i++)
+        {
+            const Node& node= nodes[i];
+            if(node.right < 0)
+                continue;
+
+            // axe de separation des fils : celui qui separe le plus leurs centres
+            const Node& left= nodes[node.left];
+            const Node& right= nodes[node.right];
+            Vector d= (right.pmin + right.pmax) - (left.pmin + left.pmax);
+            d= Vector(std::abs(d.x), std::abs(d.y), std::abs(d.z));
+            int axis= (d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z) ? 1 : 2;
+
+            links[i]= (links[i] & ~3) | axis;
+            links[node.left]= (i << 2) | (links[node.left] & 3);
+            links[node.right]= (i << 2) | (links[node.right] & 3);
+        }
+    }
+
+    /*! renvoie vrai si aucun triangle ne se trouve sur le rayon dans l'intervalle [0 tmax].
+        parcours "any hit" : s'arrete sur la premiere intersection trouvee, il n'est pas necessaire de trouver la plus proche,
+        ni de visiter les fils dans l'ordre. les noeuds a visiter sont conserves dans une pile explicite, pas de recursion.
+     */
+    bool visible( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        LeafRay lray(ray);
+        return visible(root, ray, invd, lray, stats);
+    }
+
+protected:
+    //! parcours "any hit" du sous arbre index, cf visible().
+    bool visible( const int index, const Ray& ray, const Vector& invd, const LeafRay& lray, TraversalStats *stats ) const
+    {
+        int stack[visible_stack_size];
+        int top= 0;
+        stack[top++]= index;
+        while(top > 0)
+        {
+            const Node& node= nodes[stack[--top]];
+            if(stats) { stats->nodes++; stats->bytes+= sizeof(Node); }
+            if(!node.intersect(ray, invd, ray.tmax))
+                continue;
+
+            if(node.right < 0)
+            {
+                // feuille
+                int begin= -node.left;
+                int end= -node.right;
+                if(stats) stats->triangles+= end - begin;
+                if(blocks.occluded(begin, end, lray, ray.tmax))
+                    return false;   // un triangle est sur le rayon, pas la peine de continuer
+            }
+            else
+            {
+                // noeud interne, visite les 2 fils, dans n'importe quel ordre
+                assert(top +2 <= visible_stack_size);
+                stack[top++]= node.right;
+                stack[top++]= node.left;
+            }
+        }
+
+        return true;
+    }
+
+protected:
+    std::vector<int> links;     //!< parent << 2 | axe de separation des fils, cf intersect_stackless()
+
+    //! element de la pile des parcours de paquets : noeud et rayons actifs.
+    struct PacketEntry
+    {
+        int index;
+        int mask;
+
+        PacketEntry( ) : index(0), mask(0) {}
+        PacketEntry( const int _index, const int _mask ) : index(_index), mask(_mask) {}
+    };
+
+    //! etat du parcours d'un paquet : intersection la plus proche de chaque rayon, rayons non occultes, englobant du paquet.
+    template< int N >
+    struct PacketState
+    {
+        float t[N], u[N], v[N];
+        int id[N];
+        int all;                //!< masque des rayons du paquet
+        int alive;              //!< masque des rayons non occultes, cf visible(RayPacket&)
+        bool coherent;          //!< vrai si les directions de tous les rayons ont le meme signe sur chaque axe
+        float omin[3], omax[3]; //!< intervalles des origines et des inverses des directions des rayons
+        float imin[3], imax[3];
+
+        PacketState( const RayPacket<N>& packet ) : all((1 << packet.count) -1), alive(all), coherent(packet.count > 0)
+        {
+            for(int k= 0; k < N; k++)
+            {
+                t[k]= (k < packet.count) ? packet.tmax[k] : -1;
+                u[k]= 0; v[k]= 0;
+                id[k]= -1;
+            }
+
+            const float *o[3]= { packet.ox, packet.oy, packet.oz };
+            const float *inv[3]= { packet.ix, packet.iy, packet.iz };
+            for(int axis= 0; axis < 3; axis++)
+            {
+                omin[axis]= FLT_MAX; omax[axis]= -FLT_MAX;
+                imin[axis]= FLT_MAX; imax[axis]= -FLT_MAX;
+                for(int k= 0; k < packet.count; k++)
+                {
+                    omin[axis]= std::min(omin[axis], o[axis][k]); omax[axis]= std::max(omax[axis], o[axis][k]);
+                    imin[axis]= std::min(imin[axis], inv[axis][k]); imax[axis]= std::max(imax[axis], inv[axis][k]);
+                }
+                // les inverses changent de signe, ou sont infinis : pas de test conservatif simple
+                if(!(imin[axis] > 0 || imax[axis] < 0) || std::isinf(imin[axis]) || std::isinf(imax[axis]))
+                    coherent= false;
+            }
+        }
+
+        Hit hit( const int k ) const { return Hit(id[k], t[k], u[k], v[k]); }
+        void set( const int k, const Hit& h ) { if(h) { t[k]= h.t; u[k]= h.u; v[k]= h.v; id[k]= h.triangle_id; } }
+    };
+
+    static int popcount( const int mask )
+    {
+    #if defined(__GNUC__)
+        return __builtin_popcount(mask);
+    #else
+        int n= 0;
+        for(int m= mask; m; m&= m -1) n++;
+        return n;
+    #endif
+    }
+
+    static int ctz( const int mask )
+    {
+    #if defined(__GNUC__)
+        return __builtin_ctz(mask);
+    #else
+        int n= 0;
+        while(!(mask & (1 << n))) n++;
+        return n;
+    #endif
+    }
+
+    //! nombre minimum de rayons actifs pour continuer le parcours en paquet, sinon les rayons sont traites un par un.
+    static int packet_min_rays( const int n ) { return std::max(2, n / 4); }
+
+    /*! teste l'englobant pour les rayons du masque, renvoie le masque des rayons qui le touchent dans l'intervalle [0 htmax[k]].
+        un paquet coherent est d'abord teste avec les intervalles des origines et des directions : si l'intervalle du paquet ne touche pas
+        l'englobant, aucun rayon ne le touche.
+     */
+    template< int N >
+    int intersect_box( const Node& node, const RayPacket<N>& packet, const PacketState<N>& state, const float *htmax, const int mask ) const
+    {
+        if(state.coherent)
+        {
+            float tmin= 0;
+            float tmax= 0;
+            for(int k= 0; k < N; k++)
+                if(mask & (1 << k)) tmax= std::max(tmax, htmax[k]);
+
+            for(int axis= 0; axis < 3; axis++)
+            {
+                // plans d'entree et de sortie, selon le signe des directions
+                bool neg= state.imax[axis] < 0;
+                float pnear= neg ? node.pmax(axis) : node.pmin(axis);
+                float pfar= neg ? node.pmin(axis) : node.pmax(axis);
+
+                // bornes de (plan - origine) * inverse de la direction, sur les intervalles
+                float n0= (pnear - state.omax[axis]) * state.imin[axis], n1= (pnear - state.omax[axis]) * state.imax[axis];
+                float n2= (pnear - state.omin[axis]) * state.imin[axis], n3= (pnear - state.omin[axis]) * state.imax[axis];
+                float f0= (pfar - state.omax[axis]) * state.imin[axis], f1= (pfar - state.omax[axis]) * state.imax[axis];
+                float f2= (pfar - state.omin[axis]) * state.imin[axis], f3= (pfar - state.omin[axis]) * state.imax[axis];
+                tmin= std::max(tmin, std::min(std::min(n0, n1), std::min(n2, n3)));
+                tmax= std::min(tmax, std::max(std::max(f0, f1), std::max(f2, f3)) * box_margin);
+            }
+            if(tmin > tmax)
+                return 0;
+        }
+
+        int hits= 0;
+        for(int k= 0; k < N; k++)
+        {
+            float x0= (node.pmin.x - packet.ox[k]) * packet.ix[k], x1= (node.pmax.x - packet.ox[k]) * packet.ix[k];
+            float y0= (node.pmin.y - packet.oy[k]) * packet.iy[k], y1= (node.pmax.y - packet.oy[k]) * packet.iy[k];
+            float z0= (node.pmin.z - packet.oz[k]) * packet.iz[k], z1= (node.pmax.z - packet.oz[k]) * packet.iz[k];
+            float tmin= std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), 0.f));
+            float tmax= std::min(std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::max(z0, z1)) * box_margin, htmax[k]);
+            hits|= int(tmin <= tmax) << k;
+        }
+        return hits & mask;
+    }
+
+    /*! teste les triangles [begin .. end[ de la feuille, pour les rayons du masque. avec TEST_MOLLER, chaque triangle est teste sur tous les rayons
+        du paquet ensemble, sinon chaque rayon teste les triangles de la feuille, cf TriangleBlocks.
+        any_hit : elimine les rayons occultes de state.alive, sinon met a jour l'intersection la plus proche de chaque rayon.
+     */
+    template< int N >
+    void intersect_leaf( const int begin, const int end, const RayPacket<N>& packet, PacketState<N>& state, const int mask, const bool any_hit ) const
+    {
+        if(blocks.test != TEST_MOLLER)
+        {
+            for(int k= 0; k < N; k++)
+            {
+                if((mask & (1 << k)) == 0)
+                    continue;
+
+                LeafRay lray(packet.ray(k));
+                if(any_hit)
+                {
+                    if(blocks.occluded(begin, end, lray, packet.tmax[k]))
+                        state.alive&= ~(1 << k);
+                }
+                else if(Hit h= blocks.intersect(begin, end, lray, state.t[k]))
+                    state.set(k, h);
+            }
+            return;
+        }
+
+        for(int i= begin; i < end; i++)
+        {
+            const float px= blocks.px[i], py= blocks.py[i], pz= blocks.pz[i];
+            const float e1x= blocks.e1x[i], e1y= blocks.e1y[i], e1z= blocks.e1z[i];
+            const float e2x= blocks.e2x[i], e2y= blocks.e2y[i], e2z= blocks.e2z[i];
+
+            int occluded= 0;
+            for(int k= 0; k < N; k++)
+            {
+                // moller-trumbore, cf TriangleBlocks::intersect_moller(), un rayon par voie
+                const float dx= packet.dx[k], dy= packet.dy[k], dz= packet.dz[k];
+                float pvx= dy * e2z - dz * e2y;
+                float pvy= dz * e2x - dx * e2z;
+                float pvz= dx * e2y - dy * e2x;
+                float det= e1x * pvx + e1y * pvy + e1z * pvz;
+                float inv_det= 1 / det;
+
+                float tx= packet.ox[k] - px;
+                float ty= packet.oy[k] - py;
+                float tz= packet.oz[k] - pz;
+                float uk= (tx * pvx + ty * pvy + tz * pvz) * inv_det;
+
+                float qx= ty * e1z - tz * e1y;
+                float qy= tz * e1x - tx * e1z;
+                float qz= tx * e1y - ty * e1x;
+                float vk= (dx * qx + dy * qy + dz * qz) * inv_det;
+                float tk= (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+                bool valid= ((mask >> k) & 1) & (det != 0) & (uk >= 0) & (uk <= 1) & (vk >= 0) & (uk + vk <= 1) & (tk >= 0) & (tk <= state.t[k]);
+                if(any_hit)
+                    occluded|= int(valid) << k;
+                else
+                {
+                    state.t[k]= valid ? tk : state.t[k];
+                    state.u[k]= valid ? uk : state.u[k];
+                    state.v[k]= valid ? vk : state.v[k];
+                    state.id[k]= valid ? i : state.id[k];
+                }
+            }
+            if(any_hit)
+                state.alive&= ~occluded;
+        }
+    }
+
+    //! element de la pile de intersect() : noeud et distance d'entree dans son englobant.
+    struct StackEntry
+    {
+        int index;
+        float t;
+
+        StackEntry( ) : index(0), t(0) {}
+        StackEntry( const int _index, const float _t ) : index(_index), t(_t) {}
+    };
+
+    int parent( const int index ) const { return links[index] >> 2; }
+
+    //! renvoie le fils a visiter en premier, selon la direction du rayon sur l'axe de separation du noeud.
+    int near_child( const int index, const bool *neg ) const
+    {
+        const Node& node= nodes[index];
+        return neg[links[index] & 3] ? node.right : node.left;
+    }
+
+    int sibling( const int index, const bool *neg ) const
+    {
+        const Node& node= nodes[parent(index)];
+        return neg[links[parent(index)] & 3] ? ((node.right == index) ? node.left : node.right) : ((node.left == index) ? node.right : node.left);
+    }
+
+    //! parcours sans pile, renvoie vrai si any_hit et qu'une intersection existe, cf intersect_stackless().
+    bool traverse_stackless( const Ray& ray, const Vector& invd, Hit& hit, const bool any_hit, TraversalStats *stats ) const
+    {
+        LeafRay lray(ray);
+        // etats du parcours : le noeud courant est atteint depuis son parent, son frere ou un de ses fils
+        enum { FROM_PARENT, FROM_SIBLING, FROM_CHILD };
+
+        bool neg[3]= { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0 };
+        int current= root;
+        int state= FROM_SIBLING;        // la racine n'a pas de frere, remonte a la racine si elle n'est pas touchee
+        for(;;)
+        {
+            if(state == FROM_CHILD)
+            {
+                if(current == root)
+                    return false;       // fin du parcours
+
+                int p= parent(current);
+                if(current == near_child(p, neg))
+                {
+                    // le premier fils est visite, passe au second
+                    current= sibling(current, neg);
+                    state= FROM_SIBLING;
+                }
+                else
+                {
+                    // les 2 fils sont visites, remonte
+                    current= p;
+                    state= FROM_CHILD;
+                }
+                continue;
+            }
+
+            // FROM_PARENT ou FROM_SIBLING : teste le noeud
+            const Node& node= nodes[current];
+            if(stats) { stats->nodes++; stats->bytes+= sizeof(Node); }
+            bool touched= node.intersect(ray, invd, hit.t);
+            if(touched && node.right >= 0)
+            {
+                // noeud interne touche, descend dans le premier fils
+                current= near_child(current, neg);
+                state= FROM_PARENT;
+                continue;
+            }
+
+            if(touched)
+            {
+                // feuille touchee
+                int begin= -node.left;
+                int end= -node.right;
+                if(stats) stats->triangles+= end - begin;
+                if(any_hit)
+                {
+                    if(blocks.occluded(begin, end, lray, ray.tmax))
+                        return true;
+                }
+                else if(Hit h= blocks.intersect(begin, end, lray, hit.t))
+                    hit= h;
+            }
+
+            if(state == FROM_PARENT)
+            {
+                // premier fils, passe au second
+                current= sibling(current, neg);
+                state= FROM_SIBLING;
+            }
+            else
+            {
+                // second fils (ou racine), remonte
+                if(current == root)
+                    return false;
+                current= parent(current);
+                state= FROM_CHILD;
+            }
+        }
+    }
+
+    int build_node( const int begin, const int end )
+    {
+        // solution 2 : trier les triangles sur l'axe le plus etire de l'englobant
+            // construire l'englobant des 2 moities des triangles
+            // 1. construire l'englobant
+            // 2. trouver l'axe le plus etire de l'englobant
+            // 3. trier les triangles sur l'axe
+            // 4. fils gauche = 1ere moitiee des triangles et fils droit = 2ieme moitiee des triangles
+            // 5. construire les 2 fils
+
+        // construire l'englobant des triangles
+        Point bmin, bmax;
+        bounds(begin, end, bmin, bmax);
+
+        // construire une feuille, s'il ne reste plus qu'un triangle
+        if(end - begin < 2)
+        {
+            int index= int(nodes.size());
+            nodes.push_back( {bmin, bmax, -begin, -end} );
+
+            /* triche un peu avec la representation du noeud pour stocker une feuille
+                au lieu de declarer begin et end dans la structure noeud (ou utiliser 2 structures differentes ?), reutilise left et right,
+
+                mais il faut pourvoir faire la difference entre les 2 cas (noeud / feuille) :
+                if(node.right < 0)
+                    // feuille
+                else
+                    // noeud
+
+                question: if(node.left < 0) ne fonctionne pas pour detecter une feuille, pourquoi ?
+             */
+
+            return index;
+        }
+
+        // axe le plus etire de l'englobant
+        int axis= bounds_max(bmin, bmax);
+
+        // trier les triangles sur l'axe
+        std::sort(triangles.data() + begin, triangles.data() + end, triangle_less(axis));
+
+        // construire les fils du noeud
+        int left= build_node(begin, (begin+end) / 2);
+        int right= build_node((begin+end) / 2, end);
+
+        // construire le noeud
+        int index= nodes.size();
+        nodes.push_back( {bmin, bmax, left, right} );
+        return index;
+    }
+
+    int build_node_centroids( const int begin, const int end )
+    {
+        // solution 1 : couper l'englobant en 2 sur l'axe le plus etire
+            // 1. construire l'englobant
+            // 2. trouver l'axe le plus etire
+            // 3. repartir les triangles dans chaque moitiee de l'englobant
+            // 4. fils gauche = triangles dans la 1ere moitiee de l'englobant et fils droit = triangles dans la 2ieme moitiee de l'englobant
+            // 5. construire les 2 fils
+
+            // comment repartir les triangles a cheval sur les 2 boites ?
+            // solution : un seul point des triangles est teste pour la repartition, le centre de l'englobant, ce qui elimine l'ambiguite.
+
+            // consequence indirecte : il n'est plus necessaire de trier les triangles / centres pour les repartir entre les 2 moitiees de l'englobant
+            // on aurait pu ecrire :
+                // trier les centres des triangles (sur un axe)
+                // trouver les n premiers triangles dont les centres sont dans la moitiee gauche de l'englobant
+            // mais on peut obtenir le meme resultat directement en parcourant 1 fois l'ensemble de triangles, sans faire le tri
+            // c'est ce que fait std::partition()
+            // et cette solution est plus rapide : partiton en O(n), tri en O(n log n)
+
+        // construire l'englobant des triangles, pour initialiser le noeud / la feuille
+        Point bmin, bmax;
+        bounds(begin, end, bmin, bmax);
+
+        // construire l'englobant des centres des triangles, pour repartir les triangles
+        Point cmin, cmax;
+        centroid_bounds(begin, end, cmin, cmax);
+
+        // construire une feuille, s'il ne reste plus qu'un triangle
+        if(end - begin < 2)
+        {
+            int index= int(nodes.size());
+            nodes.push_back( {bmin, bmax, -begin, -end} );
+            return index;
+        }
+
+        // axe le plus etire de l'englobant des centres
+        int axis= bounds_max(cmin, cmax);
+
+        // repartir les triangles par rapport au milieu de l'englobant des centres
+        auto *p= std::partition(triangles.data() + begin, triangles.data() + end, centroid_less1(axis, (cmax(axis)+cmin(axis)) / 2));
+        int m= std::distance(triangles.data(), p);
+        if(m == begin || m == end)
+            // les centres sont confondus : coupe au milieu des triangles
+            m= (begin + end) / 2;
+
+        // construire les fils du noeud
+        int left= build_node_centroids(begin, m);
+        int right= build_node_centroids(m, end);
+
+        // construire le noeud
+        int index= int(nodes.size());
+        nodes.push_back( {bmin, bmax, left, right} );
+        return index;
+    }
+
+    int build_node_sah( const int begin, const int end, std::vector<Node>& tree )
+    {
+        // solution 3 : choisir la repartition qui minimise le cout SAH des fils
+            // 1. construire l'englobant des triangles et l'englobant de leurs centres
+            // 2. sur chaque axe, repartir les centres dans sah_bins cellules regulieres et accumuler nombre et englobant des triangles par cellule
+            // 3. evaluer le cout des sah_bins -1 coupes entre les cellules : 1 + c * (aire(gauche) * n(gauche) + aire(droit) * n(droit)) / aire(noeud)
+            // 4. comparer le cout de la meilleure coupe au cout d'une feuille : c * n, n triangles testes, au plus max_leaf
+            // 5. repartir les triangles et construire les 2 fils
+
+        // construction parallele : les gros noeuds (plus de parallel_build_min triangles) sont traites par blocs de triangles, en parallele,
+        // et leurs 2 fils sont construits en parallele, par des taches openMP, dans des tableaux de noeuds separes, concatenes ensuite.
+        // les decisions ne dependent que du nombre de triangles, pas du nombre de threads : l'arbre est identique a celui de la construction sequentielle.
+
+        Point bmin, bmax;
+        Point cmin, cmax;
+        parallel_bounds(begin, end, bmin, bmax, cmin, cmax);
+
+        int n= end - begin;
+        if(n < 2)
+        {
+            int index= int(tree.size());
+            tree.push_back( {bmin, bmax, -begin, -end} );
+            return index;
+        }
+
+        // repartit les centres dans les cellules des 3 axes
+        float scale[3];
+        for(int axis= 0; axis < 3; axis++)
+        {
+            float extent= cmax(axis) - cmin(axis);
+            scale[axis]= (extent > 0) ? sah_bins / extent : 0;     // 0 : tous les centres sont confondus sur cet axe
+        }
+
+        Bin bins[3][sah_bins];
+        parallel_bins(begin, end, cmin, scale, bins);
+
+        // evalue les coupes sur les 3 axes
+        float area= node_area(bmin, bmax);
+        float best_cost= FLT_MAX;
+        int best_axis= -1;
+        int best_bin= -1;
+        for(int axis= 0; axis < 3; axis++)
+        {
+            if(scale[axis] == 0)
+                continue;
+
+            // balaye les cellules de droite a gauche pour accumuler les englobants des fils droits
+            float right_area[sah_bins];
+            int right_n[sah_bins];
+            Bin right;
+            for(int k= sah_bins -1; k > 0; k--)
+            {
+                right.insert(bins[axis][k]);
+                right_area[k]= right.area();
+                right_n[k]= right.n;
+            }
+
+            // puis de gauche a droite, et evalue la coupe entre les cellules k-1 et k
+            Bin left;
+            for(int k= 1; k < sah_bins; k++)
+            {
+                left.insert(bins[axis][k -1]);
+                if(left.n == 0 || right_n[k] == 0)
+                    continue;
+
+                float cost= 1 + sah_triangle_cost * (left.area() * left.n + right_area[k] * right_n[k]) / area;
+                if(cost < best_cost)
+                {
+                    best_cost= cost;
+                    best_axis= axis;
+                    best_bin= k;
+                }
+            }
+        }
+
+        // construire une feuille, si tester les triangles est moins cher que de visiter les fils
+        if(n <= max_leaf && (best_axis == -1 || best_cost >= sah_triangle_cost * n))
+        {
+            int index= int(tree.size());
+            tree.push_back( {bmin, bmax, -begin, -end} );
+            return index;
+        }
+
+        int m;
+        if(best_axis == -1)
+            // les centres sont confondus, aucune coupe n'est possible : coupe au milieu des triangles
+            m= (begin + end) / 2;
+        else
+            m= parallel_partition(begin, end, bin_less(best_axis, cmin(best_axis), scale[best_axis], best_bin));
+        assert(m != begin);
+        assert(m != end);
+
+        // construire les fils du noeud
+        int left, right;
+        if(n < parallel_build_min)
+        {
+            left= build_node_sah(begin, m, tree);
+            right= build_node_sah(m, end, tree);
+        }
+        else
+        {
+            // construit les 2 fils en parallele...
+            std::vector<Node> left_tree;
+            std::vector<Node> right_tree;
+            #pragma omp task shared(left, left_tree)
+            left= build_node_sah(begin, m, left_tree);
+            #pragma omp task shared(right, right_tree)
+            right= build_node_sah(m, end, right_tree);
+            #pragma omp taskwait
+
+            // ... et les range dans le meme ordre que la construction sequentielle : fils gauche, fils droit, puis le noeud
+            left= append(tree, left_tree, left);
+            right= append(tree, right_tree, right);
+        }
+
+        // construire le noeud
+        int index= int(tree.size());
+        tree.push_back( {bmin, bmax, left, right} );
+        return index;
+    }
+
+    //! ajoute les noeuds de subtree a la fin de tree, renvoie l'indice de la racine subtree_root dans tree.
+    static int append( std::vector<Node>& tree, const std::vector<Node>& subtree, const int subtree_root )
+    {
+        int offset= int(tree.size());
+        for(Node node : subtree)
+        {
+            if(node.right >= 0)
+            {
+                // noeud interne, decale les indices des fils. les feuilles referencent les triangles, rien a changer
+                node.left+= offset;
+                node.right+= offset;
+            }
+            tree.push_back(node);
+        }
+        return subtree_root + offset;
+    }
+
+    //! nombre de blocs de triangles traites en parallele, cf parallel_bounds(), parallel_bins(), parallel_partition().
+    static int parallel_chunks( const int n ) { return (n < parallel_build_min) ? 1 : std::min(64, n / (parallel_build_min / 4)); }
+
+    //! renvoie l'englobant des triangles[begin .. end[ et l'englobant de leurs centres, en parallele pour les gros noeuds.
+    void parallel_bounds( const int begin, const int end, Point& bmin, Point& bmax, Point& cmin, Point& cmax )
+    {
+        int chunks= parallel_chunks(end - begin);
+        std::vector<Bin> boxes(chunks);
+        std::vector<Bin> centers(chunks);
+        for(int c= 0; c < chunks; c++)
+        {
+            #pragma omp task if(chunks > 1) shared(boxes, centers)
+            {
+                int cbegin= begin + int((long long) (end - begin) * c / chunks);
+                int cend= begin + int((long long) (end - begin) * (c +1) / chunks);
+                for(int i= cbegin; i < cend; i++)
+                {
+                    Point pmin, pmax;
+                    triangles[i].bounds(pmin, pmax);
+                    Point pm= (pmin + pmax) / 2;
+
+                    boxes[c].insert(pmin, pmax);
+                    centers[c].insert(pm, pm);
+                }
+            }
+        }
+        #pragma omp taskwait
+
+        // min / max ne dependent pas de l'ordre : meme resultat que le calcul sequentiel
+        for(int c= 1; c < chunks; c++)
+        {
+            boxes[0].insert(boxes[c]);
+            centers[0].insert(centers[c]);
+        }
+        bmin= boxes[0].bmin; bmax= boxes[0].bmax;
+        cmin= centers[0].bmin; cmax= centers[0].bmax;
+    }
+
+    //! repartit les triangles[begin .. end[ dans les cellules des 3 axes, en parallele pour les gros noeuds.
+    void parallel_bins( const int begin, const int end, const Point& cmin, const float scale[3], Bin bins[3][sah_bins] )
+    {
+        int chunks= parallel_chunks(end - begin);
+        std::vector<Bin> chunk_bins(chunks * 3 * sah_bins);
+        for(int c= 0; c < chunks; c++)
+        {
+            #pragma omp task if(chunks > 1) shared(chunk_bins)
+            {
+                Bin *cbins= chunk_bins.data() + c * 3 * sah_bins;
+                int cbegin= begin + int((long long) (end - begin) * c / chunks);
+                int cend= begin + int((long long) (end - begin) * (c +1) / chunks);
+                for(int i= cbegin; i < cend; i++)
+                {
+                    Point pmin, pmax;
+                    triangles[i].bounds(pmin, pmax);
+                    Point pm= (pmin + pmax) / 2;
+
+                    for(int axis= 0; axis < 3; axis++)
+                        if(scale[axis] > 0)
+                            cbins[axis * sah_bins + bin_index(cmin(axis), scale[axis], pm(axis))].insert(pmin, pmax);
+                }
+            }
+        }
+        #pragma omp taskwait
+
+        for(int c= 0; c < chunks; c++)
+            for(int axis= 0; axis < 3; axis++)
+                for(int k= 0; k < sah_bins; k++)
+                    bins[axis][k].insert(chunk_bins[(c * 3 + axis) * sah_bins + k]);
+    }
+
+    /*! repartit les triangles[begin .. end[ : ceux qui verifient le predicat en premier. renvoie l'indice du premier triangle qui ne le verifie pas.
+        std::partition pour les petits noeuds. pour les gros noeuds, repartition stable par blocs : chaque bloc compte ses triangles,
+        puis les recopie a leur place dans un tableau temporaire. le resultat ne depend pas du nombre de threads.
+     */
+    template< typename Predicate >
+    int parallel_partition( const int begin, const int end, const Predicate& predicate )
+    {
+        int chunks= parallel_chunks(end - begin);
+        if(chunks == 1)
+        {
+            auto *p= std::partition(triangles.data() + begin, triangles.data() + end, predicate);
+            return int(std::distance(triangles.data(), p));
+        }
+
+        // compte les triangles de chaque bloc qui verifient le predicat
+        std::vector<int> counts(chunks, 0);
+        for(int c= 0; c < chunks; c++)
+        {
+            #pragma omp task shared(counts)
+            {
+                int cbegin= begin + int((long long) (end - begin) * c / chunks);
+                int cend= begin + int((long long) (end - begin) * (c +1) / chunks);
+                for(int i= cbegin; i < cend; i++)
+                    if(predicate(triangles[i]))
+                        counts[c]++;
+            }
+        }
+        #pragma omp taskwait
+
+        // position du premier triangle de chaque bloc, a gauche et a droite
+        std::vector<int> left(chunks), right(chunks);
+        int m= 0;
+        for(int c= 0; c < chunks; c++)
+        {
+            left[c]= m;
+            m+= counts[c];
+        }
+        int r= m;
+        for(int c= 0; c < chunks; c++)
+        {
+            int cbegin= int((long long) (end - begin) * c / chunks);
+            int cend= int((long long) (end - begin) * (c +1) / chunks);
+            right[c]= r;
+            r+= (cend - cbegin) - counts[c];
+        }
+
+        // recopie les triangles dans le tableau temporaire, puis dans triangles
+        std::vector<Triangle> tmp(end - begin);
+        for(int c= 0; c < chunks; c++)
+        {
+            #pragma omp task shared(tmp, left, right)
+            {
+                int cbegin= begin + int((long long) (end - begin) * c / chunks);
+                int cend= begin + int((long long) (end - begin) * (c +1) / chunks);
+                int l= left[c];
+                int r= right[c];
+                for(int i= cbegin; i < cend; i++)
+                {
+                    if(predicate(triangles[i]))
+                        tmp[l++]= triangles[i];
+                    else
+                        tmp[r++]= triangles[i];
+                }
+            }
+        }
+        #pragma omp taskwait
+
+        std::copy(tmp.begin(), tmp.end(), triangles.begin() + begin);
+        return begin + m;
+    }
+
+    /*! solution 4 : lbvh, cf "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", T. Karras, 2012
+        https://research.nvidia.com/publication/2012-06_maximizing-parallelism-construction-bvhs-octrees-and-k-d-trees
+            // 1. calculer le code de morton du centre de chaque triangle, bits bits par axe
+            // 2. trier les codes, tri par base en parallele
+            // 3. construire les n-1 noeuds internes : chaque noeud trouve, independamment des autres, l'intervalle de codes qu'il couvre
+            //    et la position du premier bit different dans l'intervalle, qui le coupe en 2 fils.
+            // 4. calculer les englobants et ranger les noeuds dans nodes, regrouper les petits sous arbres en feuilles si c'est moins cher (SAH)
+        chaque etape est lineaire en nombre de triangles, et les etapes 1 a 3 sont paralleles.
+     */
+    int build_lbvh( const int bits )
+    {
+        int n= int(triangles.size());
+        if(n == 0)
+        {
+            // pas de triangles, pas de feuille : une feuille vide serait codee {0, -0}, comme un noeud interne, cf build()
+            nodes.clear();
+            return -1;
+        }
+
+        // 1. codes de morton des centres, dans l'englobant des centres
+        // les taches openMP de parallel_bounds() sont executees par les threads de la region parallele
+        Point bmin, bmax, cmin, cmax;
+        #pragma omp parallel
+        #pragma omp single
+        parallel_bounds(0, n, bmin, bmax, cmin, cmax);
+        Vector extent= cmax - cmin;
+        float scale= float((1u << bits) - 1);
+
+        std::vector<uint64_t> codes(n);
+        std::vector<int> order(n);
+        #pragma omp parallel for schedule(static)
+        for(int i= 0; i < n; i++)
+        {
+            Point c= triangles[i].centroid();
+            unsigned int x= (extent.x > 0) ? (unsigned int) ((c.x - cmin.x) / extent.x * scale) : 0;
+            unsigned int y= (extent.y > 0) ? (unsigned int) ((c.y - cmin.y) / extent.y * scale) : 0;
+            unsigned int z= (extent.z > 0) ? (unsigned int) ((c.z - cmin.z) / extent.z * scale) : 0;
+            codes[i]= morton_bits(x) << 2 | morton_bits(y) << 1 | morton_bits(z);
+            order[i]= i;
+        }
+
+        // 2. trie les codes, puis les triangles dans le meme ordre
+        radix_sort(codes, order, 3 * bits);
+        {
+            std::vector<Triangle> sorted(n);
+            #pragma omp parallel for schedule(static)
+            for(int i= 0; i < n; i++)
+                sorted[i]= triangles[order[i]];
+            triangles.swap(sorted);
+        }
+
+        nodes.clear();
+        if(n == 1)
+        {
+            nodes.push_back( {bmin, bmax, 0, -1} );
+            return 0;
+        }
+
+        // 3. noeuds internes 0 .. n-2, la racine est le noeud 0. les fils sont des noeuds internes ou des feuilles (1 triangle), cf LBVHNode
+        std::vector<LBVHNode> lnodes(n -1);
+        #pragma omp parallel for schedule(static)
+        for(int i= 0; i < n -1; i++)
+        {
+            // direction de l'intervalle : vers le voisin qui partage le plus de bits
+            int d= (delta(codes, i, i +1) - delta(codes, i, i -1)) > 0 ? 1 : -1;
+            int delta_min= delta(codes, i, i - d);
+
+            // longueur de l'intervalle, borne superieure puis recherche dichotomique
+            int lmax= 2;
+            while(delta(codes, i, i + lmax * d) > delta_min)
+                lmax*= 2;
+            int l= 0;
+            for(int t= lmax / 2; t >= 1; t/= 2)
+                if(delta(codes, i, i + (l + t) * d) > delta_min)
+                    l+= t;
+            int j= i + l * d;
+
+            // position de la coupe : dernier code qui partage plus de delta_node bits avec le code i
+            int delta_node= delta(codes, i, j);
+            int split= 0;
+            for(int t= (l +1) / 2; ; t= (t +1) / 2)
+            {
+                if(delta(codes, i, i + (split + t) * d) > delta_node)
+                    split+= t;
+                if(t == 1)
+                    break;
+            }
+            int gamma= i + split * d + std::min(d, 0);
+
+            LBVHNode& node= lnodes[i];
+            node.first= std::min(i, j);
+            node.last= std::max(i, j);
+            node.left= (node.first == gamma) ? -gamma -1 : gamma;
+            node.right= (node.last == gamma +1) ? -(gamma +1) -1 : gamma +1;
+        }
+
+        // 4. englobants, et range les noeuds dans nodes
+        float root_cost;
+        return emit_lbvh(lnodes, 0, root_cost);
+    }
+
+    //! noeud interne construit par build_lbvh(). fils >= 0 : noeud interne, fils < 0 : feuille, triangle -fils -1.
+    struct LBVHNode
+    {
+        int left, right;
+        int first, last;    //!< triangles[first .. last] couverts par le noeud
+    };
+
+    //! renvoie le nombre de bits en commun des codes i et j, ou -1 si j n'existe pas. les codes identiques sont departages par leurs indices.
+    static int delta( const std::vector<uint64_t>& codes, const int i, const int j )
+    {
+        if(j < 0 || j >= int(codes.size()))
+            return -1;
+        if(codes[i] == codes[j])
+            return 64 + clz32(unsigned(i ^ j));
+        return clz64(codes[i] ^ codes[j]);
+    }
+
+    static int clz64( const uint64_t x )
+    {
+    #if defined(__GNUC__)
+        return x ? __builtin_clzll(x) : 64;
+    #else
+        int n= 0;
+        for(uint64_t bit= uint64_t(1) << 63; bit && !(x & bit); bit>>= 1) n++;
+        return n;
+    #endif
+    }
+
+    static int clz32( const unsigned x )
+    {
+    #if defined(__GNUC__)
+        return x ? __builtin_clz(x) : 32;
+    #else
+        int n= 0;
+        for(unsigned bit= 1u << 31; bit && !(x & bit); bit>>= 1) n++;
+        return n;
+    #endif
+    }
+
+    //! intercale 2 bits nuls entre les 21 bits de poids faible de x, cf codes de morton.
+    static uint64_t morton_bits( const unsigned int v )
+    {
+        uint64_t x= v & 0x1fffff;
+        x= (x | x << 32) & 0x1f00000000ffffull;
+        x= (x | x << 16) & 0x1f0000ff0000ffull;
+        x= (x | x << 8) & 0x100f00f00f00f00full;
+        x= (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x= (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    /*! tri par base (radix sort) des bits de poids faible des codes, 8 bits par passe, et des valeurs associees.
+        chaque passe est stable : histogramme par bloc en parallele, prefixes, puis recopie en parallele. le resultat ne depend pas du nombre de threads.
+     */
+    static void radix_sort( std::vector<uint64_t>& codes, std::vector<int>& values, const int bits )
+    {
+        int n= int(codes.size());
+        int chunks= std::max(1, std::min(64, n / (16 * 1024)));
+        std::vector<uint64_t> tmp_codes(n);
+        std::vector<int> tmp_values(n);
+        std::vector<int> offsets(chunks * 256);
+
+        for(int shift= 0; shift < bits; shift+= 8)
+        {
+            // histogramme de chaque bloc
+            std::fill(offsets.begin(), offsets.end(), 0);
+            #pragma omp parallel for schedule(static)
+            for(int c= 0; c < chunks; c++)
+            {
+                int begin= int((long long) n * c / chunks);
+                int end= int((long long) n * (c +1) / chunks);
+                for(int i= begin; i < end; i++)
+                    offsets[c * 256 + ((codes[i] >> shift) & 0xff)]++;
+            }
+
+            // position du premier element de chaque bloc, pour chaque valeur
+            int sum= 0;
+            for(int digit= 0; digit < 256; digit++)
+            for(int c= 0; c < chunks; c++)
+            {
+                int count= offsets[c * 256 + digit];
+                offsets[c * 256 + digit]= sum;
+                sum+= count;
+            }
+
+            #pragma omp parallel for schedule(static)
+            for(int c= 0; c < chunks; c++)
+            {
+                int begin= int((long long) n * c / chunks);
+                int end= int((long long) n * (c +1) / chunks);
+                int *offset= offsets.data() + c * 256;
+                for(int i= begin; i < end; i++)
+                {
+                    int k= offset[(codes[i] >> shift) & 0xff]++;
+                    tmp_codes[k]= codes[i];
+                    tmp_values[k]= values[i];
+                }
+            }
+
+            codes.swap(tmp_codes);
+            values.swap(tmp_values);
+        }
+    }
+
+    /*! range le sous arbre du noeud lbvh index dans nodes, en ordre postfixe comme build_node_sah(), renvoie l'indice du noeud.
+        cost : cout SAH du sous arbre, multiplie par l'aire de son englobant (pour eviter les divisions).
+        un sous arbre d'au plus max_leaf triangles est remplace par une feuille, si elle est moins chere.
+     */
+    int emit_lbvh( const std::vector<LBVHNode>& lnodes, const int index, float& cost )
+    {
+        if(index < 0)
+        {
+            // feuille, 1 triangle
+            int i= -index -1;
+            Point pmin, pmax;
+            triangles[i].bounds(pmin, pmax);
+            cost= sah_triangle_cost * node_area(pmin, pmax);
+
+            int node= int(nodes.size());
+            nodes.push_back( {pmin, pmax, -i, -(i +1)} );
+            return node;
+        }
+
+        const LBVHNode& lnode= lnodes[index];
+        int first= int(nodes.size());
+        float left_cost, right_cost;
+        int left= emit_lbvh(lnodes, lnode.left, left_cost);
+        int right= emit_lbvh(lnodes, lnode.right, right_cost);
+
+        Point pmin= min(nodes[left].pmin, nodes[right].pmin);
+        Point pmax= max(nodes[left].pmax, nodes[right].pmax);
+        float area= node_area(pmin, pmax);
+        cost= area + left_cost + right_cost;
+
+        int n= lnode.last - lnode.first +1;
+        if(n <= max_leaf && sah_triangle_cost * n * area <= cost)
+        {
+            // remplace le sous arbre, range a la fin de nodes, par une feuille
+            nodes.resize(first);
+            cost= sah_triangle_cost * n * area;
+
+            int node= int(nodes.size());
+            nodes.push_back( {pmin, pmax, -lnode.first, -(lnode.last +1)} );
+            return node;
+        }
+
+        int node= int(nodes.size());
+        nodes.push_back( {pmin, pmax, left, right} );
+        return node;
+    }
+
+    /*! optimisation des treelets, cf "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies", T. Karras, T. Aila, 2013
+        https://research.nvidia.com/publication/2013-07_fast-parallel-construction-high-quality-bounding-volume-hierarchies
+        pour chaque noeud interne, en partant des feuilles : forme un treelet de treelet_size feuilles (en developpant le fils de plus grande aire),
+        cherche l'arbre binaire de cout SAH minimal sur ces feuilles (programmation dynamique sur les sous ensembles de feuilles),
+        et reconstruit le treelet, avec les memes noeuds internes, s'il est moins cher.
+        un treelet ne modifie que les noeuds de son sous arbre : les sous arbres des 2 fils sont optimises en parallele, 
+        le resultat ne depend pas du nombre de threads.
+     */
+    void optimize_treelets( )
+    {
+        auto cpu_start= std::chrono::high_resolution_clock::now();
+
+        std::vector<float> costs(nodes.size());
+        double before= cost();
+        int changes= 0;
+        #pragma omp parallel
+        #pragma omp single
+        changes= optimize_treelet(root, costs, 0);
+
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("treelets: %d changes, SAH cost %lf -> %lf, cpu  %ds %03dms\n", changes, before, cost(), int(cpu_time / 1000), int(cpu_time % 1000));
+    }
+
+    //! optimise les treelets du sous arbre index, renvoie son cout dans costs[index], cf emit_lbvh(), et le nombre de treelets modifies.
+    int optimize_treelet( const int index, std::vector<float>& costs, const int depth )
+    {
+        Node& node= nodes[index];
+        if(node.right < 0)
+        {
+            costs[index]= sah_triangle_cost * (-node.right - -node.left) * node_area(node.pmin, node.pmax);
+            return 0;
+        }
+
+        int changes= 0;
+        if(depth >= treelet_parallel_depth)
+        {
+            changes+= optimize_treelet(node.left, costs, depth +1);
+            changes+= optimize_treelet(node.right, costs, depth +1);
+        }
+        else
+        {
+            // les sous arbres des fils sont disjoints, ils sont optimises en parallele
+            int left_changes= 0;
+            int right_changes= 0;
+            #pragma omp task shared(costs, left_changes)
+            left_changes= optimize_treelet(node.left, costs, depth +1);
+            #pragma omp task shared(costs, right_changes)
+            right_changes= optimize_treelet(node.right, costs, depth +1);
+            #pragma omp taskwait
+            changes= left_changes + right_changes;
+        }
+
+        // forme le treelet : les noeuds internes developpes, et les feuilles du treelet (des sous arbres quelconques)
+        int leaves[treelet_size];
+        int internals[treelet_size -1];
+        int m= 0;
+        int k= 0;
+        internals[k++]= index;
+        leaves[m++]= nodes[index].left;
+        leaves[m++]= nodes[index].right;
+        while(m < treelet_size)
+        {
+            int best= -1;
+            float best_area= -1;
+            for(int i= 0; i < m; i++)
+            {
+                const Node& leaf= nodes[leaves[i]];
+                if(leaf.right < 0)
+                    continue;
+
+                float area= node_area(leaf.pmin, leaf.pmax);
+                if(area > best_area)
+                {
+                    best= i;
+                    best_area= area;
+                }
+            }
+            if(best == -1)
+                break;
+
+            int expand= leaves[best];
+            internals[k++]= expand;
+            leaves[best]= nodes[expand].left;
+            leaves[m++]= nodes[expand].right;
+        }
+
+        // cout actuel du treelet : aires des noeuds internes + couts des feuilles
+        float current= 0;
+        for(int i= 0; i < k; i++)
+            current+= node_area(nodes[internals[i]].pmin, nodes[internals[i]].pmax);
+        for(int i= 0; i < m; i++)
+            current+= costs[leaves[i]];
+
+        // programmation dynamique : meilleur arbre pour chaque sous ensemble de feuilles
+        const int subsets= 1 << m;
+        float area[1 << treelet_size];
+        float best_cost[1 << treelet_size];
+        int best_split[1 << treelet_size];
+        Point bmin[1 << treelet_size];
+        Point bmax[1 << treelet_size];
+        for(int s= 1; s < subsets; s++)
+        {
+            int i= 0;
+            while(!(s & (1 << i))) i++;
+            int rest= s & ~(1 << i);
+            if(rest == 0)
+            {
+                bmin[s]= nodes[leaves[i]].pmin;
+                bmax[s]= nodes[leaves[i]].pmax;
+            }
+            else
+            {
+                bmin[s]= min(bmin[rest], nodes[leaves[i]].pmin);
+                bmax[s]= max(bmax[rest], nodes[leaves[i]].pmax);
+            }
+            area[s]= node_area(bmin[s], bmax[s]);
+        }
+
+        for(int s= 1; s < subsets; s++)
+        {
+            if((s & (s -1)) == 0)
+            {
+                // 1 seule feuille
+                int i= 0;
+                while(!(s & (1 << i))) i++;
+                best_cost[s]= costs[leaves[i]];
+                best_split[s]= 0;
+                continue;
+            }
+
+            // essaye toutes les partitions de s en 2, la premiere partie contient le bit de poids faible pour ne pas les evaluer 2 fois
+            int low= s & -s;
+            float cost= FLT_MAX;
+            int split= 0;
+            for(int p= (s - 1) & s; p > 0; p= (p - 1) & s)
+            {
+                if(!(p & low))
+                    continue;
+                float c= best_cost[p] + best_cost[s & ~p];
+                if(c < cost)
+                {
+                    cost= c;
+                    split= p;
+                }
+            }
+            best_cost[s]= area[s] + cost;
+            best_split[s]= split;
+        }
+
+        if(best_cost[subsets -1] >= current * 0.999f)
+        {
+            costs[index]= current;
+            return changes;
+        }
+
+        // reconstruit le treelet avec les noeuds internes existants, la racine reste index
+        int next= 0;
+        rebuild_treelet(subsets -1, leaves, internals, next, best_split, bmin, bmax);
+        costs[index]= best_cost[subsets -1];
+        return changes +1;
+    }
+
+    //! reconstruit le sous arbre du sous ensemble de feuilles s, renvoie l'indice de sa racine, cf optimize_treelet().
+    int rebuild_treelet( const int s, const int *leaves, const int *internals, int& next, const int *best_split, const Point *bmin, const Point *bmax )
+    {
+        if((s & (s -1)) == 0)
+        {
+            int i= 0;
+            while(!(s & (1 << i))) i++;
+            return leaves[i];
+        }
+
+        int index= internals[next++];
+        int left= rebuild_treelet(best_split[s], leaves, internals, next, best_split, bmin, bmax);
+        int right= rebuild_treelet(s & ~best_split[s], leaves, internals, next, best_split, bmin, bmax);
+
+        Node& node= nodes[index];
+        node.pmin= bmin[s];
+        node.pmax= bmax[s];
+        node.left= left;
+        node.right= right;
+        return index;
+    }
+
+// utilitaires
+    //! renvoie l'englobant des triangles[begin .. end[
+    void bounds( const int begin, const int end, Point& bmin, Point& bmax )
+    {
+        triangles[begin].bounds(bmin, bmax);
+        for(int i= begin +1; i < end; i++)
+        {
+            Point pmin, pmax;
+            triangles[i].bounds(pmin, pmax);
+
+            bmin= min(bmin, pmin);
+            bmax= max(bmax, pmax);
+        }
+    }
+
+    //! renvoie l'englobant des centres des triangles[begin .. end[
+    void centroid_bounds( const int begin, const int end, Point& bmin, Point& bmax )
+    {
+        Point pm= triangles[begin].centroid();
+        bmin= pm;
+        bmax= pm;
+        for(int i= begin +1; i < end; i++)
+        {
+            Point pm= triangles[i].centroid();
+            bmin= min(bmin, pm);
+            bmax= max(bmax, pm);
+        }
+    }
+
+    //! renvoie l'axe le plus etire d'un englobant
+    int bounds_max( const Point& pmin, const Point& pmax )
+    {
+        Vector d= pmax - pmin;
+        if(d.x > d.y && d.x > d.z) return 0;
+        else if(d.y > d.z) return 1;
+        else  return 2;
+    }
+
+    //! comparaison de 2 triangles, cf build_node, std::sort
+    struct triangle_less
+    {
+        int axis;
+        triangle_less( const int _axis ) : axis(_axis) {}
+
+        bool operator() ( const Triangle& a, const Triangle& b ) const
+        {
+            Point apmin, apmax;
+            a.bounds(apmin, apmax);
+
+            Point bpmin, bpmax;
+            b.bounds(bpmin, bpmax);
+
+            if(apmin(axis) < bpmin(axis)) return true;
+            else if(apmin(axis) == bpmin(axis)) return apmax(axis) < bpmax(axis);
+            return false;
+        }
+    };
+
+    //! position d'un triangle, cf build_centroids, std::partition
+    struct centroid_less1
+    {
+        int axis;
+        float cut;
+
+        centroid_less1( const int _axis, const float _cut ) : axis(_axis), cut(_cut) {}
+
+        bool operator() ( const Triangle& a ) const
+        {
+            Point am= a.centroid();
+            return am(axis) < cut;
+        }
+    };
+
+    //! renvoie la cellule contenant le centre c d'un triangle, cf build_node_sah().
+    static int bin_index( const float cmin, const float scale, const float c )
+    {
+        int k= int((c - cmin) * scale);
+        return std::max(0, std::min(k, sah_bins -1));
+    }
+
+    //! position d'un triangle par rapport a une coupe entre 2 cellules, cf build_node_sah, std::partition
+    struct bin_less
+    {
+        int axis;
+        float cmin;
+        float scale;
+        int bin;
+
+        bin_less( const int _axis, const float _cmin, const float _scale, const int _bin ) : axis(_axis), cmin(_cmin), scale(_scale), bin(_bin) {}
 
         bool operator() ( const Triangle& a ) const
         {
-            Point am= a.centroid();
-            return am(axis) < cut;
+            return bin_index(cmin, scale, a.centroid()(axis)) < bin;
+        }
+    };
+};
+
+
+//! englobants des W fils d'un noeud de WideBVH, stockes par composantes, pour les tester ensemble.
+template< int W >
+struct WideNode
+{
+    float bmin_x[W], bmin_y[W], bmin_z[W];
+    float bmax_x[W], bmax_y[W], bmax_z[W];
+    int child[W];       //!< indice du noeud fils, ou du premier triangle d'une feuille
+    int count[W];       //!< nombre de triangles d'une feuille, 0 pour un noeud, -1 pour un fils absent
+
+    //! initialise un noeud sans fils. l'englobant vide [+inf -inf] n'est jamais touche par un rayon.
+    WideNode( )
+    {
+        for(int k= 0; k < W; k++)
+        {
+            bmin_x[k]= FLT_MAX; bmin_y[k]= FLT_MAX; bmin_z[k]= FLT_MAX;
+            bmax_x[k]= -FLT_MAX; bmax_y[k]= -FLT_MAX; bmax_z[k]= -FLT_MAX;
+            child[k]= 0;
+            count[k]= -1;
+        }
+    }
+};
+
+//! rayon prepare pour les tests de WideBVH : inverse de la direction et plans d'entree / sortie de chaque axe.
+struct WideRay
+{
+    float ox, oy, oz;
+    float ix, iy, iz;
+    bool negx, negy, negz;
+
+    WideRay( const Ray& ray ) : ox(ray.o.x), oy(ray.o.y), oz(ray.o.z),
+        ix(1 / ray.d.x), iy(1 / ray.d.y), iz(1 / ray.d.z),
+        negx(ray.d.x < 0), negy(ray.d.y < 0), negz(ray.d.z < 0) {}
+};
+
+/*! teste les W englobants des fils d'un noeud, cf Node::intersect().
+    renvoie un masque : bit k == 1 si le fils k est touche dans l'intervalle [0 htmax], et la distance d'entree dans tnear[k].
+    version generique, cf les versions sse / avx ci-dessous.
+ */
+template< int W >
+inline int intersect_children( const WideNode<W>& node, const WideRay& ray, const float htmax, float *tnear )
+{
+    const float *nx= ray.negx ? node.bmax_x : node.bmin_x;
+    const float *fx= ray.negx ? node.bmin_x : node.bmax_x;
+    const float *ny= ray.negy ? node.bmax_y : node.bmin_y;
+    const float *fy= ray.negy ? node.bmin_y : node.bmax_y;
+    const float *nz= ray.negz ? node.bmax_z : node.bmin_z;
+    const float *fz= ray.negz ? node.bmin_z : node.bmax_z;
+
+    int mask= 0;
+    for(int k= 0; k < W; k++)
+    {
+        float tmin= std::max(std::max((nx[k] - ray.ox) * ray.ix, (ny[k] - ray.oy) * ray.iy), std::max((nz[k] - ray.oz) * ray.iz, 0.f));
+        float tmax= std::min(std::min(std::min((fx[k] - ray.ox) * ray.ix, (fy[k] - ray.oy) * ray.iy), (fz[k] - ray.oz) * ray.iz) * box_margin, htmax);
+        tnear[k]= tmin;
+        mask|= int(tmin <= tmax) << k;
+    }
+    return mask;
+}
+
+#if defined(__SSE__) || defined(_M_X64)
+//! teste les 4 englobants en meme temps, sse.
+template< >
+inline int intersect_children<4>( const WideNode<4>& node, const WideRay& ray, const float htmax, float *tnear )
+{
+    __m128 ox= _mm_set1_ps(ray.ox), oy= _mm_set1_ps(ray.oy), oz= _mm_set1_ps(ray.oz);
+    __m128 ix= _mm_set1_ps(ray.ix), iy= _mm_set1_ps(ray.iy), iz= _mm_set1_ps(ray.iz);
+
+    __m128 nx= _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.negx ? node.bmax_x : node.bmin_x), ox), ix);
+    __m128 fx= _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.negx ? node.bmin_x : node.bmax_x), ox), ix);
+    __m128 ny= _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.negy ? node.bmax_y : node.bmin_y), oy), iy);
+    __m128 fy= _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.negy ? node.bmin_y : node.bmax_y), oy), iy);
+    __m128 nz= _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.negz ? node.bmax_z : node.bmin_z), oz), iz);
+    __m128 fz= _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(ray.negz ? node.bmin_z : node.bmax_z), oz), iz);
+
+    __m128 tmin= _mm_max_ps(_mm_max_ps(nx, ny), _mm_max_ps(nz, _mm_setzero_ps()));
+    __m128 tmax= _mm_min_ps(_mm_mul_ps(_mm_min_ps(_mm_min_ps(fx, fy), fz), _mm_set1_ps(box_margin)), _mm_set1_ps(htmax));
+    _mm_storeu_ps(tnear, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+}
+#endif
+
+#ifdef __AVX__
+//! teste les 8 englobants en meme temps, avx.
+template< >
+inline int intersect_children<8>( const WideNode<8>& node, const WideRay& ray, const float htmax, float *tnear )
+{
+    __m256 ox= _mm256_set1_ps(ray.ox), oy= _mm256_set1_ps(ray.oy), oz= _mm256_set1_ps(ray.oz);
+    __m256 ix= _mm256_set1_ps(ray.ix), iy= _mm256_set1_ps(ray.iy), iz= _mm256_set1_ps(ray.iz);
+
+    __m256 nx= _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.negx ? node.bmax_x : node.bmin_x), ox), ix);
+    __m256 fx= _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.negx ? node.bmin_x : node.bmax_x), ox), ix);
+    __m256 ny= _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.negy ? node.bmax_y : node.bmin_y), oy), iy);
+    __m256 fy= _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.negy ? node.bmin_y : node.bmax_y), oy), iy);
+    __m256 nz= _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.negz ? node.bmax_z : node.bmin_z), oz), iz);
+    __m256 fz= _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ray.negz ? node.bmin_z : node.bmax_z), oz), iz);
+
+    __m256 tmin= _mm256_max_ps(_mm256_max_ps(nx, ny), _mm256_max_ps(nz, _mm256_setzero_ps()));
+    __m256 tmax= _mm256_min_ps(_mm256_mul_ps(_mm256_min_ps(_mm256_min_ps(fx, fy), fz), _mm256_set1_ps(box_margin)), _mm256_set1_ps(htmax));
+    _mm256_storeu_ps(tnear, tmin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+}
+#endif
+
+//! taille de la pile utilisee par WideBVH::intersect() et WideBVH::visible() : au plus W-1 noeuds en attente par niveau, + les W fils du noeud courant, W <= 8.
+//! un arbre W-aire construit par WideBVH::build() n'est pas plus profond que l'arbre binaire, cf max_tree_depth.
+const int wide_stack_size= 7 * max_tree_depth + 1;
+
+/*! arbre a W fils par noeud (BVH4, BVH8), construit en "aplatissant" un arbre binaire : chaque noeud recupere ses petits-fils
+    jusqu'a en avoir W, en developpant a chaque fois le fils de plus grande aire.
+    les englobants des W fils sont testes ensemble (sse pour W == 4, avx pour W == 8) et les fils touches sont visites du plus proche au plus loin.
+    les feuilles sont celles de l'arbre binaire, et utilisent les memes triangles, cf TriangleBlocks.
+ */
+template< int W >
+struct WideBVH
+{
+    std::vector< WideNode<W> > nodes;
+    TriangleBlocks blocks;
+    int root;
+
+    WideBVH( ) : nodes(), blocks(), root(-1) {}
+    WideBVH( const BVH& bvh ) : nodes(), blocks(), root(-1) { build(bvh); }
+
+    void build( const BVH& bvh )
+    {
+        auto cpu_start= std::chrono::high_resolution_clock::now();
+
+        nodes.clear();
+        blocks= bvh.blocks;
+        if(bvh.nodes[bvh.root].right < 0)
+        {
+            // l'arbre binaire est une seule feuille...
+            nodes.push_back( WideNode<W>() );
+            set_child(bvh, 0, 0, bvh.root);
+            root= 0;
+        }
+        else
+            root= collapse(bvh, bvh.root);
+
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("bvh%d: nodes %d, %d bytes/node, cpu  %ds %03dms\n", W, int(nodes.size()), int(sizeof(WideNode<W>)), int(cpu_time / 1000), int(cpu_time % 1000));
+    }
+
+    //! renvoie l'intersection *la plus proche* de l'origine du rayon, cf BVH::intersect().
+    Hit intersect( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+
+        WideRay wray(ray);
+        LeafRay lray(ray);
+        Hit hit;
+        hit.t= ray.tmax;
+
+        Entry stack[wide_stack_size];
+        int top= 0;
+        stack[top++]= Entry(root, 0, 0);
+        while(top > 0)
+        {
+            Entry entry= stack[--top];
+            if(entry.t > hit.t)
+                continue;       // le fils est plus loin que l'intersection deja trouvee
+
+            if(entry.count > 0)
+            {
+                // feuille
+                if(stats) stats->triangles+= entry.count;
+                if(Hit h= blocks.intersect(entry.index, entry.index + entry.count, lray, hit.t))
+                    hit= h;
+                continue;
+            }
+
+            // noeud, teste les W fils
+            if(stats) { stats->nodes+= W; stats->bytes+= sizeof(WideNode<W>); }
+            const WideNode<W>& node= nodes[entry.index];
+            float tnear[W];
+            int mask= intersect_children(node, wray, hit.t, tnear);
+
+            // trie les fils touches, du plus loin au plus proche
+            Entry children[W];
+            int n= 0;
+            for(int k= 0; k < W; k++)
+            {
+                if((mask & (1 << k)) == 0)
+                    continue;
+
+                Entry child(node.child[k], node.count[k], tnear[k]);
+                int i= n++;
+                for(; i > 0 && children[i -1].t < child.t; i--)
+                    children[i]= children[i -1];
+                children[i]= child;
+            }
+
+            // empile les fils, le plus proche sera visite en premier
+            assert(top + n <= wide_stack_size);
+            for(int i= 0; i < n; i++)
+                stack[top++]= children[i];
+        }
+
+        return hit;
+    }
+
+    //! renvoie vrai si aucun triangle ne se trouve sur le rayon dans l'intervalle [0 tmax], cf BVH::visible().
+    bool visible( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(root != -1);
+
+        WideRay wray(ray);
+        LeafRay lray(ray);
+
+        Entry stack[wide_stack_size];
+        int top= 0;
+        stack[top++]= Entry(root, 0, 0);
+        while(top > 0)
+        {
+            Entry entry= stack[--top];
+            if(entry.count > 0)
+            {
+                if(stats) stats->triangles+= entry.count;
+                if(blocks.occluded(entry.index, entry.index + entry.count, lray, ray.tmax))
+                    return false;
+                continue;
+            }
+
+            if(stats) { stats->nodes+= W; stats->bytes+= sizeof(WideNode<W>); }
+            const WideNode<W>& node= nodes[entry.index];
+            float tnear[W];
+            int mask= intersect_children(node, wray, ray.tmax, tnear);
+
+            // empile les fils touches, dans n'importe quel ordre
+            assert(top + W <= wide_stack_size);
+            for(int k= 0; k < W; k++)
+                if(mask & (1 << k))
+                    stack[top++]= Entry(node.child[k], node.count[k], 0);
+        }
+
+        return true;
+    }
+
+protected:
+    //! element de la pile de parcours : noeud ou feuille, et distance d'entree dans son englobant.
+    struct Entry
+    {
+        int index;
+        int count;
+        float t;
+
+        Entry( ) : index(0), count(0), t(0) {}
+        Entry( const int _index, const int _count, const float _t ) : index(_index), count(_count), t(_t) {}
+    };
+
+    //! construit le noeud correspondant au noeud interne index de l'arbre binaire, renvoie son indice.
+    int collapse( const BVH& bvh, const int index )
+    {
+        // recupere les fils, puis remplace le fils interne de plus grande aire par ses 2 fils, tant qu'il y a de la place
+        int children[W];
+        int n= 0;
+        children[n++]= bvh.nodes[index].left;
+        children[n++]= bvh.nodes[index].right;
+        while(n < W)
+        {
+            int best= -1;
+            float best_area= -1;
+            for(int k= 0; k < n; k++)
+            {
+                const Node& child= bvh.nodes[children[k]];
+                if(child.right < 0)
+                    continue;   // feuille
+
+                float area= node_area(child.pmin, child.pmax);
+                if(area > best_area)
+                {
+                    best= k;
+                    best_area= area;
+                }
+            }
+
+            if(best == -1)
+                break;  // que des feuilles
+
+            const Node& child= bvh.nodes[children[best]];
+            children[best]= child.left;
+            children[n++]= child.right;
+        }
+
+        // construit le noeud, puis ses fils, dans l'ordre : parcours en profondeur
+        int node= int(nodes.size());
+        nodes.push_back( WideNode<W>() );
+        for(int k= 0; k < n; k++)
+            set_child(bvh, node, k, children[k]);
+
+        return node;
+    }
+
+    //! initialise le fils k du noeud avec le noeud child de l'arbre binaire.
+    void set_child( const BVH& bvh, const int node, const int k, const int child )
+    {
+        const Node& c= bvh.nodes[child];
+        int index;
+        int count;
+        if(c.right < 0)
+        {
+            // feuille
+            index= -c.left;
+            count= -c.right - -c.left;
+        }
+        else
+        {
+            index= collapse(bvh, child);        // modifie nodes, ne pas garder de reference...
+            count= 0;
+        }
+
+        WideNode<W>& wide= nodes[node];
+        wide.bmin_x[k]= c.pmin.x; wide.bmin_y[k]= c.pmin.y; wide.bmin_z[k]= c.pmin.z;
+        wide.bmax_x[k]= c.pmax.x; wide.bmax_y[k]= c.pmax.y; wide.bmax_z[k]= c.pmax.z;
+        wide.child[k]= index;
+        wide.count[k]= count;
+    }
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+//! parcours sans pile de l'arbre binaire, meme interface que BVH, BVH4, etc. pour render() et bench().
+struct StacklessBVH
+{
+    const BVH& bvh;
+
+    StacklessBVH( const BVH& _bvh ) : bvh(_bvh) {}
+
+    Hit intersect( const Ray& ray, TraversalStats *stats= nullptr ) const { return bvh.intersect_stackless(ray, stats); }
+    bool visible( const Ray& ray, TraversalStats *stats= nullptr ) const { return bvh.visible_stackless(ray, stats); }
+};
+
+
+/*! noeud d'un arbre binaire range en profondeur d'abord, 32 octets : le fils gauche d'un noeud interne le suit directement dans le tableau,
+    seul l'indice du fils droit est conserve. les 2 fils sont proches en memoire, et le parcours descend le plus souvent vers le noeud suivant.
+ */
+struct LinearNode
+{
+    Point pmin;
+    int offset;             //!< indice du fils droit d'un noeud interne, ou du premier triangle d'une feuille
+    Point pmax;
+    uint16_t count;         //!< nombre de triangles d'une feuille, 0 pour un noeud interne
+    uint16_t axis;          //!< axe de separation des fils, pour visiter le plus proche en premier
+
+    int right( ) const { return offset; }
+    int first( ) const { return offset; }
+    int size( ) const { return count; }
+    int split( ) const { return axis; }
+};
+
+/*! noeud compresse, 16 octets : les englobants sont quantifies sur 16 bits par coordonnee, dans l'englobant de la racine,
+    arrondis vers l'exterieur pour rester conservatifs. 2 fois moins de memoire a lire, au prix de quelques tests supplementaires,
+    sur des englobants un peu plus grands.
+ */
+struct QuantizedNode
+{
+    uint16_t qmin[3];
+    uint16_t qmax[3];
+    uint32_t data;          //!< offset << 6 | axis << 4 | count, cf LinearNode
+
+    int right( ) const { return int(data >> 6); }
+    int first( ) const { return int(data >> 6); }
+    int size( ) const { return int(data & 15); }
+    int split( ) const { return int((data >> 4) & 3); }
+};
+
+/*! arbre binaire range en profondeur d'abord, construit a partir de BVH. N est LinearNode ou QuantizedNode.
+    parcours iteratif, le fils le plus proche, selon la direction du rayon sur l'axe de separation, est visite en premier.
+ */
+template< typename N >
+struct LinearBVH
+{
+    std::vector<N> nodes;
+    TriangleBlocks blocks;
+    Point origin;           //!< quantification des englobants, cf QuantizedNode
+    Vector scale;
+
+    LinearBVH( ) : nodes(), blocks(), origin(), scale() {}
+    LinearBVH( const BVH& bvh ) : nodes(), blocks(), origin(), scale() { build(bvh); }
+
+    void build( const BVH& bvh )
+    {
+        auto cpu_start= std::chrono::high_resolution_clock::now();
+
+        // grille de quantification : 65535 intervalles, un peu plus grande que l'englobant de la racine pour conserver la derniere coordonnee
+        const Node& root= bvh.nodes[bvh.root];
+        origin= root.pmin;
+        scale= (root.pmax - root.pmin) * (1.0001f / 65535);
+
+        nodes.clear();
+        nodes.reserve(bvh.nodes.size());
+        blocks= bvh.blocks;
+        flatten(bvh, bvh.root);
+
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("%s: nodes %d, %d bytes/node, cpu  %ds %03dms\n", name(), int(nodes.size()), int(sizeof(N)), int(cpu_time / 1000), int(cpu_time % 1000));
+    }
+
+    //! renvoie l'intersection *la plus proche* de l'origine du rayon, cf BVH::intersect().
+    Hit intersect( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(!nodes.empty());
+
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        LeafRay lray(ray);
+        bool neg[3]= { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0 };
+        Hit hit;
+        hit.t= ray.tmax;
+
+        int stack[visible_stack_size];
+        int top= 0;
+        int index= 0;
+        for(;;)
+        {
+            const N& node= nodes[index];
+            if(stats) { stats->nodes++; stats->bytes+= sizeof(N); }
+            if(bounds(node).intersect(ray, invd, hit.t))
+            {
+                if(node.size() > 0)
+                {
+                    // feuille
+                    if(stats) stats->triangles+= node.size();
+                    if(Hit h= blocks.intersect(node.first(), node.first() + node.size(), lray, hit.t))
+                        hit= h;
+                }
+                else
+                {
+                    // noeud interne, descend dans le fils le plus proche, conserve l'autre
+                    assert(top < visible_stack_size);
+                    if(neg[node.split()])
+                    {
+                        stack[top++]= index +1;
+                        index= node.right();
+                    }
+                    else
+                    {
+                        stack[top++]= node.right();
+                        index= index +1;
+                    }
+                    continue;
+                }
+            }
+
+            if(top == 0)
+                break;
+            index= stack[--top];
+        }
+
+        return hit;
+    }
+
+    //! renvoie vrai si aucun triangle ne se trouve sur le rayon dans l'intervalle [0 tmax], cf BVH::visible().
+    bool visible( const Ray& ray, TraversalStats *stats= nullptr ) const
+    {
+        assert(!nodes.empty());
+
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        LeafRay lray(ray);
+
+        int stack[visible_stack_size];
+        int top= 0;
+        int index= 0;
+        for(;;)
+        {
+            const N& node= nodes[index];
+            if(stats) { stats->nodes++; stats->bytes+= sizeof(N); }
+            if(bounds(node).intersect(ray, invd, ray.tmax))
+            {
+                if(node.size() > 0)
+                {
+                    if(stats) stats->triangles+= node.size();
+                    if(blocks.occluded(node.first(), node.first() + node.size(), lray, ray.tmax))
+                        return false;
+                }
+                else
+                {
+                    // descend dans le fils gauche, le noeud suivant, sans tenir compte de la direction du rayon
+                    assert(top < visible_stack_size);
+                    stack[top++]= node.right();
+                    index= index +1;
+                    continue;
+                }
+            }
+
+            if(top == 0)
+                break;
+            index= stack[--top];
+        }
+
+        return true;
+    }
+
+protected:
+    static const char *name( );
+
+    //! renvoie l'englobant du noeud.
+    Node bounds( const LinearNode& node ) const { return { node.pmin, node.pmax, 0, 0 }; }
+
+    Node bounds( const QuantizedNode& node ) const
+    {
+        return {
+            Point(origin.x + node.qmin[0] * scale.x, origin.y + node.qmin[1] * scale.y, origin.z + node.qmin[2] * scale.z),
+            Point(origin.x + node.qmax[0] * scale.x, origin.y + node.qmax[1] * scale.y, origin.z + node.qmax[2] * scale.z),
+            0, 0 };
+    }
+
+    //! range le noeud index de l'arbre binaire et ses fils, en profondeur d'abord, renvoie l'indice du noeud.
+    int flatten( const BVH& bvh, const int index )
+    {
+        const Node& node= bvh.nodes[index];
+        int linear= int(nodes.size());
+        nodes.push_back( N() );
+
+        int offset;
+        int count;
+        int axis= 0;
+        if(node.right < 0)
+        {
+            // feuille
+            offset= -node.left;
+            count= -node.right - -node.left;
+        }
+        else
+        {
+            // axe de separation des fils : celui qui separe le plus leurs centres
+            Vector d= (centroid(bvh.nodes[node.right]) - centroid(bvh.nodes[node.left]));
+            d= Vector(std::abs(d.x), std::abs(d.y), std::abs(d.z));
+            axis= (d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z) ? 1 : 2;
+
+            flatten(bvh, node.left);    // le fils gauche suit le noeud
+            offset= flatten(bvh, node.right);
+            count= 0;
+        }
+
+        set(nodes[linear], node, offset, count, axis);
+        return linear;
+    }
+
+    static Point centroid( const Node& node ) { return Point((node.pmin.x + node.pmax.x) / 2, (node.pmin.y + node.pmax.y) / 2, (node.pmin.z + node.pmax.z) / 2); }
+
+    void set( LinearNode& linear, const Node& node, const int offset, const int count, const int axis ) const
+    {
+        linear.pmin= node.pmin;
+        linear.pmax= node.pmax;
+        linear.offset= offset;
+        linear.count= uint16_t(count);
+        linear.axis= uint16_t(axis);
+    }
+
+    void set( QuantizedNode& quantized, const Node& node, const int offset, const int count, const int axis ) const
+    {
+        assert(offset < (1 << 26) && count < 16);
+        for(int k= 0; k < 3; k++)
+        {
+            // arrondis vers l'exterieur, avec une marge, les calculs de bounds() peuvent etre arrondis differemment
+            float qmin= (scale(k) > 0) ? std::floor((node.pmin(k) - origin(k)) / scale(k)) -1 : 0;
+            float qmax= (scale(k) > 0) ? std::ceil((node.pmax(k) - origin(k)) / scale(k)) +1 : 0;
+            quantized.qmin[k]= uint16_t(std::max(0.f, std::min(65535.f, qmin)));
+            quantized.qmax[k]= uint16_t(std::max(0.f, std::min(65535.f, qmax)));
+        }
+        quantized.data= uint32_t(offset) << 6 | uint32_t(axis) << 4 | uint32_t(count);
+    }
+};
+
+template< > inline const char *LinearBVH<LinearNode>::name( ) { return "linear"; }
+template< > inline const char *LinearBVH<QuantizedNode>::name( ) { return "quantized"; }
+
+typedef LinearBVH<LinearNode> LinearBVH32;
+typedef LinearBVH<QuantizedNode> LinearBVH16;
+
+
+struct World
+{
+    World( const Vector& _n ) : n(_n)
+    {
+        float sign= std::copysign(1.0f, n.z);
+        float a= -1.0f / (sign + n.z);
+        float d= n.x * n.y * a;
+        t= Vector(1.0f + sign * n.x * n.x * a, sign * d, -sign * n.x);
+        b= Vector(d, sign + n.y * n.y * a, -n.y);
+    }
+
+    // transforme le vecteur du repere local vers le repere du monde
+    Vector operator( ) ( const Vector& local )  const { return local.x * t + local.y * b + local.z * n; }
+
+    // transforme le vecteur du repere du monde vers le repere local
+    Vector inverse( const Vector& global ) const { return Vector(dot(global, t), dot(global, b), dot(global, n)); }
+
+    Vector t;
+    Vector b;
+    Vector n;
+};
+
+
+// genere une direction uniforme 1 / 2pi, cf GI compendium, eq 34
+struct UniformDirection
+{
+    UniformDirection( const int _n, const Vector& _z ) : world(_z), n(_n){}
+
+    Vector operator() ( const float u1, const float u2 ) const
+    {
+        float cos_theta= u1;
+        float phi= 2.f * float(M_PI) * u2;
+        float sin_theta= std::sqrt(std::max(0.f, 1.f - cos_theta*cos_theta));
+
+        return world(Vector(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta));
+    }
+
+    float pdf( const Vector& v ) const { if(dot(v, world.n) < 0) return 0; else return 1.f / (2.f * float(M_PI)); }
+    int size( ) const { return n; }
+
+protected:
+    World world;
+    int n;
+};
+
+// genere une direction distribuee selon cos theta / pi, cf GI compendium, eq 35
+struct CosineDirection
+{
+    CosineDirection( const Vector& _z ) : world(_z) {}
+
+    Vector operator() ( const float u1, const float u2 ) const
+    {
+        float cos_theta= std::sqrt(u1);
+        float phi= 2.f * float(M_PI) * u2;
+        float sin_theta= std::sqrt(std::max(0.f, 1.f - cos_theta*cos_theta));
+
+        return world(Vector(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta));
+    }
+
+    float pdf( const Vector& v ) const { float cos_theta= dot(v, world.n); if(cos_theta < 0) return 0; else return cos_theta / float(M_PI); }
+
+protected:
+    World world;
+};
+
+/*! renvoie le rayon primaire du pixel (px, py) de image, d'origine o, passant par le point jitter du pixel, (.5, .5) pour son centre.
+    mvpInv est l'inverse de projection * view, sans viewport : les coordonnees du pixel sont ramenees dans [-1 1] avec les dimensions de l'image.
+    Target est Image ou Accumulator.
+ */
+template< typename Target >
+Ray primary_ray( const Transform& mvpInv, const Point& o, const Target& image, const int px, const int py, const vec2& jitter= vec2(.5f, .5f) )
+{
+    Point e= mvpInv( Point((px + jitter.x) / (image.width() / 2.0) - 1, (py + jitter.y) / (image.height() / 2.0) - 1, 1) );    // extremite
+    return Ray(o, e);
+}
+
+/*! calcule l'image, cf main(). Accel est BVH, BVH4 ou BVH8. les blocs de pixels sont repartis entre les threads par scheduler.
+    les directions d'occultation de chaque pixel sont generees par un Sampler de type sampler_type.
+ */
+template< typename Accel >
+void render( const Accel& bvh, const ShadingTable& shading, Orbiter& camera, Image& image, TileScheduler& scheduler, const SamplerType sampler_type )
+{
+    // recupere les transformations view, projection et viewport pour generer les rayons
+    Transform m= Identity();
+    Transform v= camera.view();
+    Transform p= camera.projection(image.width(), image.height(), 45);
+    Transform mvp  = p * v * m ;
+    Transform mvpInv = mvp.inverse();
+
+// parcourir tous les pixels de l'image
+// en parallele, un bloc de pixels a la fois, cf TileScheduler
+    scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
+    {
+        Sampler sampler(sampler_type);
+
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
+        {
+            // generer le rayon pour le pixel (x, y), passant par son centre
+            Point o = camera.position();  // origine
+            Ray ray= primary_ray(mvpInv, o, image, px, py);
+
+            // calculer les intersections
+
+            if(Hit hit= bvh.intersect(ray))
+            {
+                // recupere les donnees sur l'intersection
+                Point p= point(hit, ray);               // point d'intersection
+                Vector pn= shading.normal(hit);       // normale interpolee du triangle au point d'intersection
+                if(dot(pn, ray.d) > 0)                  // retourne la normale vers l'origine du rayon
+                    pn= -pn;
+
+
+
+                  // Phong
+                Vector viewDir = normalize(ray.d);
+                Vector reflectDir = normalize(viewDir - 2.0 * dot(pn, viewDir) * pn);
+                float spec = pow(std::max(dot(viewDir, reflectDir), 0.0f), 64);
+
+                Color Specular = 0.8 * spec * shading.material(hit).specular;
+                Color Diffuse = shading.material(hit).diffuse* std::max(0.0f, dot(normalize(-pn), normalize(ray.d))) ;
+                Color Emission = shading.material(hit).emission;
+
+                // couleur du pixel
+                Color color= Black();
+                float factor = 0.0f;
+
+
+                int n = 32; // nombre directions
+                UniformDirection directions(n, pn);            // genere des directions uniformes 1 / 2pi
+                const float scale= 10;
+
+                for(int i= 0; i < directions.size(); i++)
+                {
+                    // genere la direction i sur n du pixel, cf Sampler
+                    sampler.start(px, py, i, n);
+                    vec2 u= sampler.sample2();
+                    Vector w= directions(u.x, u.y);
+
+                    // teste le rayon dans cette direction
+                    Ray shadow(p + pn * .001f, p + w * scale);
+                    if(bvh.visible(shadow))
+                    {
+                        float cos_theta_i =  abs(dot(normalize(pn), normalize(w)));
+                        factor += (cos_theta_i * (1.0/M_PI) / directions.pdf(w) )/n*1.0 ;
+                    }
+                }
+
+                Color Ambient = Color(1.0);
+                color = Ambient* factor  ;
+                image(px, py)= Color( color, 1);
+
+               // image(px, py)= Color(Diffuse + Specular + Emission, 1);
+            }
+        }
+    } );
+}
+
+
+//! direction i sur n de la spirale de fibonacci, la meme pour tous les points, cf generate_rays().
+Vector fibonacci_direction( const UniformDirection& directions, const int i, const int n )
+{
+    float cos0 = ( 1.0f - (2.0f*i + 1.0f)/(2.0f * n));
+    float perturbation = (std::sqrt(5.0) + 1.0f)/2.0f;
+    return directions(cos0, (i*1.0f+0.5f)/perturbation);
+}
+
+/*! calcule l'image comme render(), avec des paquets de N rayons : les rayons primaires d'un bloc de N pixels, puis les rayons d'ombre
+    de chaque point visible, N directions a la fois.
+ */
+template< int N >
+void render_packets( const BVH& bvh, const ShadingTable& shading, Orbiter& camera, Image& image, TileScheduler& scheduler, const SamplerType sampler_type, PacketStats *stats= nullptr )
+{
+    Transform v= camera.view();
+    Transform p= camera.projection(image.width(), image.height(), 45);
+    Transform mvpInv= (p * v).inverse();
+
+    // blocs de 2x2, 4x2 ou 4x4 pixels
+    const int tile_w= (N >= 8) ? 4 : 2;
+    const int tile_h= N / tile_w;
+    const int n= 32;    // nombre de directions, multiple de N
+    const float scale= 10;
+
+    // les blocs de pixels de scheduler sont decoupes en paquets, les statistiques sont accumulees par thread
+    PacketStats total;
+    scheduler.run<PacketStats>( [&]( const Tile& tile, PacketStats& local )
+    {
+        Sampler sampler(sampler_type);
+
+        for(int ty= tile.y0; ty < tile.y1; ty+= tile_h)
+        for(int tx= tile.x0; tx < tile.x1; tx+= tile_w)
+        {
+            RayPacket<N> primary;
+            for(int k= 0; k < N; k++)
+            {
+                int px= tx + k % tile_w;
+                int py= ty + k / tile_w;
+                if(px >= tile.x1 || py >= tile.y1)
+                    break;      // pas de trous dans le paquet, les blocs du bord sont incomplets...
+                Point o = camera.position();
+                primary.push(primary_ray(mvpInv, o, image, px, py));
+            }
+            bvh.intersect(primary, &local);
+
+            for(int k= 0; k < primary.count; k++)
+            {
+                const Hit& hit= primary.hits[k];
+                if(!hit)
+                    continue;
+
+                int px= tx + k % tile_w;
+                int py= ty + k / tile_w;
+
+                Ray ray= primary.ray(k);
+                Point p= point(hit, ray);
+                Vector pn= shading.normal(hit);
+                if(dot(pn, ray.d) > 0)
+                    pn= -pn;
+
+                // occultation ambiante, N directions a la fois
+                UniformDirection directions(n, pn);
+                float factor= 0;
+                for(int i= 0; i < n; i+= N)
+                {
+                    RayPacket<N> shadows;
+                    Vector w[N];
+                    for(int j= 0; j < N && i + j < n; j++)
+                    {
+                        sampler.start(px, py, i + j, n);
+                        vec2 u= sampler.sample2();
+                        w[j]= directions(u.x, u.y);
+                        shadows.push( Ray(p + pn * .001f, p + w[j] * scale) );
+                    }
+                    bvh.visible(shadows, &local);
+
+                    for(int j= 0; j < shadows.count; j++)
+                        if((shadows.occluded & (1 << j)) == 0)
+                        {
+                            float cos_theta_i =  std::abs(dot(normalize(pn), normalize(w[j])));
+                            factor += (cos_theta_i * (1.0/M_PI) / directions.pdf(w[j]) )/n*1.0 ;
+                        }
+                }
+
+                image(px, py)= Color(Color(1.0) * factor, 1);
+            }
+        }
+    },
+    [&]( const PacketStats& local )
+    {
+        total.packets+= local.packets;
+        total.nodes+= local.nodes;
+        total.active+= local.active;
+        total.fallbacks+= local.fallbacks;
+    } );
+
+    if(stats)
+        *stats= total;
+}
+
+/*! renvoie un echantillon d'occultation ambiante du point p, de normale pn, dans la direction generee par u, cf render_progressive().
+    les directions sont distribuees selon cos theta / pi, comme le terme cos theta / pi de l'integrale : l'echantillon vaut 1 ou 0,
+    et un point qui n'est pas occulte converge avec un seul echantillon, cf render_adaptive().
+ */
+template< typename Accel >
+Color occlusion_sample( const Accel& bvh, const Point& p, const Vector& pn, const vec2& u )
+{
+    const float scale= 10;
+    CosineDirection directions(pn);
+    Vector w= directions(u.x, u.y);
+    Ray shadow(p + pn * .001f, p + w * scale);
+    if(!bvh.visible(shadow))
+        return Black();
+
+    // cos theta / pi / pdf= 1
+    return White();
+}
+
+//! parametres du rendu progressif, cf render_progressive().
+struct ProgressiveOptions
+{
+    int max_passes;             //!< nombre maximum de passes, 1 echantillon par pixel et par passe
+    int min_passes;             //!< nombre de passes avant d'estimer l'erreur des blocs
+    float max_error;            //!< erreur relative acceptable d'un bloc, cf Accumulator::error()
+    float time_budget;          //!< duree maximum du rendu, en secondes
+    int snapshot;               //!< enregistre l'image toutes les snapshot passes, 0 pour ne pas enregistrer d'images intermediaires
+    const char *filename;       //!< image intermediaire .hdr
+
+    ProgressiveOptions( ) : max_passes(1024), min_passes(16), max_error(0.05f), time_budget(10), snapshot(16), filename("Partie_3_progressive.hdr") {}
+};
+
+/*! calcule l'image par passes successives : chaque passe ajoute 1 echantillon, un rayon primaire dans le pixel et une direction d'occultation,
+    a chaque pixel des blocs qui n'ont pas converge. le rendu s'arrete quand tous les blocs ont converge, apres max_passes, ou quand
+    la duree depasse time_budget. renvoie le nombre de passes.
+ */
+template< typename Accel >
+int render_progressive( const Accel& bvh, const ShadingTable& shading, Orbiter& camera, Accumulator& accumulator, TileScheduler& scheduler,
+    const SamplerType sampler_type, const ProgressiveOptions& options )
+{
+    Transform v= camera.view();
+    Transform p= camera.projection(accumulator.width(), accumulator.height(), 45);
+    Transform mvpInv= (p * v).inverse();
+    Point o= camera.position();     // origine des rayons, Orbiter::position() inverse la transformation a chaque appel...
+
+    auto start= std::chrono::high_resolution_clock::now();
+
+    std::vector<bool> converged(scheduler.tiles.size(), false);
+    int active= int(scheduler.tiles.size());
+    int pass= 0;
+    for(; pass < options.max_passes && active > 0; pass++)
+    {
+        scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
+        {
+            if(converged[tile.index])
+                return;
+
+            Sampler sampler(sampler_type);
+            for(int py= tile.y0; py < tile.y1; py++)
+            for(int px= tile.x0; px < tile.x1; px++)
+            {
+                // echantillon pass du pixel : position dans le pixel, puis direction d'occultation
+                sampler.start(px, py, pass, options.max_passes);
+                vec2 jitter= sampler.sample2();
+
+                Ray ray= primary_ray(mvpInv, o, accumulator, px, py, jitter);
+
+                Color color= Black();
+                if(Hit hit= bvh.intersect(ray))
+                {
+                    Point p= point(hit, ray);
+                    Vector pn= shading.normal(hit);
+                    if(dot(pn, ray.d) > 0)
+                        pn= -pn;
+
+                    color= occlusion_sample(bvh, p, pn, sampler.sample2());
+                }
+
+                accumulator.add(px, py, color);
+            }
+        } );
+
+        // estime l'erreur des blocs, et arrete ceux qui ont converge
+        if(pass +1 >= options.min_passes)
+            for(int i= 0; i < int(scheduler.tiles.size()); i++)
+                if(!converged[i] && accumulator.error(scheduler.tiles[i]) < options.max_error)
+                {
+                    converged[i]= true;
+                    active--;
+                }
+
+        float elapsed= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.f;
+        if(options.snapshot > 0 && (pass +1) % options.snapshot == 0)
+        {
+            printf("pass %d: %d/%d tiles active, %.1fs\n", pass +1, active, int(scheduler.tiles.size()), elapsed);
+            write_image_hdr(accumulator.image(), options.filename);
+        }
+
+        if(elapsed > options.time_budget)
+        {
+            printf("time budget %.1fs, stopping after %d passes, %d tiles active...\n", options.time_budget, pass +1, active);
+            pass++;
+            break;
+        }
+    }
+
+    return pass;
+}
+
+//! parametres du rendu adaptatif, cf render_adaptive().
+struct AdaptiveOptions
+{
+    int samples;                //!< nombre moyen d'echantillons par pixel, budget total de l'image
+    int initial;                //!< nombre d'echantillons de chaque pixel, avant d'estimer l'erreur
+    int batch;                  //!< nombre moyen d'echantillons par pixel repartis a chaque etape
+    int max_samples;            //!< nombre maximum d'echantillons d'un pixel
+
+    AdaptiveOptions( ) : samples(32), initial(8), batch(8), max_samples(512) {}
+};
+
+//! point visible et normale d'un pixel, cf visible_points().
+struct VisiblePoint
+{
+    Point p;
+    Vector n;               //!< normale interpolee, orientee vers la camera
+    bool hit;               //!< faux si le pixel ne voit aucun objet
+};
+
+/*! calcule le point visible de chaque pixel de image, en parallele, pour les rendus qui n'intersectent qu'une seule fois
+    le rayon primaire de chaque pixel, cf render_adaptive() et render_cached(). Target est Image ou Accumulator.
+ */
+template< typename Accel, typename Target >
+std::vector<VisiblePoint> visible_points( const Accel& bvh, const ShadingTable& shading, Orbiter& camera, const Target& image, TileScheduler& scheduler )
+{
+    Transform v= camera.view();
+    Transform p= camera.projection(image.width(), image.height(), 45);
+    Transform mvpInv= (p * v).inverse();
+    Point o= camera.position();
+
+    const int width= image.width();
+    std::vector<VisiblePoint> visibles(width * image.height());
+    scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
+    {
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
+        {
+            Ray ray= primary_ray(mvpInv, o, image, px, py);
+
+            VisiblePoint& visible= visibles[py * width + px];
+            visible.hit= false;
+            if(Hit hit= bvh.intersect(ray))
+            {
+                visible.p= point(hit, ray);
+                visible.n= shading.normal(hit);
+                if(dot(visible.n, ray.d) > 0)
+                    visible.n= -visible.n;
+                visible.hit= true;
+            }
+        }
+    } );
+
+    return visibles;
+}
+
+/*! calcule l'occultation ambiante comme render(), mais en repartissant les directions en fonction de l'erreur estimee de chaque pixel :
+    chaque pixel recoit d'abord initial echantillons, puis chaque etape distribue batch echantillons par pixel en moyenne,
+    proportionnellement a l'erreur relative des pixels, cf Accumulator::error(), jusqu'a epuiser le budget de samples echantillons par pixel.
+    un mur sans occultation converge avec les echantillons initiaux, les coins et les creux recoivent le reste.
+    le rayon primaire de chaque pixel n'est calcule qu'une seule fois.
+ */
+template< typename Accel >
+void render_adaptive( const Accel& bvh, const ShadingTable& shading, Orbiter& camera, Accumulator& accumulator, TileScheduler& scheduler,
+    const SamplerType sampler_type, const AdaptiveOptions& options )
+{
+    const int width= accumulator.width();
+    const int height= accumulator.height();
+
+    // point visible et normale de chaque pixel
+    std::vector<VisiblePoint> visibles= visible_points(bvh, shading, camera, accumulator, scheduler);
+
+    // nombre d'echantillons de chaque pixel pour l'etape, et reste de la repartition
+    std::vector<int> counts(width * height, options.initial);
+    std::vector<float> carry(width * height, 0);
+
+    // budget des pixels qui voient un objet, les autres n'ont pas d'occultation a estimer
+    long long visible_count= 0;
+    for(int i= 0; i < width * height; i++)
+        if(visibles[i].hit)
+            visible_count++;
+    long long budget= (long long) options.samples * visible_count;
+    for(int step= 0; budget > 0; step++)
+    {
+        if(step > 0)
+        {
+            // repartit les echantillons de l'etape proportionnellement a l'erreur relative des pixels,
+            // la variance a priori est celle d'un echantillon 0 ou 1 avec p= 1/2, cf occlusion_sample()
+            std::vector<float> errors(width * height, 0);
+            double total= 0;
+            for(int py= 0; py < height; py++)
+            for(int px= 0; px < width; px++)
+            {
+                int i= py * width + px;
+                if(visibles[i].hit && accumulator.samples(px, py) < options.max_samples)
+                    errors[i]= accumulator.error(px, py, 0.1f, 0.25f);
+                total+= errors[i];
+            }
+            if(total == 0)
+                break;  // toutes les estimations sont exactes...
+
+            long long step_budget= std::min(budget, (long long) options.batch * visible_count);
+            for(int i= 0; i < width * height; i++)
+            {
+                float n= float(step_budget * (errors[i] / total)) + carry[i];
+                counts[i]= int(n);
+                carry[i]= n - counts[i];
+            }
+        }
+
+        long long used= 0;
+        for(int i= 0; i < width * height; i++)
+        {
+            if(!visibles[i].hit)
+                counts[i]= 0;
+            used+= counts[i];
+        }
+        budget-= std::max(used, 1LL);
+
+        scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
+        {
+            Sampler sampler(sampler_type);
+            for(int py= tile.y0; py < tile.y1; py++)
+            for(int px= tile.x0; px < tile.x1; px++)
+            {
+                const VisiblePoint& visible= visibles[py * width + px];
+                int count= counts[py * width + px];
+                if(!visible.hit)
+                {
+                    if(accumulator.samples(px, py) == 0)
+                        accumulator.add(px, py, Black());
+                    continue;
+                }
+
+                for(int k= 0; k < count && accumulator.samples(px, py) < options.max_samples; k++)
+                {
+                    // les echantillons d'un pixel se suivent d'une etape a l'autre, cf Sampler
+                    sampler.start(px, py, accumulator.samples(px, py), options.max_samples);
+                    accumulator.add(px, py, occlusion_sample(bvh, visible.p, visible.n, sampler.sample2()));
+                }
+            }
+        } );
+    }
+}
+
+//! entete des fichiers .ao, cf write_occlusion_cache().
+struct OcclusionCacheHeader
+{
+    CacheHeader cache;          //!< "gkitao", et cle du fichier obj et des parametres du calcul
+    uint32_t samples;           //!< nombre de directions par sommet
+    uint64_t vertex_count;      //!< 2 valeurs par sommet, cf bake_occlusion()
+};
+
+const char occlusion_cache_magic[8]= "gkitao";
+const uint32_t occlusion_cache_version= 2;
+
+//! relit l'occultation des sommets sauvegardee par write_occlusion_cache(), renvoie faux si le fichier n'existe pas ou s'il ne correspond pas a key.
+bool read_occlusion_cache( const char *filename, const uint64_t key, const int vertex_count, std::vector<float>& occlusion )
+{
+    MappedFile file(filename);
+    if(!file)
+        return false;
+
+    OcclusionCacheHeader header;
+    size_t size= 0;
+    const unsigned char *data= read_cache_file(file, occlusion_cache_magic, occlusion_cache_version, key, header, size);
+    if(data == nullptr || header.vertex_count != uint64_t(vertex_count) || size != 2 * header.vertex_count * sizeof(float))
+    {
+        printf("[cache] '%s' is stale, baking...\n", filename);
+        return false;
+    }
+
+    occlusion.resize(2 * header.vertex_count);
+    memcpy(occlusion.data(), data, occlusion.size() * sizeof(float));
+    printf("[cache] read '%s', %u samples\n", filename, header.samples);
+    return true;
+}
+
+//! sauvegarde l'occultation des sommets, cf read_occlusion_cache().
+bool write_occlusion_cache( const char *filename, const uint64_t key, const int samples, const std::vector<float>& occlusion )
+{
+    OcclusionCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.samples= samples;
+    header.vertex_count= occlusion.size() / 2;
+
+    return write_cache_file(filename, header, occlusion_cache_magic, occlusion_cache_version, key,
+        { { occlusion.data(), occlusion.size() * sizeof(float) } });
+}
+
+/*! calcule l'occultation ambiante de chaque sommet du mesh, avec samples directions, cf occlusion_sample().
+    renvoie 2 valeurs par sommet, 1 pour un sommet qui n'est pas occulte, 0 pour un sommet completement occulte : l'occultation
+    du cote de la normale, puis du cote oppose. l'orientation des triangles n'est pas toujours coherente dans les fichiers obj,
+    et les rendus eclairent le cote visible des triangles, cf render(), render_baked().
+
+    les fichiers obj sont souvent relus sans indexation : les sommets partages par plusieurs triangles sont dupliques.
+    les sommets de meme position et de meme normale ne sont calcules qu'une fois. si le mesh n'a pas de normales, la normale
+    d'un sommet est la moyenne des normales des triangles qui partagent sa position.
+ */
+template< typename Accel >
+std::vector<float> bake_occlusion( const Accel& bvh, const Mesh& mesh, const int samples, const SamplerType sampler_type )
+{
+    const std::vector<vec3>& positions= mesh.positions();
+    const std::vector<unsigned int>& indices= mesh.indices();
+    const int n= int(positions.size());
+    const bool smooth= (mesh.normals().size() != positions.size());
+
+    // normales des sommets, ou somme des normales des triangles, ponderees par leur aire
+    std::vector<Vector> normals(n, Vector(0, 0, 0));
+    if(!smooth)
+    {
+        for(int i= 0; i < n; i++)
+            normals[i]= Vector(mesh.normals()[i]);
+    }
+    else
+    {
+        for(int id= 0; id < mesh.triangle_count(); id++)
+        {
+            int a= indices.size() ? indices[3*id] : 3*id;
+            int b= indices.size() ? indices[3*id +1] : 3*id +1;
+            int c= indices.size() ? indices[3*id +2] : 3*id +2;
+            Vector ng= cross(Point(positions[b]) - Point(positions[a]), Point(positions[c]) - Point(positions[a]));
+            normals[a]= normals[a] + ng;
+            normals[b]= normals[b] + ng;
+            normals[c]= normals[c] + ng;
+        }
+    }
+
+    // regroupe les sommets identiques : meme position, et meme normale si le mesh a des normales
+    auto key= [&]( const int i )
+    {
+        return smooth ? std::make_tuple(positions[i].x, positions[i].y, positions[i].z, 0.f, 0.f, 0.f)
+            : std::make_tuple(positions[i].x, positions[i].y, positions[i].z, normals[i].x, normals[i].y, normals[i].z);
+    };
+
+    std::vector<int> order(n);
+    for(int i= 0; i < n; i++)
+        order[i]= i;
+    std::sort(order.begin(), order.end(), [&]( const int a, const int b ) { return key(a) < key(b); });
+
+    std::vector<int> remap(n);
+    std::vector<Point> points;
+    std::vector<Vector> vertex_normals;
+    for(int k= 0; k < n; k++)
+    {
+        int i= order[k];
+        if(k == 0 || key(order[k -1]) != key(i))
+        {
+            points.push_back(Point(positions[i]));
+            vertex_normals.push_back(Vector(0, 0, 0));
+        }
+
+        int unique= int(points.size()) -1;
+        remap[i]= unique;
+        if(smooth)
+            vertex_normals[unique]= vertex_normals[unique] + normals[i];
+        else
+            vertex_normals[unique]= normals[i];
+    }
+
+    const int m= int(points.size());
+    printf("bake: %d vertices, %d unique, %d samples\n", n, m, samples);
+
+    // occultation des sommets uniques, les directions de chaque sommet sont generees comme les echantillons d'un pixel, cf Sampler
+    std::vector<float> unique_occlusion(2 * m, 1);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(int i= 0; i < m; i++)
+    {
+        float length2= dot(vertex_normals[i], vertex_normals[i]);
+        if(length2 == 0)
+            continue;   // triangles degeneres, pas d'orientation
+
+        Vector pn= vertex_normals[i] / std::sqrt(length2);
+        Sampler sampler(sampler_type);
+        for(int side= 0; side < 2; side++)
+        {
+            int visible= 0;
+            for(int s= 0; s < samples; s++)
+            {
+                sampler.start(i, side, s, samples);
+                if(occlusion_sample(bvh, points[i], side ? -pn : pn, sampler.sample2()).r > 0)
+                    visible++;
+            }
+            unique_occlusion[2*i + side]= float(visible) / float(samples);
+        }
+    }
+
+    std::vector<float> occlusion(2 * n);
+    for(int i= 0; i < n; i++)
+    {
+        occlusion[2*i]= unique_occlusion[2*remap[i]];
+        occlusion[2*i +1]= unique_occlusion[2*remap[i] +1];
+    }
+    return occlusion;
+}
+
+/*! affiche l'occultation ambiante precalculee sur les sommets, cf bake_occlusion() : 1 rayon par pixel, l'occultation est interpolee
+    entre les sommets du triangle visible, cf ShadingTable::color(). le cout ne depend plus du nombre de directions d'occultation.
+    la couleur des sommets contient l'occultation du cote de la normale, et alpha celle du cote oppose, cf main().
+ */
+template< typename Accel >
+void render_baked( const Accel& bvh, const ShadingTable& shading, Orbiter& camera, Image& image, TileScheduler& scheduler )
+{
+    Transform v= camera.view();
+    Transform p= camera.projection(image.width(), image.height(), 45);
+    Transform mvpInv= (p * v).inverse();
+    Point o= camera.position();
+
+    scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
+    {
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
+        {
+            Ray ray= primary_ray(mvpInv, o, image, px, py);
+
+            Color color= Black();
+            if(Hit hit= bvh.intersect(ray))
+            {
+                Color c= shading.color(hit);
+                float occlusion= (dot(shading.normal(hit), ray.d) > 0) ? c.a : c.r;
+                color= Color(occlusion, occlusion, occlusion, 1);
+            }
+
+            image(px, py)= color;
+        }
+    } );
+}
+
+/*! calcule l'occultation ambiante au point p de normale pn, et ses gradients, avec m x n directions stratifiees selon cos theta / pi, cf IrradianceCache.
+    "Irradiance Gradients", G. Ward, P. Heckbert, 1992, et "Radiance Caching for Efficient Global Illumination Computation", J. Krivanek et al, 2005
+    pour les gradients d'une distribution en cos theta. le rayon de validite est la moyenne harmonique des distances aux objets, limitee par
+    le gradient de translation : e / |gradient|, cf "Making Radiance and Irradiance Caching Practical", J. Krivanek, P. Gautron, 2006.
+ */
+template< typename Accel >
+IrradianceRecord occlusion_record( const Accel& bvh, const Point& p, const Vector& pn, const int m, const int n, Sampler& sampler )
+{
+    const float scale= 10;
+    World world(pn);
+
+    // visibilite et distance de chaque direction, les directions non occultees sont a distance scale
+    std::vector<float> visible(m * n);
+    std::vector<float> distance(m * n);
+    std::vector<float> sin_theta(m * n);
+    for(int k= 0; k < n; k++)
+    for(int j= 0; j < m; j++)
+    {
+        vec2 u= sampler.sample2();
+        float sin2= (j + u.x) / m;
+        float cos_theta= std::sqrt(std::max(0.f, 1 - sin2));
+        float phi= 2 * float(M_PI) * (k + u.y) / n;
+        Vector w= world(Vector(std::cos(phi) * std::sqrt(sin2), std::sin(phi) * std::sqrt(sin2), cos_theta));
+
+        int i= k * m + j;
+        sin_theta[i]= std::sqrt(sin2);
+        visible[i]= 1;
+        distance[i]= scale;
+        if(Hit hit= bvh.intersect(Ray(p + pn * .001f, p + w * scale)))
+        {
+            visible[i]= 0;
+            distance[i]= std::max(hit.t * scale, .001f);
+        }
+    }
+
+    IrradianceRecord record;
+    record.p= p;
+    record.n= pn;
+
+    float sum= 0;
+    float inv_distance= 0;
+    for(int i= 0; i < m * n; i++)
+    {
+        sum+= visible[i];
+        inv_distance+= 1 / distance[i];
+    }
+    record.e= sum / float(m * n);
+    record.radius= float(m * n) / inv_distance;
+
+    // gradients de l'eclairement divises par pi, comme l'occultation
+    Vector rotation= Vector(0, 0, 0);
+    Vector translation= Vector(0, 0, 0);
+    for(int k= 0; k < n; k++)
+    {
+        float phi= 2 * float(M_PI) * (k + .5f) / n;
+        float phi_minus= 2 * float(M_PI) * k / n;
+        Vector uk= world(Vector(std::cos(phi), std::sin(phi), 0));
+        Vector vk= world(Vector(-std::sin(phi), std::cos(phi), 0));
+        Vector vk_minus= world(Vector(-std::sin(phi_minus), std::cos(phi_minus), 0));
+        int previous= (k + n - 1) % n;
+
+        float rotation_sum= 0;
+        float theta_sum= 0;
+        float phi_sum= 0;
+        for(int j= 0; j < m; j++)
+        {
+            int i= k * m + j;
+            float cos_theta= std::sqrt(std::max(0.f, 1 - sin_theta[i] * sin_theta[i]));
+            rotation_sum+= -sin_theta[i] / std::max(cos_theta, 1e-3f) * visible[i];
+
+            // variation a la frontiere entre les strates j-1 et j, le long de theta
+            float sin_minus= std::sqrt(float(j) / m);
+            float cos_minus= std::sqrt(1 - float(j) / m);
+            float cos_plus= std::sqrt(1 - float(j + 1) / m);
+            if(j > 0)
+                theta_sum+= sin_minus * cos_minus * cos_minus / std::min(distance[i], distance[i - 1]) * (visible[i] - visible[i - 1]);
+
+            // variation a la frontiere entre les strates k-1 et k, le long de phi
+            int ip= previous * m + j;
+            phi_sum+= (cos_minus - cos_plus) / (std::max(sin_theta[i], 1e-3f) * std::min(distance[i], distance[ip])) * (visible[i] - visible[ip]);
+        }
+
+        rotation= rotation + vk * rotation_sum;
+        translation= translation + uk * (2 * float(M_PI) / n * theta_sum) + vk_minus * phi_sum;
+    }
+    record.rotation= rotation / float(m * n);
+    record.translation= translation / float(M_PI);
+
+    float gradient= length(record.translation);
+    if(gradient * record.radius > record.e)
+        record.radius= std::max(record.e, 1.f / float(m * n)) / gradient;
+
+    return record;
+}
+
+//! parametres du cache d'occultation, cf render_cached().
+struct CacheOptions
+{
+    float accuracy;             //!< erreur acceptable, cf IrradianceCache
+    int samples;                //!< nombre de directions de chaque echantillon du cache
+    int spacing;                //!< distance en pixels entre les echantillons de la premiere passe
+    float min_spacing;          //!< rayon de validite minimum, en pixels
+    float max_spacing;          //!< rayon de validite maximum, en pixels
+
+    CacheOptions( ) : accuracy(0.3f), samples(256), spacing(16), min_spacing(1.5f), max_spacing(64) {}
+};
+
+/*! calcule l'occultation ambiante avec un cache d'eclairement, cf IrradianceCache : l'integrale sur l'hemisphere n'est calculee que sur
+    quelques points visibles, et interpolee sur les autres pixels.
+
+    les pixels d'une grille de spacing x spacing sont testes en parallele, ceux qui ne sont couverts par aucun echantillon du cache calculent
+    un nouvel echantillon, en parallele, puis les nouveaux echantillons sont inseres dans l'octree. la grille est divisee par 2 a chaque passe,
+    jusqu'a tester tous les pixels. aucun thread ne modifie le cache pendant que les autres le lisent, il n'y a pas de verrou.
+    le rayon de validite des echantillons est limite en pixels, pour que les echantillons ne soient pas trop espaces a l'ecran, ni trop serres.
+    renvoie le nombre d'echantillons du cache.
+ */
+template< typename Accel >
+int render_cached( const Accel& bvh, const ShadingTable& shading, Orbiter& camera, Image& image, TileScheduler& scheduler,
+    const SamplerType sampler_type, const CacheOptions& options )
+{
+    Point o= camera.position();
+
+    const int width= image.width();
+    const int height= image.height();
+    const float pixel_angle= 2 * std::tan(radians(45) / 2) / height;   // taille d'un pixel a distance 1
+
+    // point visible et normale de chaque pixel, comme pour render_adaptive()
+    std::vector<VisiblePoint> visibles= visible_points(bvh, shading, camera, image, scheduler);
+
+    Point pmin= Point(FLT_MAX, FLT_MAX, FLT_MAX);
+    Point pmax= Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for(const VisiblePoint& visible : visibles)
+        if(visible.hit)
+        {
+            pmin= Point(std::min(pmin.x, visible.p.x), std::min(pmin.y, visible.p.y), std::min(pmin.z, visible.p.z));
+            pmax= Point(std::max(pmax.x, visible.p.x), std::max(pmax.y, visible.p.y), std::max(pmax.z, visible.p.z));
+        }
+
+    IrradianceCache cache(pmin, pmax, options.accuracy);
+    const int m= std::max(1, int(std::sqrt(options.samples / float(M_PI)) + .5f));
+    const int n= std::max(1, options.samples / m);
+
+    // occultation des pixels testes pendant la derniere passe, tous les pixels sont testes, -1 pour les pixels sans echantillon utilisable
+    std::vector<float> values(width * height, -1);
+
+    std::vector<int> candidates;
+    for(int spacing= std::max(1, options.spacing); spacing >= 1; spacing/= 2)
+    {
+        // pixels de la grille qui ne sont pas couverts par le cache
+        candidates.clear();
+        scheduler.run<std::vector<int>>(
+            [&]( const Tile& tile, std::vector<int>& uncovered )
+            {
+                for(int py= tile.y0; py < tile.y1; py++)
+                for(int px= tile.x0; px < tile.x1; px++)
+                {
+                    const VisiblePoint& visible= visibles[py * width + px];
+                    if(px % spacing != 0 || py % spacing != 0 || !visible.hit)
+                        continue;
+
+                    float e;
+                    if(!cache.lookup(visible.p, visible.n, e))
+                        uncovered.push_back(py * width + px);
+                    else if(spacing == 1)
+                        values[py * width + px]= e;
+                }
+            },
+            [&]( std::vector<int>& uncovered )
+            {
+                candidates.insert(candidates.end(), uncovered.begin(), uncovered.end());
+            } );
+
+        // l'ordre des echantillons ne depend pas de la repartition des blocs entre les threads
+        std::sort(candidates.begin(), candidates.end());
+
+        std::vector<IrradianceRecord> records(candidates.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int i= 0; i < int(candidates.size()); i++)
+        {
+            int px= candidates[i] % width;
+            int py= candidates[i] / width;
+            const VisiblePoint& visible= visibles[candidates[i]];
+
+            Sampler sampler(sampler_type);
+            sampler.start(px, py, 0, 1);
+            records[i]= occlusion_record(bvh, visible.p, visible.n, m, n, sampler);
+
+            // rayon de validite, en pixels, footprint : taille du pixel au point visible
+            float footprint= distance(o, visible.p) * pixel_angle;
+            float r= records[i].radius * options.accuracy;
+            r= std::max(options.min_spacing * footprint, std::min(options.max_spacing * footprint, r));
+            records[i].radius= r / options.accuracy;
+        }
+
+        for(const IrradianceRecord& record : records)
+            cache.insert(record);
+    }
+
+    // interpole le cache sur les pixels qui ont calcule un echantillon pendant la derniere passe
+    scheduler.run<NoScratch>( [&]( const Tile& tile, NoScratch& )
+    {
+        for(int py= tile.y0; py < tile.y1; py++)
+        for(int px= tile.x0; px < tile.x1; px++)
+        {
+            const VisiblePoint& visible= visibles[py * width + px];
+            float e= std::max(0.f, values[py * width + px]);
+            if(visible.hit && values[py * width + px] < 0)
+                cache.lookup(visible.p, visible.n, e);
+
+            e= std::min(e, 1.f);
+            image(px, py)= Color(e, e, e, 1);
+        }
+    } );
+
+    printf("cache: %d records, %d directions/record, %d nodes\n", int(cache.records.size()), m * n, int(cache.nodes.size()));
+    return int(cache.records.size());
+}
+
+//! source de lumiere : triangle emissif du mesh, cf Lights.
+struct Light
+{
+    Point a, b, c;
+    Vector n;               //!< normale geometrique
+    float area;
+    Color emission;
+};
+
+/*! sources de lumiere du mesh, les triangles dont la matiere emet de la lumiere, cf render_path().
+    les sources sont choisies proportionnellement a leur puissance, par une recherche dichotomique dans la fonction de repartition.
+ */
+struct Lights
+{
+    std::vector<Light> lights;
+    std::vector<float> cdf;         //!< fonction de repartition des puissances
+    std::vector<int> ids;           //!< indice de la source de chaque triangle de l'arbre, cf Hit::triangle_id, ou -1
+    float power;
+
+    Lights( ) = default;
+    Lights( const std::vector<Triangle>& triangles, const ShadingTable& shading ) { build(triangles, shading); }
+
+    //! construit les sources, triangles : triangles de l'arbre, cf BVH::triangles et ShadingTable.
+    void build( const std::vector<Triangle>& triangles, const ShadingTable& shading )
+    {
+        lights.clear();
+        cdf.clear();
+        ids.assign(triangles.size(), -1);
+        power= 0;
+
+        for(int id= 0; id < int(triangles.size()); id++)
+        {
+            const Material& material= shading.materials[shading.triangles[id].material];
+            if(material.emission.power() <= 0)
+                continue;
+
+            Light light;
+            light.a= triangles[id].a;
+            light.b= triangles[id].b;
+            light.c= triangles[id].c;
+            Vector ng= cross(light.b - light.a, light.c - light.a);
+            light.area= length(ng) / 2;
+            if(light.area == 0)
+                continue;
+            light.n= ng / (2 * light.area);
+            light.emission= material.emission;
+
+            ids[id]= int(lights.size());
+            lights.push_back(light);
+            power+= material.emission.power() * light.area;
+            cdf.push_back(power);
+        }
+    }
+
+    int size( ) const { return int(lights.size()); }
+
+    //! choisit une source, u uniforme [0 1[, renvoie son indice et la probabilite de la choisir.
+    int sample( const float u, float& pdf ) const
+    {
+        int id= int(std::upper_bound(cdf.begin(), cdf.end(), u * power) - cdf.begin());
+        id= std::min(id, size() -1);
+        pdf= this->pdf(id);
+        return id;
+    }
+
+    //! renvoie la probabilite de choisir la source id.
+    float pdf( const int id ) const { return (cdf[id] - (id > 0 ? cdf[id -1] : 0)) / power; }
+
+    //! renvoie un point uniforme sur la source.
+    Point point( const int id, const vec2& u ) const
+    {
+        const Light& light= lights[id];
+        float r= std::sqrt(u.x);
+        return (1 - r) * light.a + r * (1 - u.y) * light.b + r * u.y * light.c;
+    }
+};
+
+//! heuristique "puissance" de veach, pour combiner 2 strategies d'echantillonnage, cf render_path().
+float power_heuristic( const float pdf, const float other_pdf )
+{
+    return (pdf * pdf) / (pdf * pdf + other_pdf * other_pdf);
+}
+
+/*! brdf diffuse + reflet blinn-phong normalise, construite a partir des parametres de Material : diffuse, specular et ns.
+    f(wo, wi)= kd / pi + ks * (ns + 8) / (8 pi) * cos^ns theta_h, les coefficients sont reduits si kd + ks > 1, pour ne pas creer d'energie.
+    les directions sont choisies dans le lobe diffus ou dans le lobe speculaire, proportionnellement a kd et ks.
+ */
+struct BlinnPhong
+{
+    Color kd;
+    Color ks;
+    float ns;
+    float diffuse_probability;
+    Vector n;
+    Vector wo;
+
+    BlinnPhong( const Material& material, const Vector& _n, const Vector& _wo ) : kd(material.diffuse), ks(material.specular), ns(material.ns), n(_n), wo(_wo)
+    {
+        float scale= std::max(kd.r + ks.r, std::max(kd.g + ks.g, kd.b + ks.b));
+        if(scale > 1)
+        {
+            kd= kd / scale;
+            ks= ks / scale;
+        }
+
+        float d= kd.power();
+        float s= ks.power();
+        diffuse_probability= (d + s > 0) ? d / (d + s) : 1;
+    }
+
+    Color f( const Vector& wi ) const
+    {
+        if(dot(n, wi) <= 0)
+            return Black();
+
+        Vector h= normalize(wo + wi);
+        float cos_h= std::max(0.f, dot(n, h));
+        return kd / float(M_PI) + ks * ((ns + 8) / (8 * float(M_PI)) * std::pow(cos_h, ns));
+    }
+
+    float pdf( const Vector& wi ) const
+    {
+        float cos_theta= dot(n, wi);
+        if(cos_theta <= 0)
+            return 0;
+
+        Vector h= normalize(wo + wi);
+        float cos_h= std::max(0.f, dot(n, h));
+        float pdf_h= (ns + 1) / (2 * float(M_PI)) * std::pow(cos_h, ns);
+        float dot_h= dot(wo, h);
+        float specular= (dot_h > 0) ? pdf_h / (4 * dot_h) : 0;
+        return diffuse_probability * cos_theta / float(M_PI) + (1 - diffuse_probability) * specular;
+    }
+
+    //! choisit une direction, u : 2 nombres uniformes pour la direction, lobe : uniforme pour choisir le lobe.
+    Vector sample( const vec2& u, const float lobe ) const
+    {
+        if(lobe < diffuse_probability)
+            return CosineDirection(n)(u.x, u.y);
+
+        // demi vecteur distribue selon cos^ns theta_h, puis reflexion de wo
+        float cos_theta= std::pow(u.x, 1 / (ns + 1));
+        float sin_theta= std::sqrt(std::max(0.f, 1 - cos_theta * cos_theta));
+        float phi= 2 * float(M_PI) * u.y;
+        Vector h= World(n)(Vector(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta));
+        return 2 * dot(wo, h) * h - wo;
+    }
+};
+
+//! parametres du path tracer, cf render_path().
+struct PathOptions
+{
+    int samples;            //!< nombre de chemins par pixel
+    int max_depth;          //!< nombre maximum de rebonds
+    int roulette_depth;     //!< nombre de rebonds avant la roulette russe
+    Color sky;              //!< emission des rayons qui ne touchent rien, apres un rebond
+
+    PathOptions( ) : samples(16), max_depth(8), roulette_depth(3), sky(Black()) {}
+};
+
+//! compteurs du path tracer.
+struct PathStats
+{
+    long long paths;
+    long long rays;
+
+    PathStats( ) : paths(0), rays(0) {}
+};
+
+/*! estime la lumiere qui arrive le long du rayon, en suivant un chemin.
+    a chaque rebond, un point est choisi sur une source de lumiere ("next event estimation"), puis une direction est choisie selon la brdf.
+    si cette direction touche une source, les 2 strategies sont combinees avec l'heuristique puissance de veach, cf "Optimally Combining Sampling
+    Techniques for Monte Carlo Rendering", E. Veach, L. Guibas, 1995. apres roulette_depth rebonds, le chemin s'arrete avec une
+    probabilite qui depend de son energie (roulette russe).
+ */
+template< typename Accel >
+Color path( const Accel& bvh, const ShadingTable& shading, const Lights& lights, Ray ray, Sampler& sampler, const PathOptions& options, PathStats& stats )
+{
+    Color color= Black();
+    Color weight= White();
+    float bsdf_pdf= 0;          // pdf de la direction du rayon, choisie par la brdf du rebond precedent
+    for(int depth= 0; depth <= options.max_depth; depth++)
+    {
+        stats.rays++;
+        Hit hit= bvh.intersect(ray);
+        if(!hit)
+        {
+            if(depth > 0)
+                color= color + weight * options.sky;
+            break;
+        }
+
+        Point p= point(hit, ray);
+        Vector wo= -normalize(ray.d);
+        Vector pn= shading.normal(hit);
+        if(dot(pn, wo) < 0)
+            pn= -pn;
+
+        // emission du point, les sources emettent des 2 cotes
+        const Material& material= shading.material(hit);
+        int light_id= lights.ids[hit.triangle_id];
+        if(light_id >= 0)
+        {
+            if(depth == 0)
+                color= color + weight * material.emission;
+            else
+            {
+                // la source pouvait aussi etre choisie par la strategie des sources
+                const Light& light= lights.lights[light_id];
+                float d2= distance2(ray.o, p);
+                float cos_light= std::abs(dot(light.n, wo));
+                float light_pdf= (cos_light > 0) ? lights.pdf(light_id) * d2 / (light.area * cos_light) : 0;
+                color= color + weight * material.emission * power_heuristic(bsdf_pdf, light_pdf);
+            }
         }
-    };
-};
 
+        if(depth == options.max_depth)
+            break;
 
+        BlinnPhong bsdf(material, pn, wo);
 
-float node_area( const Point& pmin, const Point& pmax )
+        // choisit un point sur une source
+        if(lights.size() > 0)
+        {
+            float select_pdf;
+            int id= lights.sample(sampler.sample1(), select_pdf);
+            const Light& light= lights.lights[id];
+            Point q= lights.point(id, sampler.sample2());
+
+            Vector l= q - p;
+            float d2= dot(l, l);
+            l= l / std::sqrt(d2);
+            float cos_theta= dot(pn, l);
+            float cos_light= std::abs(dot(light.n, l));
+            if(cos_theta > 0 && cos_light > 0)
+            {
+                // rayon d'ombre, raccourci pour ne pas toucher la source
+                stats.rays++;
+                Ray shadow(p + pn * .001f, q - l * .001f);
+                if(bvh.visible(shadow))
+                {
+                    float light_pdf= select_pdf * d2 / (light.area * cos_light);
+                    color= color + weight * bsdf.f(l) * light.emission * (cos_theta * power_heuristic(light_pdf, bsdf.pdf(l)) / light_pdf);
+                }
+            }
+        }
+        else
+        {
+            // garde les memes dimensions du sampler pour chaque rebond
+            sampler.sample1();
+            sampler.sample2();
+        }
+
+        // choisit une direction selon la brdf
+        float lobe= sampler.sample1();
+        Vector wi= bsdf.sample(sampler.sample2(), lobe);
+        bsdf_pdf= bsdf.pdf(wi);
+        float cos_theta= dot(pn, wi);
+        if(bsdf_pdf <= 0 || cos_theta <= 0)
+            break;
+
+        weight= weight * bsdf.f(wi) * (cos_theta / bsdf_pdf);
+
+        // roulette russe
+        float roulette= sampler.sample1();
+        if(depth +1 >= options.roulette_depth)
+        {
+            float survive= std::min(.95f, std::max(weight.r, std::max(weight.g, weight.b)));
+            if(roulette >= survive)
+                break;
+            weight= weight / survive;
+        }
+
+        ray= Ray(p + pn * .001f, wi);
+    }
+
+    return color;
+}
+
+/*! calcule l'image avec un path tracer, options.samples chemins par pixel, cf path(). renvoie les compteurs de chemins et de rayons.
+ */
+template< typename Accel >
+PathStats render_path( const Accel& bvh, const ShadingTable& shading, const Lights& lights, Orbiter& camera, Image& image, TileScheduler& scheduler,
+    const SamplerType sampler_type, const PathOptions& options )
 {
-    Vector d(pmin, pmax);
-    return 2 * d.x*d.y + 2 * d.x*d.z + 2 * d.y*d.z;
+    Transform v= camera.view();
+    Transform p= camera.projection(image.width(), image.height(), 45);
+    Transform mvpInv= (p * v).inverse();
+    Point o= camera.position();
+
+    PathStats total;
+    scheduler.run<PathStats>(
+        [&]( const Tile& tile, PathStats& stats )
+        {
+            Sampler sampler(sampler_type);
+            for(int py= tile.y0; py < tile.y1; py++)
+            for(int px= tile.x0; px < tile.x1; px++)
+            {
+                Color color= Black();
+                for(int i= 0; i < options.samples; i++)
+                {
+                    sampler.start(px, py, i, options.samples);
+                    vec2 jitter= sampler.sample2();
+
+                    color= color + path(bvh, shading, lights, primary_ray(mvpInv, o, image, px, py, jitter), sampler, options, stats);
+                }
+
+                stats.paths+= options.samples;
+                image(px, py)= Color(color / float(options.samples), 1);
+            }
+        },
+        [&]( const PathStats& stats )
+        {
+            total.paths+= stats.paths;
+            total.rays+= stats.rays;
+        } );
+
+    return total;
 }
 
-struct World
+//! genere les rayons primaires d'un pixel sur step x step, et les rayons d'ombre / d'occultation de leurs intersections, cf render().
+void generate_rays( const BVH& bvh, const ShadingTable& shading, Orbiter& camera, const Image& image, const int step,
+    std::vector<Ray>& primary, std::vector<Ray>& shadows )
 {
-    World( const Vector& _n ) : n(_n)
+    Transform v= camera.view();
+    Transform p= camera.projection(image.width(), image.height(), 45);
+    Transform mvpInv= (p * v).inverse();
+
+    for(int py= 0; py < image.height(); py+= step)
+    for(int px= 0; px < image.width(); px+= step)
     {
-        float sign= std::copysign(1.0f, n.z);
-        float a= -1.0f / (sign + n.z);
-        float d= n.x * n.y * a;
-        t= Vector(1.0f + sign * n.x * n.x * a, sign * d, -sign * n.x);
-        b= Vector(d, sign + n.y * n.y * a, -n.y);
+        Point o = camera.position();
+        Ray ray= primary_ray(mvpInv, o, image, px, py);
+        primary.push_back(ray);
+
+        if(Hit hit= bvh.intersect(ray))
+        {
+            Point p= point(hit, ray);
+            Vector pn= shading.normal(hit);
+            if(dot(pn, ray.d) > 0)
+                pn= -pn;
+
+            int n = 32;
+            UniformDirection directions(n, pn);
+            const float scale= 10;
+            for(int i= 0; i < directions.size(); i++)
+            {
+                Vector w= fibonacci_direction(directions, i, n);
+                shadows.push_back( Ray(p + pn * .001f, p + w * scale) );
+            }
+        }
     }
+}
 
-    // transforme le vecteur du repere local vers le repere du monde
-    Vector operator( ) ( const Vector& local )  const { return local.x * t + local.y * b + local.z * n; }
+//! mesure le parcours d'un arbre : rayons primaires avec intersect(), rayons d'ombre avec visible(), sur 1 thread.
+template< typename Accel >
+void bench( const char *name, const Accel& bvh, const std::vector<Ray>& primary, const std::vector<Ray>& shadows )
+{
+    auto primary_start= std::chrono::high_resolution_clock::now();
+    long long hits= 0;
+    for(const Ray& ray : primary)
+        if(Hit hit= bvh.intersect(ray))
+            hits+= hit.triangle_id;     // verifie que tous les arbres trouvent les memes intersections
+    auto primary_stop= std::chrono::high_resolution_clock::now();
+
+    long long occluded= 0;
+    for(const Ray& ray : shadows)
+        if(!bvh.visible(ray))
+            occluded++;
+    auto shadow_stop= std::chrono::high_resolution_clock::now();
+
+    double primary_time= std::chrono::duration_cast<std::chrono::microseconds>(primary_stop - primary_start).count();
+    double shadow_time= std::chrono::duration_cast<std::chrono::microseconds>(shadow_stop - primary_stop).count();
+
+    // compte les tests des rayons d'ombre, avec visible() et avec intersect()
+    TraversalStats any_hit;
+    TraversalStats closest_hit;
+    for(const Ray& ray : shadows)
+    {
+        bvh.visible(ray, &any_hit);
+        bvh.intersect(ray, &closest_hit);
+    }
 
-    // transforme le vecteur du repere du monde vers le repere local
-    Vector inverse( const Vector& global ) const { return Vector(dot(global, t), dot(global, b), dot(global, n)); }
+    // et les noeuds lus par les rayons primaires
+    TraversalStats primary_hit;
+    for(const Ray& ray : primary)
+        bvh.intersect(ray, &primary_hit);
+
+    printf("%s: primary %.2f Mrays/s (checksum %lld), shadow %.2f Mrays/s (occluded %lld)\n", name,
+        primary.size() / primary_time, hits, shadows.size() / shadow_time, occluded);
+    printf("  shadow rays : visible()   %lld nodes, %lld triangles\n", any_hit.nodes, any_hit.triangles);
+    printf("  shadow rays : intersect() %lld nodes, %lld triangles\n", closest_hit.nodes, closest_hit.triangles);
+    if(closest_hit.nodes > 0 && closest_hit.triangles > 0)
+        printf("  saved %.1f%% node tests, %.1f%% triangle tests\n",
+            100.0 * (closest_hit.nodes - any_hit.nodes) / closest_hit.nodes,
+            100.0 * (closest_hit.triangles - any_hit.triangles) / closest_hit.triangles);
+    printf("  node bandwidth : primary %.0f bytes/ray, shadow %.0f bytes/ray\n",
+        double(primary_hit.bytes) / primary.size(), double(any_hit.bytes) / shadows.size());
+}
+//! affiche l'utilisation des paquets : proportion de rayons actifs dans les noeuds visites, sous arbres termines rayon par rayon.
+template< int N >
+void print_packet_stats( const char *name, const PacketStats& stats )
+{
+    printf("  %s packets: %.1f nodes/packet, utilization %.1f%%, %.2f fallbacks/packet\n", name,
+        double(stats.nodes) / std::max(1LL, stats.packets),
+        100.0 * stats.active / std::max(1LL, stats.nodes * N),
+        double(stats.fallbacks) / std::max(1LL, stats.packets));
+}
 
-    Vector t;
-    Vector b;
-    Vector n;
-};
+//! mesure le parcours des paquets de N rayons consecutifs, cf bench(). les rayons d'ombre d'un point sont consecutifs.
+template< int N >
+void bench_packets( const BVH& bvh, const std::vector<Ray>& primary, const std::vector<Ray>& shadows )
+{
+    PacketStats primary_stats;
+    auto primary_start= std::chrono::high_resolution_clock::now();
+    long long hits= 0;
+    for(size_t i= 0; i < primary.size(); i+= N)
+    {
+        RayPacket<N> packet;
+        for(size_t k= i; k < primary.size() && k < i + N; k++)
+            packet.push(primary[k]);
+        bvh.intersect(packet, &primary_stats);
+        for(int k= 0; k < packet.count; k++)
+            if(packet.hits[k])
+                hits+= packet.hits[k].triangle_id;
+    }
+    auto primary_stop= std::chrono::high_resolution_clock::now();
 
+    PacketStats shadow_stats;
+    long long occluded= 0;
+    for(size_t i= 0; i < shadows.size(); i+= N)
+    {
+        RayPacket<N> packet;
+        for(size_t k= i; k < shadows.size() && k < i + N; k++)
+            packet.push(shadows[k]);
+        bvh.visible(packet, &shadow_stats);
+        for(int k= 0; k < packet.count; k++)
+            if(packet.occluded & (1 << k))
+                occluded++;
+    }
+    auto shadow_stop= std::chrono::high_resolution_clock::now();
+
+    double primary_time= std::chrono::duration_cast<std::chrono::microseconds>(primary_stop - primary_start).count();
+    double shadow_time= std::chrono::duration_cast<std::chrono::microseconds>(shadow_stop - primary_stop).count();
+    printf("packet%d: primary %.2f Mrays/s (checksum %lld), shadow %.2f Mrays/s (occluded %lld)\n", N,
+        primary.size() / primary_time, hits, shadows.size() / shadow_time, occluded);
+    print_packet_stats<N>("primary", primary_stats);
+    print_packet_stats<N>("shadow ", shadow_stats);
+}
 
-// genere une direction uniforme 1 / 2pi, cf GI compendium, eq 34
-struct UniformDirection
+
+/*! verifie qu'il n'y a pas de fissures entre les triangles : les rayons visent un point d'une arete partagee par 2 triangles,
+    et doivent toucher un triangle avant (ou sur) l'arete. renvoie le nombre de rayons qui passent a travers.
+ */
+template< typename Accel >
+int crack_test( const char *name, const Accel& bvh, const std::vector<Ray>& rays )
 {
-    UniformDirection( const int _n, const Vector& _z ) : world(_z), n(_n){}
+    int misses= 0;
+    #pragma omp parallel for schedule(static) reduction(+: misses)
+    for(int i= 0; i < int(rays.size()); i++)
+        if(!bvh.intersect(rays[i]))
+            misses++;
+
+    printf("%s: %d / %d rays through shared edges\n", name, misses, int(rays.size()));
+    return misses;
+}
 
-    Vector operator() ( const float u1, const float u2 ) const
+/*! genere count rayons pour crack_test() : vise des points des aretes partagees par 2 triangles (presque) coplanaires,
+    depuis une direction aleatoire, pas rasante. le point vise est a l'interieur de la surface formee par les 2 triangles, meme s'il n'est pas
+    exactement sur l'arete, un rayon ne peut pas passer a travers.
+ */
+void generate_edge_rays( const BVH& bvh, const int count, std::vector<Ray>& rays )
+{
+    // aretes des triangles, les 2 sommets dans un ordre fixe pour retrouver les aretes partagees
+    struct Edge
     {
-        float cos_theta= u1;
-        float phi= 2.f * float(M_PI) * u2;
-        float sin_theta= std::sqrt(std::max(0.f, 1.f - cos_theta*cos_theta));
+        Point a, b;
+        int triangle;
 
-        return world(Vector(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta));
+        bool operator< ( const Edge& e ) const
+        {
+            for(int k= 0; k < 3; k++)
+                if(a(k) != e.a(k)) return a(k) < e.a(k);
+            for(int k= 0; k < 3; k++)
+                if(b(k) != e.b(k)) return b(k) < e.b(k);
+            return false;
+        }
+    };
+
+    std::vector<Edge> edges;
+    edges.reserve(bvh.triangles.size() * 3);
+    for(int i= 0; i < int(bvh.triangles.size()); i++)
+    {
+        const Triangle& triangle= bvh.triangles[i];
+        const Point *p[3]= { &triangle.a, &triangle.b, &triangle.c };
+        for(int k= 0; k < 3; k++)
+        {
+            Edge edge= { *p[k], *p[(k +1) % 3], i };
+            Edge flip= { edge.b, edge.a, i };
+            edges.push_back((flip < edge) ? flip : edge);
+        }
     }
+    std::sort(edges.begin(), edges.end());
+
+    // ne garde que les aretes partagees par exactement 2 triangles coplanaires
+    auto normal= [&]( const int i ) { const Triangle& t= bvh.triangles[i]; return normalize(cross(Vector(t.a, t.b), Vector(t.a, t.c))); };
+    auto centroid= [&]( const int i ) { const Triangle& t= bvh.triangles[i]; return t.a + (Vector(t.a, t.b) + Vector(t.a, t.c)) / 3; };
+    std::vector<Edge> shared;
+    std::vector<Vector> normals;
+    for(size_t i= 0; i < edges.size(); )
+    {
+        size_t j= i +1;
+        while(j < edges.size() && !(edges[i] < edges[j]))
+            j++;
 
-    float pdf( const Vector& v ) const { if(dot(v, world.n) < 0) return 0; else return 1.f / (2.f * float(M_PI)); }
-    int size( ) const { return n; }
+        if(j - i == 2)
+        {
+            // et les 2 triangles doivent etre de part et d'autre de l'arete
+            Vector n0= normal(edges[i].triangle);
+            Vector n1= normal(edges[i +1].triangle);
+            Vector e(edges[i].a, edges[i].b);
+            Vector s0= cross(e, Vector(edges[i].a, centroid(edges[i].triangle)));
+            Vector s1= cross(e, Vector(edges[i].a, centroid(edges[i +1].triangle)));
+            if(std::abs(dot(n0, n1)) > 0.999f && dot(s0, s1) < 0)
+            {
+                shared.push_back(edges[i]);
+                normals.push_back(n0);
+            }
+        }
+        i= j;
+    }
+    printf("cracks: %d shared flat edges\n", int(shared.size()));
+    if(shared.empty())
+        return;
+
+    const Node& root= bvh.nodes[bvh.root];
+    float radius= length(Vector(root.pmin, root.pmax));
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u01(0.f, 1.f);
+    while(int(rays.size()) < count)
+    {
+        int e= std::min(int(u01(rng) * shared.size()), int(shared.size()) -1);
+        const Edge& edge= shared[e];
+        Point q= edge.a + (0.1f + 0.8f * u01(rng)) * Vector(edge.a, edge.b);
+
+        // direction uniforme, pas rasante
+        float z= 1 - 2 * u01(rng);
+        float r= std::sqrt(std::max(0.f, 1 - z*z));
+        float phi= 2 * float(M_PI) * u01(rng);
+        Vector d= Vector(r * std::cos(phi), r * std::sin(phi), z);
+        if(std::abs(dot(d, normals[e])) < 0.1f)
+            continue;
+
+        // origine a l'exterieur de la scene
+        Ray ray(q + radius * d, q);
+        ray.tmax= 1.0001f;      // l'intersection doit exister avant le point vise, ou sur ce point
+        rays.push_back(ray);
+    }
+}
+
+//! compare les tests rayon / triangle des feuilles, sur l'arbre Accel, cf TriangleTest.
+template< typename Accel >
+void bench_triangles( BVH& bvh, const std::vector<Ray>& primary, const std::vector<Ray>& shadows, const std::vector<Ray>& edges )
+{
+    const char *names[]= { "moller", "watertight", "plane" };
+    TriangleTest tests[]= { TEST_MOLLER, TEST_WATERTIGHT, TEST_PLANE };
+    TriangleTest test= bvh.triangle_test;
+    for(int i= 0; i < 3; i++)
+    {
+        bvh.blocks.build(bvh.triangles, tests[i]);
+        Accel accel(bvh);
+        if(!primary.empty())
+            bench(names[i], accel, primary, shadows);
+        if(!edges.empty())
+            crack_test(names[i], accel, edges);
+    }
+    bvh.blocks.build(bvh.triangles, test);
+}
+
+/*! compare le cout du shading des intersections des rayons : normale interpolee et matiere, avec Mesh::triangle() et Mesh::triangle_material(),
+    comme les rendus avant ShadingTable, ou avec ShadingTable.
+ */
+void bench_shading( const BVH& bvh, const Mesh& mesh, const ShadingTable& shading, const std::vector<Ray>& rays )
+{
+    std::vector<Hit> hits;
+    for(int i= 0; i < int(rays.size()); i++)
+        if(Hit hit= bvh.intersect(rays[i]))
+            hits.push_back(hit);
+    if(hits.empty())
+        return;
+
+    // meme table, rangee dans l'ordre du mesh, et indexee par l'indice du triangle dans le mesh
+    std::vector<Triangle> order= bvh.triangles;
+    std::sort(order.begin(), order.end(), []( const Triangle& a, const Triangle& b ) { return a.id < b.id; });
+    ShadingTable mesh_shading(mesh, order);
+    std::vector<Hit> mesh_hits= hits;
+    for(int i= 0; i < int(hits.size()); i++)
+        mesh_hits[i].triangle_id= bvh.triangles[hits[i].triangle_id].id;
+
+    // 0 : Mesh::triangle(), 1 : table dans l'ordre du mesh, 2 : table dans l'ordre de l'arbre.
+    // chaque version est mesuree plusieurs fois, en alternance, et garde son meilleur temps
+    const int repeat= 10;
+    float checksum[3]= { 0, 0, 0 };
+    float times[3]= { FLT_MAX, FLT_MAX, FLT_MAX };
+    for(int r= 0; r < repeat; r++)
+    for(int k= 0; k < 3; k++)
+    {
+        float sum= 0;
+        auto start= std::chrono::high_resolution_clock::now();
+        for(int i= 0; i < int(hits.size()); i++)
+        {
+            Vector pn;
+            Color color;
+            if(k == 0)
+            {
+                int id= mesh_hits[i].triangle_id;
+                TriangleData triangle= mesh.triangle(id);
+                pn= normal(hits[i], triangle);
+                color= mesh.triangle_material(id).diffuse + mesh.triangle_material(id).specular + mesh.triangle_material(id).emission;
+            }
+            else
+            {
+                const ShadingTable& table= (k == 1) ? mesh_shading : shading;
+                const Hit& hit= (k == 1) ? mesh_hits[i] : hits[i];
+                pn= table.normal(hit);
+                const Material& material= table.material(hit);
+                color= material.diffuse + material.specular + material.emission;
+            }
+            sum+= pn.x + pn.y + pn.z + color.r;
+        }
+        auto stop= std::chrono::high_resolution_clock::now();
+        times[k]= std::min(times[k], std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / float(hits.size()));
+        checksum[k]= sum;
+    }
+
+    printf("shading: %d hits, mesh %.1fns/hit, table (mesh order) %.1fns/hit, table (tree order) %.1fns/hit, %.2fx\n", int(hits.size()),
+        times[0], times[1], times[2], times[0] / times[2]);
+    printf("shading: checksums %f %f %f\n", checksum[0], checksum[1], checksum[2]);
+    printf("shading: table %.1fMB\n", (shading.triangles.size() * sizeof(ShadingTriangle) + shading.texcoords.size() * sizeof(vec2)) / (1024.f * 1024.f));
+}
 
-protected:
-    World world;
-    int n;
-};
 
 int main( const int argc, const char **argv )
 {
     const char *mesh_filename= "fruit_v2.obj";
     const char *orbiter_filename= "fruit_v2.txt"; // Scene 1
-    // Triangles: 207 226 SAH cost: 40,48  nodes: 414451
+    // Triangles: 207 226 SAH cost: 40,48  nodes: 414451     (BUILD_CENTROIDS)
 
 
     //const char *mesh_filename= "Lighting_Challenge_24_theCabin.obj";
     //const char *orbiter_filename= "light.txt"; // Scene 2
-    // Triangles: 422 735 SAH cost: 29.9  nodes: 845469
+    // Triangles: 422 735 SAH cost: 29.9  nodes: 845469     (BUILD_CENTROIDS)
 
     //const char *mesh_filename= "TheCarnival.obj";
     //const char *orbiter_filename= "carnival.txt"; // Scene 3
-    // Triangles: 449 858 SAH cost: 21,7 nodes: 889715
-
-
-    if(argc > 1) mesh_filename= argv[1];
+    // Triangles: 449 858 SAH cost: 21,7 nodes: 889715     (BUILD_CENTROIDS)
+
+    // Partie3 [mesh.obj] [options]
+    //  -camera orbiter.txt
+    //  -builder sort | centroids | sah | lbvh | lbvh30 : construction de l'arbre, sah par defaut
+    //  -leaf n : nombre maximum de triangles par feuille
+    //  -treelet n : nombre de passes d'optimisation des treelets, apres une construction lbvh
+    //  -width 2 | 4 | 8 : nombre de fils par noeud de l'arbre utilise pour le rendu
+    //  -layout tree | linear | quantized : representation de l'arbre binaire (width 2), noeuds ranges en profondeur d'abord pour linear et quantized
+    //  -stackless : parcours sans pile de l'arbre binaire (width 2, layout tree)
+    //  -packet 4 | 8 | 16 : rendu par paquets de rayons, avec l'arbre binaire
+    //  -tile 16 | 32 : taille des blocs de pixels repartis entre les threads, 16x16 par defaut
+    //  -triangle moller | watertight | plane : test rayon / triangle des feuilles, moller par defaut
+    //  -sampler random | fibonacci | sobol : directions d'occultation de chaque pixel, sobol par defaut, cf Sampler
+    //  -progressive : rendu progressif, jusqu'a convergence de tous les blocs, cf render_progressive()
+    //  -time s : duree maximum du rendu progressif, en secondes
+    //  -error e : erreur relative acceptable d'un bloc, pour le rendu progressif
+    //  -passes n : nombre maximum de passes du rendu progressif
+    //  -adaptive : repartit les directions d'occultation en fonction de l'erreur de chaque pixel, cf render_adaptive()
+    //  -spp n : nombre moyen de directions par pixel du rendu adaptatif, 32 par defaut
+    //  -path n : path tracer, n chemins par pixel, eclairage direct et indirect des sources du mesh, cf render_path()
+    //  -depth n : nombre maximum de rebonds du path tracer, 8 par defaut
+    //  -sky v : emission du ciel pour le path tracer, 1 par defaut si le mesh n'a pas de sources, 0 sinon
+    //  -cache : calcule l'occultation sur quelques points et l'interpole sur les autres pixels, cf render_cached()
+    //  -accuracy a : erreur acceptable du cache, 0.3 par defaut
+    //  -bake n : calcule l'occultation des sommets avec n directions, l'enregistre dans mesh.obj.ao, et l'affiche, cf bake_occlusion()
+    //  -cracks : verifie que les rayons ne passent pas entre les triangles qui partagent une arete, avec chaque test rayon / triangle
+    //  -bench : compare le parcours des arbres binaire, bvh4 et bvh8 avant le rendu
+    //  -bench_shading : compare seulement le shading des intersections, avec Mesh::triangle() et avec la table, cf bench_shading(), sans rendu
+    //  -nocache : reconstruit l'arbre et l'occultation des sommets, sans relire ni ecrire mesh.obj.bvh et mesh.obj.ao
+    BVHBuilder builder= BUILD_SAH;
+    int max_leaf= leaf_lanes;
+    int treelet_passes= 0;
+#ifdef __AVX__
+    int width= 8;
+#else
+    int width= 4;
+#endif
+    std::string layout= "tree";
+    bool run_bench= false;
+    bool run_bench_shading= false;
+    bool use_cache= true;
+    bool stackless= false;
+    int packet= 0;
+    int tile_size= 16;
+    bool run_cracks= false;
+    bool progressive= false;
+    ProgressiveOptions progressive_options;
+    bool adaptive= false;
+    AdaptiveOptions adaptive_options;
+    int bake_samples= 0;
+    bool cached= false;
+    bool path_trace= false;
+    PathOptions path_options;
+    float sky= -1;
+    CacheOptions cache_options;
+    TriangleTest triangle_test= TEST_MOLLER;
+    SamplerType sampler_type= SAMPLER_SOBOL;
+    for(int i= 1; i < argc; i++)
+    {
+        std::string option= argv[i];
+        if(option == "-camera" && i +1 < argc) orbiter_filename= argv[++i];
+        else if(option == "-builder" && i +1 < argc)
+        {
+            std::string name= argv[++i];
+            if(name == "sort") builder= BUILD_SORT;
+            else if(name == "centroids") builder= BUILD_CENTROIDS;
+            else if(name == "sah") builder= BUILD_SAH;
+            else if(name == "lbvh") builder= BUILD_LBVH;
+            else if(name == "lbvh30") builder= BUILD_LBVH30;
+            else printf("[error] unknown builder '%s', using sah...\n", name.c_str());
+        }
+        else if(option == "-leaf" && i +1 < argc) max_leaf= atoi(argv[++i]);
+        else if(option == "-treelet" && i +1 < argc) treelet_passes= atoi(argv[++i]);
+        else if(option == "-width" && i +1 < argc)
+        {
+            width= atoi(argv[++i]);
+            if(width != 2 && width != 4 && width != 8)
+            {
+                printf("[error] unsupported width '%s', use 2, 4 or 8...\n", argv[i]);
+                return 1;
+            }
+        }
+        else if(option == "-layout" && i +1 < argc)
+        {
+            layout= argv[++i];
+            if(layout != "tree" && layout != "linear" && layout != "quantized")
+            {
+                printf("[error] unknown layout '%s', use tree, linear or quantized...\n", argv[i]);
+                return 1;
+            }
+        }
+        else if(option == "-bench") run_bench= true;
+        else if(option == "-bench_shading") run_bench_shading= true;
+        else if(option == "-nocache") use_cache= false;
+        else if(option == "-stackless") stackless= true;
+        else if(option == "-packet" && i +1 < argc) packet= atoi(argv[++i]);
+        else if(option == "-tile" && i +1 < argc) tile_size= atoi(argv[++i]);
+        else if(option == "-progressive") progressive= true;
+        else if(option == "-time" && i +1 < argc) progressive_options.time_budget= atof(argv[++i]);
+        else if(option == "-error" && i +1 < argc) progressive_options.max_error= atof(argv[++i]);
+        else if(option == "-passes" && i +1 < argc) progressive_options.max_passes= atoi(argv[++i]);
+        else if(option == "-adaptive") adaptive= true;
+        else if(option == "-spp" && i +1 < argc) adaptive_options.samples= atoi(argv[++i]);
+        else if(option == "-path" && i +1 < argc) { path_trace= true; path_options.samples= atoi(argv[++i]); }
+        else if(option == "-depth" && i +1 < argc) path_options.max_depth= atoi(argv[++i]);
+        else if(option == "-sky" && i +1 < argc) sky= atof(argv[++i]);
+        else if(option == "-cache") cached= true;
+        else if(option == "-accuracy" && i +1 < argc) cache_options.accuracy= atof(argv[++i]);
+        else if(option == "-bake" && i +1 < argc) bake_samples= atoi(argv[++i]);
+        else if(option == "-cracks") run_cracks= true;
+        else if(option == "-triangle" && i +1 < argc)
+        {
+            std::string name= argv[++i];
+            if(name == "moller") triangle_test= TEST_MOLLER;
+            else if(name == "watertight") triangle_test= TEST_WATERTIGHT;
+            else if(name == "plane") triangle_test= TEST_PLANE;
+            else printf("[error] unknown triangle test '%s', using moller...\n", name.c_str());
+        }
+        else if(option == "-sampler" && i +1 < argc)
+        {
+            std::string name= argv[++i];
+            if(name == "random") sampler_type= SAMPLER_RANDOM;
+            else if(name == "fibonacci") sampler_type= SAMPLER_FIBONACCI;
+            else if(name == "sobol") sampler_type= SAMPLER_SOBOL;
+            else printf("[error] unknown sampler '%s', using sobol...\n", name.c_str());
+        }
+        else if(option[0] != '-') mesh_filename= argv[i];
+        else printf("[error] unknown option '%s'...\n", argv[i]);
+    }
 
     Mesh mesh= read_mesh(mesh_filename);
-    assert(mesh.triangle_count());
+    if(mesh.triangle_count() == 0)
+    {
+        printf("[error] no triangles in '%s'...\n", mesh_filename);
+        return 1;
+    }
     printf("triangles %d\n", mesh.triangle_count());
 
-    BVH bvh;
-    bvh.build(mesh);
-
-    printf("root %d, nodes %d, triangles %d\n", bvh.root, int(bvh.nodes.size()), int(bvh.triangles.size()));
-
-    // evaluer le cout de l'arbre
-    const Node& root= bvh.nodes[bvh.root];
-    double root_area= node_area(root.pmin, root.pmax);    // aire de l'englobant de la racine
+    // les feuilles ont au plus leaf_lanes triangles, cf TriangleBlocks
+    if(max_leaf < 1 || max_leaf > leaf_lanes)
+    {
+        printf("[error] leaf size %d, using %d...\n", max_leaf, std::max(1, std::min(max_leaf, leaf_lanes)));
+        max_leaf= std::max(1, std::min(max_leaf, leaf_lanes));
+    }
 
-    double cost= 0;
-    for(const Node& node : bvh.nodes)
+    const char *builder_names[]= { "sort", "centroids", "sah", "lbvh", "lbvh30" };
+    printf("builder %s, leaf size %d\n", builder_names[builder], max_leaf);
+
+    BVH bvh(max_leaf);
+    bvh.treelet_passes= treelet_passes;
+    bvh.triangle_test= triangle_test;
+
+    // l'arbre est sauvegarde a cote du fichier obj, et identifie par le contenu du fichier et les parametres de construction
+    std::string cache_filename= std::string(mesh_filename) + ".bvh";
+    uint64_t mesh_key= hash_file(mesh_filename);
+    uint64_t cache_key= mesh_key;
+    cache_key= hash_bytes(&builder, sizeof(builder), cache_key);
+    cache_key= hash_bytes(&bvh.max_leaf, sizeof(bvh.max_leaf), cache_key);
+    cache_key= hash_bytes(&bvh.treelet_passes, sizeof(bvh.treelet_passes), cache_key);
+    if(!use_cache || !bvh.read_cache(cache_filename.c_str(), cache_key, mesh.triangle_count()))
     {
-        if(node.right < 0)
-        {
-            // feuille
-            int begin= -node.left;
-            int end= -node.right;
-            int n= end - begin;
-            cost+= node_area(node.pmin, node.pmax) / root_area * n;  // n intersections rayon / triangles par visite
-        }
-        else
-        {
-            // noeud interne
-            cost+= node_area(node.pmin, node.pmax) / root_area * 1;  // 1 intersection rayon / bbox par visite
-        }
+        bvh.build(mesh, builder);
+        if(use_cache)
+            bvh.write_cache(cache_filename.c_str(), cache_key);
     }
-    printf("SAH cost %lf\n", cost);
 
+    printf("root %d, nodes %d, triangles %d\n", bvh.root, int(bvh.nodes.size()), int(bvh.triangles.size()));
+
+    // evaluer le cout de l'arbre
+    printf("SAH cost %lf\n", bvh.cost());
 
 
     // creer l'image resultat
@@ -554,97 +4833,256 @@ int main( const int argc, const char **argv )
         // erreur, pas de camera
         return 1;
 
-    // recupere les transformations view, projection et viewport pour generer les rayons
-    Transform m= Identity();
-    Transform v= camera.view();
-    Transform p= camera.projection(image.width(), image.height(), 45);
-    Transform mvp  = p * v * m ;
-    Transform mvpInv = mvp.inverse();
-// parcourir tous les pixels de l'image
-// en parallele avec openMP, un thread par bloc de 16 lignes
-#pragma omp parallel for schedule(dynamic, 16)
-    for(int py= 0; py < image.height(); py++)
+    BVH4 bvh4;
+    BVH8 bvh8;
+    if(width == 4 || run_bench) bvh4.build(bvh);
+    if(width == 8 || run_bench) bvh8.build(bvh);
+
+    LinearBVH32 linear;
+    LinearBVH16 quantized;
+    if(run_bench || (width == 2 && layout == "linear")) linear.build(bvh);
+    if(run_bench || (width == 2 && layout == "quantized")) quantized.build(bvh);
+
+    if(bake_samples > 0)
     {
-         // nombres aleatoires, version c++11
-        std::random_device seed;
-        // un generateur par thread... pas de synchronisation
-        std::mt19937 rng(seed());
-        std::uniform_real_distribution<float> u01(0.f, 1.f);
+        // occultation des sommets, sauvegardee a cote du fichier obj et identifiee comme l'arbre, cf BVH::read_cache()
+        std::string ao_filename= std::string(mesh_filename) + ".ao";
+        uint64_t ao_key= hash_bytes(&bake_samples, sizeof(bake_samples), mesh_key);
+        ao_key= hash_bytes(&sampler_type, sizeof(sampler_type), ao_key);
 
-        for(int px= 0; px < image.width(); px++)
+        std::vector<float> occlusion;
+        if(!use_cache || !read_occlusion_cache(ao_filename.c_str(), ao_key, mesh.vertex_count(), occlusion))
         {
-            // generer le rayon pour le pixel (x, y)
-            float x= px + .5f;          // centre du pixel
-            float y= py + .5f;
+            auto bake_start= std::chrono::high_resolution_clock::now();
 
-            Point o = camera.position();  // origine
-            Point e = mvpInv( Point(x/512.0 - 1, y/320.0 - 1 , 1) ) ;  // extremite
+            if(width == 4) occlusion= bake_occlusion(bvh4, mesh, bake_samples, sampler_type);
+            else if(width == 8) occlusion= bake_occlusion(bvh8, mesh, bake_samples, sampler_type);
+            else occlusion= bake_occlusion(bvh, mesh, bake_samples, sampler_type);
 
+            auto bake_stop= std::chrono::high_resolution_clock::now();
+            int bake_time= std::chrono::duration_cast<std::chrono::milliseconds>(bake_stop - bake_start).count();
+            printf("bake  %ds %03dms\n", int(bake_time / 1000), int(bake_time % 1000));
 
-            // calculer les intersections
-            Ray ray(o, e);
+            if(use_cache)
+                write_occlusion_cache(ao_filename.c_str(), ao_key, bake_samples, occlusion);
+        }
 
-            if(Hit hit= bvh.intersect(ray))
-            {
-                // recupere les donnees sur l'intersection
-                TriangleData triangle= mesh.triangle(hit.triangle_id);
-                Point p= point(hit, ray);               // point d'intersection
-                Vector pn= normal(hit, triangle);       // normale interpolee du triangle au point d'intersection
-                if(dot(pn, ray.d) > 0)                  // retourne la normale vers l'origine du rayon
-                    pn= -pn;
+        // range l'occultation dans les couleurs des sommets, alpha : occultation du cote oppose a la normale, cf render_baked()
+        std::vector<vec4> colors(mesh.vertex_count());
+        for(int i= 0; i < mesh.vertex_count(); i++)
+            colors[i]= vec4(occlusion[2*i], occlusion[2*i], occlusion[2*i], occlusion[2*i +1]);
+        mesh.colors(colors);
+    }
 
+    // normales et matieres des triangles, pour le shading des intersections
+    auto shading_start= std::chrono::high_resolution_clock::now();
+    ShadingTable shading(mesh, bvh.triangles);
+    auto shading_stop= std::chrono::high_resolution_clock::now();
+    printf("shading table: %d triangles, cpu %dms\n", int(shading.triangles.size()),
+        int(std::chrono::duration_cast<std::chrono::milliseconds>(shading_stop - shading_start).count()));
 
+    std::vector<Ray> primary;
+    std::vector<Ray> shadows;
+    if(run_bench)
+    {
+        // rayons primaires de tous les pixels, rayons d'ombre d'un pixel sur 4x4
+        generate_rays(bvh, shading, camera, image, 1, primary, shadows);
+        shadows.clear();
+        std::vector<Ray> tmp;
+        generate_rays(bvh, shading, camera, image, 4, tmp, shadows);
+        printf("bench: %d primary rays, %d shadow rays\n", int(primary.size()), int(shadows.size()));
+
+        bench("bvh2", bvh, primary, shadows);
+        bench("stackless", StacklessBVH(bvh), primary, shadows);
+        bench("linear", linear, primary, shadows);
+        bench("quantized", quantized, primary, shadows);
+        bench("bvh4", bvh4, primary, shadows);
+        bench("bvh8", bvh8, primary, shadows);
+
+        bench_packets<4>(bvh, primary, shadows);
+        bench_packets<8>(bvh, primary, shadows);
+        bench_packets<16>(bvh, primary, shadows);
+
+        bench_shading(bvh, mesh, shading, primary);
+    }
+    else if(run_bench_shading)
+    {
+        generate_rays(bvh, shading, camera, image, 1, primary, shadows);
+        bench_shading(bvh, mesh, shading, primary);
+        return 0;
+    }
 
-                  // Phong
-                Vector viewDir = normalize(ray.d);
-                Vector reflectDir = normalize(viewDir - 2.0 * dot(pn, viewDir) * pn);
-                float spec = pow(std::max(dot(viewDir, reflectDir), 0.0f), 64);
+    if(run_bench || run_cracks)
+    {
+        // compare les tests rayon / triangle, sur l'arbre utilise pour le rendu
+        std::vector<Ray> edges;
+        if(run_cracks)
+            generate_edge_rays(bvh, 1000000, edges);
+
+        if(width == 4) bench_triangles<BVH4>(bvh, primary, shadows, edges);
+        else if(width == 8) bench_triangles<BVH8>(bvh, primary, shadows, edges);
+        else bench_triangles<BVH>(bvh, primary, shadows, edges);
+    }
 
-                Color Specular = 0.8 * spec * mesh.triangle_material(hit.triangle_id).specular;
-                Color Diffuse = mesh.triangle_material(hit.triangle_id).diffuse* std::max(0.0f, dot(normalize(-pn), normalize(ray.d))) ;
-                Color Emission = mesh.triangle_material(hit.triangle_id).emission;
+    // blocs de pixels dans l'ordre de morton, multiples de la taille des paquets
+    if(tile_size != 16 && tile_size != 32)
+    {
+        printf("[error] tile size %d, using 16...\n", tile_size);
+        tile_size= 16;
+    }
+    TileScheduler scheduler(morton_tiles(image.width(), image.height(), tile_size));
 
-                // couleur du pixel
-                Color color= Black();
-                float factor = 0.0f;
+    if(bake_samples > 0)
+    {
+        auto baked_start= std::chrono::high_resolution_clock::now();
 
+        if(width == 4) render_baked(bvh4, shading, camera, image, scheduler);
+        else if(width == 8) render_baked(bvh8, shading, camera, image, scheduler);
+        else render_baked(bvh, shading, camera, image, scheduler);
 
-                int n = 32; // nombre directions
-                UniformDirection directions(n, pn);            // genere des directions uniformes 1 / 2pi
-                const float scale= 10;
+        auto baked_stop= std::chrono::high_resolution_clock::now();
+        int baked_time= std::chrono::duration_cast<std::chrono::milliseconds>(baked_stop - baked_start).count();
+        printf("render baked  %ds %03dms\n", int(baked_time / 1000), int(baked_time % 1000));
 
-                for(int i= 0; i < directions.size(); i++)
-                {
-                    //******************Directions aléatoires*************************
-                    // genere une direction
-                    //Vector w= directions(u01(rng), u01(rng)); //
-                    //*******************************************
-
-                    //****************Spirale de Fibonacci***************************
-                      float cos0 = ( 1.0f - (2.0f*i + 1.0f)/(2.0f * n)); //  spirale de Fibonacci
-                      float perturbation = (std::sqrt(5.0) + 1.0f)/2.0f;
-                      Vector w= directions(cos0, (i*1.0f+0.5f)/perturbation);
-                    //*******************************************
-                    // teste le rayon dans cette direction
-                    Ray shadow(p + pn * .001f, p + w * scale);
-                    if(bvh.visible(shadow))
-                    {
-                        float cos_theta_i =  abs(dot(normalize(pn), normalize(w)));
-                        factor += (cos_theta_i * (1.0/M_PI) / directions.pdf(w) )/n*1.0 ;
-                    }
-                }
+        write_image_hdr(image, "Partie_3_baked.hdr");
+        write_image(image, "Partie_3_Ambient_Fruit_Test.png");
+        return 0;
+    }
 
-                Color Ambient = Color(1.0);
-                color = Ambient* factor  ;
-                image(px, py)= Color( color, 1);
+    if(path_trace)
+    {
+        Lights lights(bvh.triangles, shading);
+        path_options.sky= Color(sky >= 0 ? sky : (lights.size() > 0 ? 0 : 1));
+        printf("path: %d lights, %d samples/pixel, depth %d\n", lights.size(), path_options.samples, path_options.max_depth);
 
-               // image(px, py)= Color(Diffuse + Specular + Emission, 1);
-            }
+        auto path_start= std::chrono::high_resolution_clock::now();
+
+        PathStats stats;
+        if(width == 4) stats= render_path(bvh4, shading, lights, camera, image, scheduler, sampler_type, path_options);
+        else if(width == 8) stats= render_path(bvh8, shading, lights, camera, image, scheduler, sampler_type, path_options);
+        else stats= render_path(bvh, shading, lights, camera, image, scheduler, sampler_type, path_options);
+
+        auto path_stop= std::chrono::high_resolution_clock::now();
+        int path_time= std::chrono::duration_cast<std::chrono::milliseconds>(path_stop - path_start).count();
+
+        // chemins et rayons par seconde, pour estimer la duree d'un rendu
+        double seconds= std::max(path_time, 1) / 1000.0;
+        printf("render path  %ds %03dms, %.2f Msamples/s, %.2f Mrays/s, %.2f rays/path\n", int(path_time / 1000), int(path_time % 1000),
+            stats.paths / seconds / 1e6, stats.rays / seconds / 1e6, double(stats.rays) / double(std::max(stats.paths, 1LL)));
+        scheduler.print_times();
+
+        write_image_hdr(image, "Partie_3_path.hdr");
+        write_image(image, "Partie_3_Ambient_Fruit_Test.png");
+        return 0;
+    }
+
+    if(cached)
+    {
+        auto cached_start= std::chrono::high_resolution_clock::now();
+
+        int records= 0;
+        if(width == 4) records= render_cached(bvh4, shading, camera, image, scheduler, sampler_type, cache_options);
+        else if(width == 8) records= render_cached(bvh8, shading, camera, image, scheduler, sampler_type, cache_options);
+        else records= render_cached(bvh, shading, camera, image, scheduler, sampler_type, cache_options);
+
+        auto cached_stop= std::chrono::high_resolution_clock::now();
+        int cached_time= std::chrono::duration_cast<std::chrono::milliseconds>(cached_stop - cached_start).count();
+        printf("render cached  %ds %03dms, %.1f occlusion rays/pixel\n", int(cached_time / 1000), int(cached_time % 1000),
+            double(records) * cache_options.samples / (image.width() * image.height()));
+
+        write_image_hdr(image, "Partie_3_cached.hdr");
+        write_image(image, "Partie_3_Ambient_Fruit_Test.png");
+        return 0;
+    }
+
+    if(progressive)
+    {
+        auto progressive_start= std::chrono::high_resolution_clock::now();
+
+        Accumulator accumulator(image.width(), image.height());
+        int passes= 0;
+        if(width == 4) passes= render_progressive(bvh4, shading, camera, accumulator, scheduler, sampler_type, progressive_options);
+        else if(width == 8) passes= render_progressive(bvh8, shading, camera, accumulator, scheduler, sampler_type, progressive_options);
+        else if(layout == "linear") passes= render_progressive(linear, shading, camera, accumulator, scheduler, sampler_type, progressive_options);
+        else if(layout == "quantized") passes= render_progressive(quantized, shading, camera, accumulator, scheduler, sampler_type, progressive_options);
+        else if(stackless) passes= render_progressive(StacklessBVH(bvh), shading, camera, accumulator, scheduler, sampler_type, progressive_options);
+        else passes= render_progressive(bvh, shading, camera, accumulator, scheduler, sampler_type, progressive_options);
+
+        auto progressive_stop= std::chrono::high_resolution_clock::now();
+        int progressive_time= std::chrono::duration_cast<std::chrono::milliseconds>(progressive_stop - progressive_start).count();
+
+        long long samples= 0;
+        for(int py= 0; py < image.height(); py++)
+        for(int px= 0; px < image.width(); px++)
+            samples+= accumulator.samples(px, py);
+        printf("render progressive  %ds %03dms, %d passes, %.1f samples/pixel\n", int(progressive_time / 1000), int(progressive_time % 1000),
+            passes, double(samples) / (image.width() * image.height()));
+
+        image= accumulator.image();
+        write_image_hdr(image, progressive_options.filename);
+        write_image(image, "Partie_3_Ambient_Fruit_Test.png");
+        return 0;
+    }
+
+    if(adaptive)
+    {
+        auto adaptive_start= std::chrono::high_resolution_clock::now();
+
+        Accumulator accumulator(image.width(), image.height());
+        if(width == 4) render_adaptive(bvh4, shading, camera, accumulator, scheduler, sampler_type, adaptive_options);
+        else if(width == 8) render_adaptive(bvh8, shading, camera, accumulator, scheduler, sampler_type, adaptive_options);
+        else if(layout == "linear") render_adaptive(linear, shading, camera, accumulator, scheduler, sampler_type, adaptive_options);
+        else if(layout == "quantized") render_adaptive(quantized, shading, camera, accumulator, scheduler, sampler_type, adaptive_options);
+        else if(stackless) render_adaptive(StacklessBVH(bvh), shading, camera, accumulator, scheduler, sampler_type, adaptive_options);
+        else render_adaptive(bvh, shading, camera, accumulator, scheduler, sampler_type, adaptive_options);
+
+        auto adaptive_stop= std::chrono::high_resolution_clock::now();
+        int adaptive_time= std::chrono::duration_cast<std::chrono::milliseconds>(adaptive_stop - adaptive_start).count();
+
+        long long samples= 0;
+        int max_samples= 0;
+        for(int py= 0; py < image.height(); py++)
+        for(int px= 0; px < image.width(); px++)
+        {
+            samples+= accumulator.samples(px, py);
+            max_samples= std::max(max_samples, accumulator.samples(px, py));
         }
+        printf("render adaptive  %ds %03dms, %.1f samples/pixel, max %d\n", int(adaptive_time / 1000), int(adaptive_time % 1000),
+            double(samples) / (image.width() * image.height()), max_samples);
+
+        image= accumulator.image();
+        write_image_hdr(image, "Partie_3_adaptive.hdr");
+        write_image(image, "Partie_3_Ambient_Fruit_Test.png");
+        write_image(accumulator.heatmap(), "Partie_3_adaptive_spp.png");
+        return 0;
     }
 
+    auto cpu_start= std::chrono::high_resolution_clock::now();
+
+    PacketStats packet_stats;
+    if(packet == 4) render_packets<4>(bvh, shading, camera, image, scheduler, sampler_type, &packet_stats);
+    else if(packet == 8) render_packets<8>(bvh, shading, camera, image, scheduler, sampler_type, &packet_stats);
+    else if(packet == 16) render_packets<16>(bvh, shading, camera, image, scheduler, sampler_type, &packet_stats);
+    else if(width == 4) render(bvh4, shading, camera, image, scheduler, sampler_type);
+    else if(width == 8) render(bvh8, shading, camera, image, scheduler, sampler_type);
+    else if(layout == "linear") render(linear, shading, camera, image, scheduler, sampler_type);
+    else if(layout == "quantized") render(quantized, shading, camera, image, scheduler, sampler_type);
+    else if(stackless) render(StacklessBVH(bvh), shading, camera, image, scheduler, sampler_type);
+    else render(bvh, shading, camera, image, scheduler, sampler_type);
+
+    auto cpu_stop= std::chrono::high_resolution_clock::now();
+    int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+    if(packet == 4 || packet == 8 || packet == 16)
+    {
+        printf("render packet%d  %ds %03dms\n", packet, int(cpu_time / 1000), int(cpu_time % 1000));
+        if(packet == 4) print_packet_stats<4>("render", packet_stats);
+        else if(packet == 8) print_packet_stats<8>("render", packet_stats);
+        else print_packet_stats<16>("render", packet_stats);
+    }
+    else
+        printf("render bvh%d  %ds %03dms\n", (width == 4 || width == 8) ? width : 2, int(cpu_time / 1000), int(cpu_time % 1000));
+    scheduler.print_times();
 
     write_image(image, "Partie_3_Ambient_Fruit_Test.png");
-
     return 0;
 }
@@ -0,0 +1,59 @@
+
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapped_file.h"
+
+
+MappedFile::MappedFile( const char *filename ) : data(nullptr), size(0), buffer()
+{
+#ifndef _WIN32
+    int fd= open(filename, O_RDONLY);
+    if(fd < 0)
+        return;
+
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void *map= mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED)
+        {
+            data= (const unsigned char *) map;
+            size= info.st_size;
+        }
+    }
+    close(fd);
+#else
+    FILE *in= fopen(filename, "rb");
+    if(in == nullptr)
+        return;
+
+    fseek(in, 0, SEEK_END);
+    long length= ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if(length > 0)
+    {
+        buffer.resize(length);
+        if(fread(buffer.data(), 1, length, in) == size_t(length))
+        {
+            data= buffer.data();
+            size= length;
+        }
+    }
+    fclose(in);
+#endif
+}
+
+MappedFile::~MappedFile( )
+{
+#ifndef _WIN32
+    if(data)
+        munmap((void *) data, size);
+#endif
+}
@@ -0,0 +1,36 @@
+
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <cstddef>
+#include <vector>
+
+
+//! \addtogroup objet3D
+///@{
+
+//! \file 
+//! fichier projete en memoire, en lecture seule.
+
+/*! fichier projete en memoire, en lecture seule. avec mmap() sur les systemes posix, sinon le fichier est simplement charge.
+    les pages du fichier ne sont lues que lorsqu'elles sont utilisees, et restent dans le cache du systeme d'une execution a l'autre.
+ */
+struct MappedFile
+{
+    MappedFile( const char *filename );
+    ~MappedFile( );
+
+    operator bool( ) const { return data != nullptr; }
+
+    const unsigned char *data;
+    size_t size;
+
+protected:
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator= ( const MappedFile& ) = delete;
+
+    std::vector<unsigned char> buffer;
+};
+
+///@}
+#endif
@@ -100,6 +100,37 @@ Mesh& Mesh::color( const unsigned int id, const vec4& c )
     return *this;
 }
 
+Mesh& Mesh::colors( const std::vector<vec4>& colors )
+{
+    assert(colors.size() == m_positions.size());
+    m_update_buffers= true;
+    m_colors= colors;
+    return *this;
+}
+
+Mesh& Mesh::positions( const std::vector<vec3>& positions )
+{
+    m_update_buffers= true;
+    m_positions= positions;
+    return *this;
+}
+
+Mesh& Mesh::texcoords( const std::vector<vec2>& texcoords )
+{
+    assert(texcoords.size() == m_positions.size());
+    m_update_buffers= true;
+    m_texcoords= texcoords;
+    return *this;
+}
+
+Mesh& Mesh::normals( const std::vector<vec3>& normals )
+{
+    assert(normals.size() == m_positions.size());
+    m_update_buffers= true;
+    m_normals= normals;
+    return *this;
+}
+
 Mesh& Mesh::normal( const unsigned int id, const vec3& n )
 {
     assert(id < m_normals.size());
@@ -146,6 +177,13 @@ Mesh& Mesh::triangle_last( const int a, const int b, const int c )
     return *this;
 }
 
+Mesh& Mesh::indices( const std::vector<unsigned int>& indices )
+{
+    m_update_buffers= true;
+    m_indices= indices;
+    return *this;
+}
+
 Mesh& Mesh::restart_strip( )
 {
     m_indices.push_back(~0u);   // ~0u plus grand entier non signe representable
@@ -187,6 +225,12 @@ Mesh& Mesh::material( const unsigned int id )
     return *this;
 }
 
+Mesh& Mesh::materials( const std::vector<unsigned int>& materials )
+{
+    m_triangle_materials= materials;
+    return *this;
+}
+
 const Material &Mesh::triangle_material( const unsigned int id ) const
 {
     assert((size_t) id < m_triangle_materials.size());
@@ -177,6 +177,9 @@ public:
     */    
     Mesh& triangle_last( const int a, const int b, const int c );
     
+    //! remplace les indices de tous les triangles, 3 indices par triangle. les sommets doivent deja etre inseres dans l'objet.
+    Mesh& indices( const std::vector<unsigned int>& indices );
+    
     //! demarre un nouveau strip. a utiliser avec un objet composes de GL_TRIANGLE_STRIP, doit aussi fonctionner avec GL_TRIANGLE_FAN, GL_LINE_STRIP, GL_LINE_LOOP, etc.
     Mesh& restart_strip( );
     //@}
@@ -189,6 +192,15 @@ public:
     Mesh& color( const unsigned int id, const Color& c ) { return color(id, vec4(c.r, c.g, c.b, c.a)); }
     //! modifie la couleur du sommet d'indice id.
     Mesh& color( const unsigned int id, const float r, const float g, const float b, const float a= 1) { return color(id, vec4(r, g, b, a)); }
+    //! remplace les couleurs de tous les sommets, une couleur par sommet.
+    Mesh& colors( const std::vector<vec4>& colors );
+    
+    //! remplace les positions de tous les sommets. a utiliser avant texcoords() et normals().
+    Mesh& positions( const std::vector<vec3>& positions );
+    //! remplace les coordonnees de texture de tous les sommets, une par sommet.
+    Mesh& texcoords( const std::vector<vec2>& texcoords );
+    //! remplace les normales de tous les sommets, une normale par sommet.
+    Mesh& normals( const std::vector<vec3>& normals );
 
     //! modifie la normale du sommet d'indice id.
     Mesh& normal( const unsigned int id, const vec3& n );
@@ -228,6 +240,8 @@ public:
     
     //! definit la matiere du prochain triangle. id est l'indice d'une matiere ajoutee par mesh_material() ou mesh_materials( ). ne fonctionne que pour les primitives GL_TRIANGLES, indexees ou pas.
     Mesh& material( const unsigned int id );
+    //! remplace les matieres de tous les triangles, un indice de matiere par triangle.
+    Mesh& materials( const std::vector<unsigned int>& materials );
     //@}
     
     //! \name description des triangles d'un maillage.
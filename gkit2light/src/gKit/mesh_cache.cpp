@@ -0,0 +1,195 @@
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#include "mesh_cache.h"
+
+
+const char mesh_cache_magic[8]= "gkitmsh";
+const uint32_t mesh_cache_version= 3;
+const int mesh_cache_alignment= 64;
+
+//! repertoire des fichiers cache, vide si les caches sont desactives.
+static
+std::string& cache_directory( )
+{
+    static std::string directory= getenv("GKIT_MESH_CACHE") ? getenv("GKIT_MESH_CACHE") : "";
+    return directory;
+}
+
+void mesh_cache_directory( const char *directory )
+{
+    cache_directory()= directory ? directory : "";
+}
+
+std::string mesh_cache_filename( const char *filename, const char *extension )
+{
+    const std::string& directory= cache_directory();
+    if(directory.empty())
+        return std::string();
+
+    // un seul repertoire pour tous les fichiers : le chemin d'acces complet fait partie du nom
+    std::string name= std::string(filename) + extension;
+    std::replace(name.begin(), name.end(), '/', '_');
+    std::replace(name.begin(), name.end(), '\\', '_');
+    std::replace(name.begin(), name.end(), ':', '_');
+    if(name[0] == '.')
+        name= "_" + name;       // les chemins relatifs, ./ ou ../, ne produisent pas de fichier invisible
+
+    char last= directory[directory.size() -1];
+    if(last == '/' || last == '\\')
+        return directory + name;
+    else
+        return directory + "/" + name;
+}
+
+
+//! renvoie la date de modification et la taille d'un fichier, faux s'il n'existe pas.
+static
+bool file_stamp( const char *filename, MeshCacheStamp& stamp )
+{
+    struct stat info;
+    if(stat(filename, &info) != 0)
+        return false;
+
+    stamp.time= int64_t(info.st_mtime);
+#if defined(__APPLE__)
+    stamp.nanoseconds= int64_t(info.st_mtimespec.tv_nsec);
+#elif defined(WIN32)
+    stamp.nanoseconds= 0;       // pas de date plus precise que la seconde
+#else
+    stamp.nanoseconds= int64_t(info.st_mtim.tv_nsec);
+#endif
+    stamp.size= int64_t(info.st_size);
+    return true;
+}
+
+
+MeshCache::MeshCache( const char *filename, const MeshCacheType type ) : file(), blocks()
+{
+    std::shared_ptr<MappedFile> mapped= std::make_shared<MappedFile>(filename);
+    if(!*mapped || mapped->size < sizeof(MeshCacheHeader))
+        return;
+
+    MeshCacheHeader header;
+    memcpy(&header, mapped->data, sizeof(header));
+    if(memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) != 0 || header.version != mesh_cache_version || header.type != uint32_t(type)
+    || header.block_count < 2
+    || mapped->size < sizeof(header) + header.block_count * sizeof(MeshCacheBlock))
+    {
+        printf("[cache] '%s' is stale...\n", filename);
+        return;
+    }
+
+    std::vector<MeshCacheBlock> table(header.block_count);
+    memcpy(table.data(), mapped->data + sizeof(header), header.block_count * sizeof(MeshCacheBlock));
+    for(unsigned i= 0; i < header.block_count; i++)
+        if(table[i].offset % mesh_cache_alignment != 0 || table[i].offset > mapped->size || table[i].size > mapped->size - table[i].offset)
+        {
+            printf("[cache] '%s' is stale...\n", filename);
+            return;
+        }
+
+    // bloc 0 : dates et tailles des fichiers sources, bloc 1 : noms des fichiers, separes par des 0
+    int n= int(table[0].size / sizeof(MeshCacheStamp));
+    const MeshCacheStamp *stamps= (const MeshCacheStamp *) (mapped->data + table[0].offset);
+    const char *names= (const char *) (mapped->data + table[1].offset);
+    const char *names_end= names + table[1].size;
+    for(int i= 0; i < n; i++)
+    {
+        const char *end= (const char *) memchr(names, 0, names_end - names);
+        if(end == nullptr)
+            return;
+
+        MeshCacheStamp stamp;
+        if(!file_stamp(names, stamp) || stamp.time != stamps[i].time || stamp.nanoseconds != stamps[i].nanoseconds || stamp.size != stamps[i].size)
+        {
+            printf("[cache] '%s' is stale, '%s' was modified...\n", filename, names);
+            return;
+        }
+        names= end +1;
+    }
+
+    // les blocs de l'application commencent apres les fichiers sources
+    blocks.assign(table.begin() + 2, table.end());
+    file= mapped;
+}
+
+
+bool MeshCacheWriter::write( const char *filename, const MeshCacheType type ) const
+{
+    // fichiers sources
+    std::vector<MeshCacheStamp> stamps(dependencies.size());
+    std::vector<char> names;
+    for(int i= 0; i < int(dependencies.size()); i++)
+    {
+        if(!file_stamp(dependencies[i].c_str(), stamps[i]))
+        {
+            printf("[cache] can't write '%s', no file '%s'...\n", filename, dependencies[i].c_str());
+            return false;
+        }
+
+        names.insert(names.end(), dependencies[i].begin(), dependencies[i].end());
+        names.push_back(0);
+    }
+
+    std::vector< std::pair<const void *, size_t> > data;
+    data.push_back( std::make_pair((const void *) stamps.data(), stamps.size() * sizeof(MeshCacheStamp)) );
+    data.push_back( std::make_pair((const void *) names.data(), names.size()) );
+    data.insert(data.end(), blocks.begin(), blocks.end());
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+    header.version= mesh_cache_version;
+    header.type= type;
+    header.block_count= uint32_t(data.size());
+
+    // place les blocs
+    std::vector<MeshCacheBlock> table(data.size());
+    uint64_t offset= sizeof(header) + table.size() * sizeof(MeshCacheBlock);
+    for(int i= 0; i < int(data.size()); i++)
+    {
+        offset= (offset + mesh_cache_alignment -1) / mesh_cache_alignment * mesh_cache_alignment;
+        table[i].offset= offset;
+        table[i].size= data[i].second;
+        offset+= data[i].second;
+    }
+
+    // ecrit un fichier temporaire, puis le renomme : un fichier incomplet ne peut pas etre relu
+    std::string tmp= std::string(filename) + ".tmp";
+    FILE *out= fopen(tmp.c_str(), "wb");
+    if(out == nullptr)
+    {
+        printf("[cache] can't write '%s'...\n", filename);
+        return false;
+    }
+
+    bool ok= fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(table.data(), sizeof(MeshCacheBlock), table.size(), out) == table.size();
+
+    const char zeros[mesh_cache_alignment]= { };
+    uint64_t position= sizeof(header) + table.size() * sizeof(MeshCacheBlock);
+    for(int i= 0; ok && i < int(data.size()); i++)
+    {
+        ok= fwrite(zeros, 1, table[i].offset - position, out) == table[i].offset - position
+            && fwrite(data[i].first, 1, data[i].second, out) == data[i].second;
+        position= table[i].offset + table[i].size;
+    }
+    ok= (fclose(out) == 0) && ok;
+
+    remove(filename);
+    if(!ok || rename(tmp.c_str(), filename) != 0)
+    {
+        remove(tmp.c_str());
+        printf("[cache] can't write '%s'...\n", filename);
+        return false;
+    }
+
+    printf("[cache] wrote '%s'\n", filename);
+    return true;
+}
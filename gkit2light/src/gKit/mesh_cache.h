@@ -0,0 +1,142 @@
+
+#ifndef _MESH_CACHE_H
+#define _MESH_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+
+//! \addtogroup objet3D
+///@{
+
+//! \file 
+//! fichiers cache binaires des maillages : blocs de donnees alignes, relus par projection en memoire, sans analyse.
+
+/*! active les fichiers cache de read_mesh(), read_indexed_mesh(), read_mesh_data() et read_mesh_buffer(), ils sont ranges dans directory.
+    les caches sont desactives par defaut, sauf si la variable d'environnement GKIT_MESH_CACHE indique un repertoire.
+    mesh_cache_directory(NULL) ou mesh_cache_directory("") les desactive.
+ */
+void mesh_cache_directory( const char *directory );
+
+/*! renvoie le nom du fichier cache de filename, ou une chaine vide si les caches sont desactives, cf mesh_cache_directory().
+    avec mesh_cache_directory("cache"), mesh_cache_filename("data/bigguy.obj", ".mesh") == "cache/data_bigguy.obj.mesh"
+ */
+std::string mesh_cache_filename( const char *filename, const char *extension );
+
+//! contenu d'un fichier cache, cf MeshCacheHeader::type.
+enum MeshCacheType
+{
+    CACHE_MESH= 1,          //!< Mesh, cf read_mesh()
+    CACHE_INDEXED_MESH,     //!< Mesh indexe, cf read_indexed_mesh()
+    CACHE_MESH_DATA,        //!< MeshData, cf read_mesh_data() dans tutos/
+    CACHE_MESH_BUFFER       //!< MeshBuffer, cf read_mesh_buffer() dans tutos/
+};
+
+//! entete des fichiers cache, suivie de la description des blocs et des blocs.
+struct MeshCacheHeader
+{
+    char magic[8];              //!< "gkitmsh"
+    uint32_t version;           //!< version du format, et de la representation des donnees
+    uint32_t type;              //!< cf MeshCacheType
+    uint32_t block_count;       //!< nombre de blocs, y compris les 2 blocs qui decrivent les fichiers sources
+    uint32_t pad;
+};
+
+//! position d'un bloc dans le fichier, les blocs commencent sur une adresse multiple de 64 octets.
+struct MeshCacheBlock
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+//! date de modification, a la nanoseconde pres, et taille d'un fichier source : le cache n'est utilisable que s'ils n'ont pas change.
+struct MeshCacheStamp
+{
+    int64_t time;
+    int64_t nanoseconds;
+    int64_t size;
+};
+
+/*! relit un fichier cache, ecrit par MeshCacheWriter::write(). le fichier est projete en memoire, les blocs ne sont pas copies.
+    le cache n'est valide que si son type et sa version correspondent, et si les fichiers sources n'ont pas ete modifies.
+ */
+struct MeshCache
+{
+    //! projette le fichier et verifie son contenu.
+    MeshCache( const char *filename, const MeshCacheType type );
+
+    //! renvoie vrai si le cache est utilisable.
+    operator bool( ) const { return file != nullptr; }
+
+    //! renvoie le nombre de blocs.
+    int block_count( ) const { return int(blocks.size()); }
+    //! renvoie l'adresse du bloc id, dans le fichier projete en memoire.
+    const void *block( const int id ) const { return file->data + blocks[id].offset; }
+    //! renvoie la taille du bloc id, en octets.
+    size_t block_size( const int id ) const { return size_t(blocks[id].size); }
+
+    //! copie le bloc id dans un vecteur, renvoie faux si la taille du bloc ne correspond pas a un ensemble de T.
+    template < typename T >
+    bool read( const int id, std::vector<T>& data ) const
+    {
+        if(id < 0 || id >= block_count() || block_size(id) % sizeof(T) != 0)
+            return false;
+
+        const T *begin= (const T *) block(id);
+        data.assign(begin, begin + block_size(id) / sizeof(T));
+        return true;
+    }
+
+    //! fichier projete en memoire, partage avec les objets qui utilisent directement les blocs, cf MeshBuffer.
+    std::shared_ptr<MappedFile> file;
+    std::vector<MeshCacheBlock> blocks;
+};
+
+/*! construit un fichier cache : les blocs de donnees et les noms des fichiers sources.
+    \code
+    MeshCacheWriter cache;
+    cache.dependency("data/bigguy.obj");
+    cache.block(positions);
+    cache.block(indices);
+    cache.write(mesh_cache_filename("data/bigguy.obj", ".mesh").c_str(), CACHE_MESH);
+    \endcode
+ */
+struct MeshCacheWriter
+{
+    MeshCacheWriter( ) : dependencies(), blocks(), storage() {}
+
+    //! ajoute un fichier source.
+    void dependency( const std::string& filename ) { dependencies.push_back(filename); }
+
+    //! ajoute un bloc, renvoie son indice. les donnees ne sont pas copiees, elles doivent exister jusqu'a l'appel de write().
+    int block( const void *data, const size_t size )
+    {
+        blocks.push_back( std::make_pair(data, size) );
+        return int(blocks.size()) -1;
+    }
+
+    //! ajoute un bloc, renvoie son indice. le vecteur doit exister jusqu'a l'appel de write().
+    template < typename T >
+    int block( const std::vector<T>& data ) { return block(data.data(), data.size() * sizeof(T)); }
+
+    //! ajoute un bloc construit pour le cache, par exemple des chaines de caracteres, renvoie son indice.
+    int block( std::vector<unsigned char>&& data )
+    {
+        storage.push_back( std::unique_ptr< std::vector<unsigned char> >(new std::vector<unsigned char>(std::move(data))) );
+        return block(storage.back()->data(), storage.back()->size());
+    }
+
+    //! ecrit le fichier, renvoie faux en cas d'erreur.
+    bool write( const char *filename, const MeshCacheType type ) const;
+
+    std::vector<std::string> dependencies;
+    std::vector< std::pair<const void *, size_t> > blocks;
+    std::vector< std::unique_ptr< std::vector<unsigned char> > > storage;
+};
+
+///@}
+#endif
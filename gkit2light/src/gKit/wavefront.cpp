@@ -1,11 +1,20 @@
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #include <ctype.h>
 #include <climits>
 
+#include <chrono>
 #include <algorithm>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "wavefront.h"
+#include "mesh_cache.h"
 
 /*! renvoie le chemin d'acces a un fichier. le chemin est toujours termine par /
     pathname("path\to\file") == "path/to/"
@@ -35,70 +44,285 @@ std::string pathname( const std::string& filename )
 }
 
 
-Mesh read_mesh( const char *filename )
+/*! charge le contenu complet d'un fichier, termine par un 0.
+    renvoie faux si le fichier n'existe pas ou ne peut pas etre lu.
+ */
+static
+bool read_file( const char *filename, std::vector<char>& buffer )
 {
-    FILE *in= fopen(filename, "rt");
+    FILE *in= fopen(filename, "rb");
     if(in == NULL)
+        return false;
+    
+    // taille du fichier
+    fseek(in, 0, SEEK_END);
+    long size= ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if(size < 0)
+        size= 0;
+    
+    buffer.resize(size +1);
+    size_t n= fread(buffer.data(), 1, size, in);
+    bool error= ferror(in) != 0;
+    fclose(in);
+    
+    buffer.resize(n +1);
+    buffer[n]= 0;
+    return !error;
+}
+
+//! saute les espaces et les tabulations, mais pas la fin de ligne.
+static inline
+const char *skip_spaces( const char *text )
+{
+    while(*text == ' ' || *text == '\t')
+        text++;
+    return text;
+}
+
+//! renvoie vrai si c termine un mot : espace, fin de ligne ou fin du fichier.
+static inline
+bool is_separator( const char c )
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == 0;
+}
+
+/*! lit un entier, renvoie faux s'il n'y a pas de chiffre, ou si la valeur depasse INT_MAX. text avance apres le nombre.
+ */
+static inline
+bool parse_int( const char *& text, int& value )
+{
+    const char *p= text;
+    bool negative= false;
+    if(*p == '-' || *p == '+')
     {
-        printf("[error] loading mesh '%s'...\n", filename);
-        return Mesh::error();
+        negative= (*p == '-');
+        p++;
     }
     
-    Mesh data(GL_TRIANGLES);
+    if(*p < '0' || *p > '9')
+        return false;
     
-    printf("loading mesh '%s'...\n", filename);
+    long long v= 0;
+    for(; *p >= '0' && *p <= '9'; p++)
+    {
+        v= v * 10 + (*p - '0');
+        if(v > INT_MAX)
+            return false;
+    }
+    
+    value= negative ? -int(v) : int(v);
+    text= p;
+    return true;
+}
+
+/*! lit un reel, apres les espaces eventuels, renvoie faux s'il n'y a pas de nombre. text avance apres le nombre.
+    les nombres usuels, jusqu'a 15 chiffres significatifs et un exposant raisonnable, sont convertis directement :
+    la mantisse entiere est exacte, et les puissances de 10 jusqu'a 10^22 sont exactes en double, le double est donc arrondi correctement. 
+    il est ensuite arrondi en float, ce qui donne le meme resultat que strtof(), sauf si le double tombe exactement au milieu de 2 floats :
+    strtof() traite ce cas, et les autres.
+ */
+static inline
+bool parse_float( const char *& text, float& value )
+{
+    static const double powers[]= {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    
+    text= skip_spaces(text);
+    const char *p= text;
+    bool negative= false;
+    if(*p == '-' || *p == '+')
+    {
+        negative= (*p == '-');
+        p++;
+    }
+    
+    unsigned long long mantissa= 0;
+    int digits= 0;          // chiffres significatifs
+    int exponent= 0;
+    bool number= false;
+    
+    for(; *p >= '0' && *p <= '9'; p++, number= true)
+    {
+        if(mantissa == 0 && *p == '0')
+            continue;
+        if(digits < 19)
+        {
+            mantissa= mantissa * 10 + (*p - '0');
+            digits++;
+        }
+        else
+            exponent++;
+    }
+    
+    if(*p == '.')
+    {
+        p++;
+        for(; *p >= '0' && *p <= '9'; p++, number= true)
+        {
+            if(mantissa == 0 && *p == '0')
+            {
+                exponent--;
+                continue;
+            }
+            if(digits < 19)
+            {
+                mantissa= mantissa * 10 + (*p - '0');
+                digits++;
+                exponent--;
+            }
+        }
+    }
+    
+    if(!number)
+    {
+        // nan, inf, ...
+        char *end= NULL;
+        float v= strtof(text, &end);
+        if(end == text)
+            return false;
+        
+        value= v;
+        text= end;
+        return true;
+    }
+    
+    bool exact= true;
+    if(*p == 'e' || *p == 'E')
+    {
+        const char *e= p + 1;
+        const char *d= (*e == '-' || *e == '+') ? e + 1 : e;
+        int power;
+        if(parse_int(e, power))
+        {
+            if(power < -1000 || power > 1000)
+                exact= false;           // de toutes facons hors des puissances exactes
+            else
+                exponent+= power;
+            p= e;
+        }
+        else if(*d >= '0' && *d <= '9')
+            exact= false;               // exposant plus grand que INT_MAX
+    }
+    
+    exact= exact && (digits <= 15 && exponent >= -22 && exponent <= 22);
+    double v= 0;
+    if(exact)
+    {
+        v= double(mantissa);
+        v= (exponent < 0) ? v / powers[-exponent] : v * powers[exponent];
+        
+        // bits du double perdus par l'arrondi en float : le milieu de 2 floats est un 1 suivi de 28 zeros
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        exact= (bits & 0x1fffffff) != 0x10000000;
+    }
+    
+    if(!exact)
+    {
+        // cas rares, conversion exacte par la librairie standard
+        char *end= NULL;
+        value= strtof(text, &end);
+        text= end;
+        return true;
+    }
+    
+    value= float(negative ? -v : v);
+    text= p;
+    return true;
+}
+
+//! renvoie le reste de la ligne, sans les espaces au debut et a la fin.
+static
+std::string parse_name( const char *text, const char *end )
+{
+    text= skip_spaces(text);
+    while(end > text && isspace((unsigned char) end[-1]))
+        end--;
+    return std::string(text, end);
+}
+
+//! bloc de lignes d'un fichier .obj, analyse par un thread, cf read_obj_data().
+struct ObjChunk
+{
+    const char *begin;
+    const char *end;
+    const char *error;                  //!< premiere ligne invalide, ou NULL
     
     std::vector<vec3> positions;
     std::vector<vec2> texcoords;
     std::vector<vec3> normals;
-    MaterialLib materials;
-    int default_material_id= -1;
-    int material_id= -1;
     
+    std::vector<int> corners;           //!< indices p, t, n des sommets des triangles, tels qu'ils sont dans le fichier
+    std::vector<int> counts;            //!< nombre de positions, texcoords et normales du bloc, lues avant chaque triangle
+    std::vector<ObjCommand> commands;
+    
+    int triangles;                      //!< nombre de triangles valides
+    int position_offset;                //!< nombre de positions, texcoords, normales et triangles des blocs precedents
+    int texcoord_offset;
+    int normal_offset;
+    int triangle_offset;
+    
+    ObjChunk( const char *_begin, const char *_end ) : begin(_begin), end(_end), error(NULL), 
+        positions(), texcoords(), normals(), corners(), counts(), commands(), 
+        triangles(0), position_offset(0), texcoord_offset(0), normal_offset(0), triangle_offset(0) {}
+};
+
+//! analyse les lignes d'un bloc, sans resoudre les indices : ils peuvent faire reference aux sommets des blocs precedents.
+static
+void parse_obj_chunk( ObjChunk& chunk )
+{
     std::vector<int> idp;
     std::vector<int> idt;
     std::vector<int> idn;
+    bool first_face= true;
     
-    char tmp[1024];
-    char line_buffer[1024];
-    bool error= true;
-    for(;;)
+    // parcourt le bloc ligne par ligne, sans copier les lignes, quelle que soit leur longueur
+    for(const char *next= chunk.begin; next < chunk.end; )
     {
-        // charge une ligne du fichier
-        if(fgets(line_buffer, sizeof(line_buffer), in) == NULL)
-        {
-            error= false;       // fin du fichier, pas d'erreur detectee
-            break;
-        }
-        
-        // force la fin de la ligne, au cas ou
-        line_buffer[sizeof(line_buffer) -1]= 0;
+        const char *line= next;
+        const char *line_end= (const char *) memchr(line, '\n', chunk.end - line);
+        if(line_end == NULL)
+            line_end= chunk.end;
+        next= line_end +1;
         
         // saute les espaces en debut de ligne
-        char *line= line_buffer;
-        while(*line && isspace(*line))
+        while(line < line_end && isspace((unsigned char) *line))
             line++;
         
         if(line[0] == 'v')
         {
-            float x, y, z;
-            if(line[1] == ' ')          // position x y z
+            const char *p= line + 2;
+            if(line[1] == ' ' || line[1] == '\t')       // position x y z
             {
-                if(sscanf(line, "v %f %f %f", &x, &y, &z) != 3)
+                vec3 v;
+                if(!parse_float(p, v.x) || !parse_float(p, v.y) || !parse_float(p, v.z))
+                {
+                    chunk.error= line;
                     break;
-                positions.push_back( vec3(x, y, z) );
+                }
+                chunk.positions.push_back(v);
             }
             else if(line[1] == 'n')     // normal x y z
             {
-                if(sscanf(line, "vn %f %f %f", &x, &y, &z) != 3)
+                vec3 v;
+                if(!parse_float(p, v.x) || !parse_float(p, v.y) || !parse_float(p, v.z))
+                {
+                    chunk.error= line;
                     break;
-                normals.push_back( vec3(x, y, z) );
+                }
+                chunk.normals.push_back(v);
             }
             else if(line[1] == 't')     // texcoord x y
             {
-                if(sscanf(line, "vt %f %f", &x, &y) != 2)
+                vec2 v;
+                if(!parse_float(p, v.x) || !parse_float(p, v.y))
+                {
+                    chunk.error= line;
                     break;
-                texcoords.push_back( vec2(x, y) );
+                }
+                chunk.texcoords.push_back(v);
             }
         }
         
@@ -108,26 +332,272 @@ Mesh read_mesh( const char *filename )
             idt.clear();
             idn.clear();
             
-            int next;
-            for(line= line +1; ; line= line + next)
+            // sommets p, p/t, p//n ou p/t/n
+            const char *p= line +1;
+            for(;;)
             {
-                idp.push_back(0); 
-                idt.push_back(0); 
-                idn.push_back(0);         // 0: invalid index
-                
-                next= 0;
-                if(sscanf(line, " %d/%d/%d %n", &idp.back(), &idt.back(), &idn.back(), &next) == 3) 
-                    continue;
-                else if(sscanf(line, " %d/%d %n", &idp.back(), &idt.back(), &next) == 2)
-                    continue;
-                else if(sscanf(line, " %d//%d %n", &idp.back(), &idn.back(), &next) == 2)
-                    continue;
-                else if(sscanf(line, " %d %n", &idp.back(), &next) == 1)
-                    continue;
-                else if(next == 0)      // fin de ligne
+                p= skip_spaces(p);
+                int vp= 0, vt= 0, vn= 0;        // 0: invalid index
+                if(!parse_int(p, vp))
                     break;
+                if(*p == '/')
+                {
+                    p++;
+                    parse_int(p, vt);
+                    if(*p == '/')
+                    {
+                        p++;
+                        parse_int(p, vn);
+                    }
+                }
+                
+                idp.push_back(vp);
+                idt.push_back(vt);
+                idn.push_back(vn);
+            }
+            
+            if(first_face)
+                chunk.commands.push_back( { ObjCommand::FACE, int(chunk.counts.size() / 3), std::string() } );
+            first_face= false;
+            
+            // triangule la face, construit les triangles 0 1 2, 0 2 3, 0 3 4, etc
+            for(int v= 2; v < (int) idp.size(); v++)
+            {
+                int idv[3]= { 0, v -1, v };
+                for(int i= 0; i < 3; i++)
+                {
+                    int k= idv[i];
+                    chunk.corners.push_back(idp[k]);
+                    chunk.corners.push_back(idt[k]);
+                    chunk.corners.push_back(idn[k]);
+                }
+                
+                chunk.counts.push_back(int(chunk.positions.size()));
+                chunk.counts.push_back(int(chunk.texcoords.size()));
+                chunk.counts.push_back(int(chunk.normals.size()));
+            }
+        }
+        
+        else if(line[0] == 'm')
+        {
+            if(strncmp(line, "mtllib", 6) == 0 && is_separator(line[6]))
+            {
+                std::string name= parse_name(line + 6, line_end);
+                if(!name.empty())
+                    chunk.commands.push_back( { ObjCommand::MTLLIB, int(chunk.counts.size() / 3), name } );
             }
+        }
+        
+        else if(line[0] == 'u')
+        {
+            if(strncmp(line, "usemtl", 6) == 0 && is_separator(line[6]))
+            {
+                std::string name= parse_name(line + 6, line_end);
+                if(!name.empty())
+                    chunk.commands.push_back( { ObjCommand::USEMTL, int(chunk.counts.size() / 3), name } );
+            }
+        }
+    }
+}
+
+/*! resout les indices des triangles d'un bloc, connaissant le nombre de sommets des blocs precedents.
+    les triangles valides sont conserves au debut de chunk.corners, les commandes sont renumerotees.
+ */
+static
+void resolve_obj_chunk( ObjChunk& chunk )
+{
+    int triangles= int(chunk.counts.size() / 3);
+    int valid= 0;
+    int command= 0;
+    for(int i= 0; i < triangles; i++)
+    {
+        for(; command < int(chunk.commands.size()) && chunk.commands[command].triangle == i; command++)
+            chunk.commands[command].triangle= valid;
+        
+        // nombre de sommets lus avant le triangle, dans tout le fichier
+        int np= chunk.position_offset + chunk.counts[3*i];
+        int nt= chunk.texcoord_offset + chunk.counts[3*i +1];
+        int nn= chunk.normal_offset + chunk.counts[3*i +2];
+        
+        int ids[9];
+        bool error= false;
+        for(int k= 0; k < 3; k++)
+        {
+            const int *corner= &chunk.corners[9*i + 3*k];
+            int p= (corner[0] < 0) ? np + corner[0] : corner[0] -1;
+            int t= (corner[1] < 0) ? nt + corner[1] : corner[1] -1;
+            int n= (corner[2] < 0) ? nn + corner[2] : corner[2] -1;
+            
+            if(p < 0 || p >= np) error= true;
+            if(t < 0 || t >= nt) t= -1;
+            if(n < 0 || n >= nn) n= -1;
             
+            ids[3*k]= p;
+            ids[3*k +1]= t;
+            ids[3*k +2]= n;
+        }
+        
+        if(error)
+            continue;   // ignore le triangle
+        
+        for(int k= 0; k < 9; k++)
+            chunk.corners[9*valid + k]= ids[k];
+        valid++;
+    }
+    
+    for(; command < int(chunk.commands.size()); command++)
+        chunk.commands[command].triangle= valid;
+    
+    chunk.triangles= valid;
+}
+
+bool read_obj_data( const char *filename, ObjData& data )
+{
+    data= ObjData();
+    
+    std::vector<char> buffer;
+    if(!read_file(filename, buffer))
+    {
+        printf("[error] loading mesh '%s'...\n", filename);
+        return false;
+    }
+    
+    printf("loading mesh '%s'...\n", filename);
+    
+    // decoupe le fichier en blocs de lignes completes, au moins 1Mo par bloc, quelques blocs par thread pour equilibrer la charge
+    const char *file_begin= buffer.data();
+    const char *file_end= buffer.data() + buffer.size() -1;
+    size_t size= file_end - file_begin;
+    
+    int threads= 1;
+#ifdef _OPENMP
+    threads= omp_get_max_threads();
+#endif
+    int n= int(std::min(size / (1024*1024) +1, size_t(4 * threads)));
+    
+    std::vector<ObjChunk> chunks;
+    const char *begin= file_begin;
+    for(int i= 1; i <= n && begin < file_end; i++)
+    {
+        const char *end= file_end;
+        if(i < n)
+        {
+            end= std::max(begin, file_begin + size * i / n);
+            end= (const char *) memchr(end, '\n', file_end - end);
+            end= (end == NULL) ? file_end : end +1;
+        }
+        
+        chunks.push_back( ObjChunk(begin, end) );
+        begin= end;
+    }
+    
+    // analyse les blocs en parallele
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i= 0; i < int(chunks.size()); i++)
+        parse_obj_chunk(chunks[i]);
+    
+    // ne conserve que les blocs qui precedent la premiere erreur
+    const char *error= NULL;
+    for(int i= 0; i < int(chunks.size()); i++)
+        if(chunks[i].error)
+        {
+            error= chunks[i].error;
+            chunks.erase(chunks.begin() + i +1, chunks.end());
+            break;
+        }
+    
+    // nombre de sommets des blocs precedents, pour resoudre les indices relatifs
+    int positions= 0;
+    int texcoords= 0;
+    int normals= 0;
+    for(int i= 0; i < int(chunks.size()); i++)
+    {
+        chunks[i].position_offset= positions;
+        chunks[i].texcoord_offset= texcoords;
+        chunks[i].normal_offset= normals;
+        positions+= int(chunks[i].positions.size());
+        texcoords+= int(chunks[i].texcoords.size());
+        normals+= int(chunks[i].normals.size());
+    }
+    
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i= 0; i < int(chunks.size()); i++)
+        resolve_obj_chunk(chunks[i]);
+    
+    int triangles= 0;
+    for(int i= 0; i < int(chunks.size()); i++)
+    {
+        chunks[i].triangle_offset= triangles;
+        triangles+= chunks[i].triangles;
+        
+        for(int k= 0; k < int(chunks[i].commands.size()); k++)
+        {
+            data.commands.push_back(chunks[i].commands[k]);
+            data.commands.back().triangle+= chunks[i].triangle_offset;
+        }
+    }
+    
+    // rassemble les blocs
+    data.positions.resize(positions);
+    data.texcoords.resize(texcoords);
+    data.normals.resize(normals);
+    data.position_indices.resize(3*triangles);
+    data.texcoord_indices.resize(3*triangles);
+    data.normal_indices.resize(3*triangles);
+    
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i= 0; i < int(chunks.size()); i++)
+    {
+        const ObjChunk& chunk= chunks[i];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), data.positions.begin() + chunk.position_offset);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), data.texcoords.begin() + chunk.texcoord_offset);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + chunk.normal_offset);
+        
+        for(int k= 0; k < 3*chunk.triangles; k++)
+        {
+            data.position_indices[3*chunk.triangle_offset + k]= chunk.corners[3*k];
+            data.texcoord_indices[3*chunk.triangle_offset + k]= chunk.corners[3*k +1];
+            data.normal_indices[3*chunk.triangle_offset + k]= chunk.corners[3*k +2];
+        }
+    }
+    
+    if(error)
+    {
+        const char *end= error;
+        while(*end && *end != '\n' && *end != '\r')
+            end++;
+        printf("loading mesh '%s'...\n[error]\n%.*s\n\n", filename, int(end - error), error);
+    }
+    
+    return true;
+}
+
+
+/*! enregistre les matieres dans le mesh et renvoie la matiere de chaque triangle, cf ObjData::commands.
+    reproduit les appels a Mesh::material() et Mesh::vertex() d'une lecture sequentielle.
+ */
+static
+std::vector<unsigned int> read_obj_materials( const ObjData& obj, const char *filename, Mesh& data )
+{
+    std::vector<unsigned int> triangle_materials;
+    auto triangles= [&]( const int end )
+    {
+        int begin= int(triangle_materials.size());
+        if(begin == 0 || begin >= end)
+            return;
+        triangle_materials.resize(end, triangle_materials.back());
+    };
+    
+    MaterialLib materials;
+    int default_material_id= -1;
+    int material_id= -1;
+    for(int i= 0; i < int(obj.commands.size()); i++)
+    {
+        const ObjCommand& command= obj.commands[i];
+        triangles(command.triangle);
+        
+        if(command.type == ObjCommand::FACE)
+        {
             // force une matiere par defaut, si necessaire
             if(material_id == -1)
             {
@@ -136,67 +606,271 @@ Mesh read_mesh( const char *filename )
                     default_material_id= data.mesh_material(Material());
                 
                 material_id= default_material_id;
-                data.material(material_id);
+                triangle_materials.push_back(material_id);
                 
                 printf("usemtl default\n");
             }
+        }
+        
+        else if(command.type == ObjCommand::MTLLIB)
+        {
+            materials= read_materials( std::string(pathname(filename) + command.name).c_str() );
+            // enregistre les matieres dans le mesh
+            data.mesh_materials(materials.data);
+        }
+        
+        else if(command.type == ObjCommand::USEMTL)
+        {
+            auto found= materials.ids.find(command.name);
+            material_id= (found != materials.ids.end()) ? found->second : -1;
             
-            for(int v= 2; v +1 < (int) idp.size(); v++)
+            if(material_id == -1)
             {
-                int idv[3]= { 0, v -1, v };
-                for(int i= 0; i < 3; i++)
-                {
-                    int k= idv[i];
-                    int p= (idp[k] < 0) ? (int) positions.size() + idp[k] : idp[k] -1;
-                    int t= (idt[k] < 0) ? (int) texcoords.size() + idt[k] : idt[k] -1;
-                    int n= (idn[k] < 0) ? (int) normals.size()   + idn[k] : idn[k] -1;
-                    
-                    if(p < 0) break; // error
-                    if(t >= 0) data.texcoord(texcoords[t]);
-                    if(n >= 0) data.normal(normals[n]);
-                    data.vertex(positions[p]);
-                }
+                // force une matiere par defaut, si necessaire
+                if(default_material_id == -1)
+                    default_material_id= data.mesh_material(Material());
+                
+                material_id= default_material_id;
             }
+            
+            // selectionne une matiere pour le prochain triangle
+            triangle_materials.push_back(material_id);
         }
+    }
+    
+    triangles(int(obj.position_indices.size() / 3));
+    return triangle_materials;
+}
+
+//! relit un mesh enregistre par write_mesh_cache(), renvoie faux si le cache n'existe pas ou n'est plus valide.
+static
+bool read_mesh_cache( const char *filename, const MeshCacheType type, Mesh& data )
+{
+    MeshCache cache(filename, type);
+    if(!cache || cache.block_count() != 6)
+        return false;
+    
+    std::vector<vec3> positions;
+    std::vector<vec2> texcoords;
+    std::vector<vec3> normals;
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> triangle_materials;
+    std::vector<Material> materials;
+    if(!cache.read(0, positions) || !cache.read(1, texcoords) || !cache.read(2, normals) 
+    || !cache.read(3, indices) || !cache.read(4, triangle_materials) || !cache.read(5, materials))
+        return false;
+    
+    data.positions(positions);
+    if(texcoords.size())
+        data.texcoords(texcoords);
+    if(normals.size())
+        data.normals(normals);
+    if(indices.size())
+        data.indices(indices);
+    data.materials(triangle_materials);
+    data.mesh_materials(materials);
+    
+    printf("[cache] read '%s'\n", filename);
+    return true;
+}
+
+//! enregistre un mesh, et les noms des fichiers .obj et .mtl utilises pour le construire, cf read_mesh_cache().
+static
+bool write_mesh_cache( const char *filename, const MeshCacheType type, const Mesh& data, const char *obj_filename, const ObjData& obj )
+{
+    // les sommets n'ont pas tous des texcoords ou des normales, cf read_mesh(), le cache ne peut pas les representer
+    if((data.texcoords().size() && data.texcoords().size() != data.positions().size())
+    || (data.normals().size() && data.normals().size() != data.positions().size()))
+        return false;
+    
+    MeshCacheWriter cache;
+    cache.dependency(obj_filename);
+    for(int i= 0; i < int(obj.commands.size()); i++)
+        if(obj.commands[i].type == ObjCommand::MTLLIB)
+            cache.dependency(pathname(obj_filename) + obj.commands[i].name);
+    
+    cache.block(data.positions());
+    cache.block(data.texcoords());
+    cache.block(data.normals());
+    cache.block(data.indices());
+    cache.block(data.materials());
+    cache.block(data.mesh_materials());
+    return cache.write(filename, type);
+}
+
+Mesh read_mesh( const char *filename )
+{
+    auto cpu_start= std::chrono::high_resolution_clock::now();
+    
+    Mesh data(GL_TRIANGLES);
+    
+    // relit le cache, s'il est active, s'il existe et si les fichiers .obj et .mtl n'ont pas ete modifies
+    std::string cache_filename= mesh_cache_filename(filename, ".mesh");
+    if(!cache_filename.empty() && read_mesh_cache(cache_filename.c_str(), CACHE_MESH, data))
+    {
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("mesh '%s': %d triangles, cpu %dms\n", filename, data.triangle_count(), cpu_time);
+        return data;
+    }
+    
+    ObjData obj;
+    if(!read_obj_data(filename, obj))
+        return Mesh::error();
+    
+    std::vector<unsigned int> triangle_materials= read_obj_materials(obj, filename, data);
+    
+    int n= int(obj.position_indices.size());
+    
+    // les sommets ont tous, ou n'ont pas, de texcoord ou de normale : copie les attributs en parallele
+    int texcoord_count= 0;
+    int normal_count= 0;
+    #pragma omp parallel for reduction(+: texcoord_count, normal_count)
+    for(int i= 0; i < n; i++)
+    {
+        if(obj.texcoord_indices[i] >= 0) texcoord_count++;
+        if(obj.normal_indices[i] >= 0) normal_count++;
+    }
+    
+    if((texcoord_count == 0 || texcoord_count == n) && (normal_count == 0 || normal_count == n))
+    {
+        std::vector<vec3> positions(n);
+        #pragma omp parallel for
+        for(int i= 0; i < n; i++)
+            positions[i]= obj.positions[obj.position_indices[i]];
+        data.positions(positions);
         
-        else if(line[0] == 'm')
+        if(texcoord_count)
         {
-           if(sscanf(line, "mtllib %[^\r\n]", tmp) == 1)
-           {
-               materials= read_materials( std::string(pathname(filename) + tmp).c_str() );
-               // enregistre les matieres dans le mesh
-               data.mesh_materials(materials.data);
-           }
+            std::vector<vec2> texcoords(n);
+            #pragma omp parallel for
+            for(int i= 0; i < n; i++)
+                texcoords[i]= obj.texcoords[obj.texcoord_indices[i]];
+            data.texcoords(texcoords);
         }
         
-        else if(line[0] == 'u')
+        if(normal_count)
         {
-           if(sscanf(line, "usemtl %[^\r\n]", tmp) == 1)
-           {
-               material_id= -1;
-               for(unsigned int i= 0; i < (unsigned int) materials.names.size(); i++)
-                    if(materials.names[i] == tmp)
-                        material_id= i;
-                
-                if(material_id == -1)
-                {
-                    // force une matiere par defaut, si necessaire
-                    if(default_material_id == -1)
-                        default_material_id= data.mesh_material(Material());
-                    
-                    material_id= default_material_id;
-                }
-                
-                // selectionne une matiere pour le prochain triangle
-                data.material(material_id);
-           }
+            std::vector<vec3> normals(n);
+            #pragma omp parallel for
+            for(int i= 0; i < n; i++)
+                normals[i]= obj.normals[obj.normal_indices[i]];
+            data.normals(normals);
+        }
+    }
+    else
+    {
+        // cas general, les attributs manquants sont recopies du sommet precedent, cf Mesh::vertex()
+        for(int i= 0; i < n; i++)
+        {
+            if(obj.texcoord_indices[i] >= 0) data.texcoord(obj.texcoords[obj.texcoord_indices[i]]);
+            if(obj.normal_indices[i] >= 0) data.normal(obj.normals[obj.normal_indices[i]]);
+            data.vertex(obj.positions[obj.position_indices[i]]);
         }
     }
     
-    fclose(in);
+    data.materials(triangle_materials);
+    if(!cache_filename.empty())
+        write_mesh_cache(cache_filename.c_str(), CACHE_MESH, data, filename, obj);
     
-    if(error)
-        printf("loading mesh '%s'...\n[error]\n%s\n\n", filename, line_buffer);
+    auto cpu_stop= std::chrono::high_resolution_clock::now();
+    int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+    printf("mesh '%s': %d triangles, cpu %dms\n", filename, data.triangle_count(), cpu_time);
+    
+    return data;
+}
+
+Mesh read_indexed_mesh( const char *filename )
+{
+    auto cpu_start= std::chrono::high_resolution_clock::now();
+    
+    Mesh data(GL_TRIANGLES);
+    
+    // relit le cache, s'il est active, s'il existe et si les fichiers .obj et .mtl n'ont pas ete modifies
+    std::string cache_filename= mesh_cache_filename(filename, ".imesh");
+    if(!cache_filename.empty() && read_mesh_cache(cache_filename.c_str(), CACHE_INDEXED_MESH, data))
+    {
+        auto cpu_stop= std::chrono::high_resolution_clock::now();
+        int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+        printf("mesh '%s': %d triangles, %d vertices, cpu %dms\n", filename, data.triangle_count(), data.vertex_count(), cpu_time);
+        return data;
+    }
+    
+    ObjData obj;
+    if(!read_obj_data(filename, obj))
+        return Mesh::error();
+    
+    std::vector<unsigned int> triangle_materials= read_obj_materials(obj, filename, data);
+    
+    // un sommet par triplet d'indices (position, texcoord, normale) different. 
+    // les sommets sont ranges par position : la table est indexee par la position, puis on compare les texcoords et les normales
+    int n= int(obj.position_indices.size());
+    std::vector<int> heads(obj.positions.size(), -1);    // dernier sommet cree pour chaque position
+    std::vector<int> next;                               // sommet precedent de la meme position
+    std::vector<int> texcoord_ids;
+    std::vector<int> normal_ids;
+    std::vector<unsigned int> indices(n);
+    
+    int texcoord_count= 0;
+    int normal_count= 0;
+    for(int i= 0; i < n; i++)
+    {
+        int p= obj.position_indices[i];
+        int t= obj.texcoord_indices[i];
+        int nn= obj.normal_indices[i];
+        
+        int v= heads[p];
+        for(; v != -1; v= next[v])
+            if(texcoord_ids[v] == t && normal_ids[v] == nn)
+                break;
+        
+        if(v == -1)
+        {
+            v= int(next.size());
+            next.push_back(heads[p]);
+            heads[p]= v;
+            texcoord_ids.push_back(t);
+            normal_ids.push_back(nn);
+            
+            data.vertex(obj.positions[p]);
+            if(t >= 0) texcoord_count++;
+            if(nn >= 0) normal_count++;
+        }
+        
+        indices[i]= v;
+    }
+    
+    // attributs des sommets, s'ils sont definis. 
+    // si seuls certains sommets en ont, les autres recoivent des texcoords ou des normales nulles
+    int m= int(next.size());
+    if(texcoord_count)
+    {
+        std::vector<vec2> texcoords(m);
+        for(int i= 0; i < m; i++)
+            if(texcoord_ids[i] >= 0)
+                texcoords[i]= obj.texcoords[texcoord_ids[i]];
+        data.texcoords(texcoords);
+    }
+    
+    if(normal_count)
+    {
+        std::vector<vec3> normals(m);
+        for(int i= 0; i < m; i++)
+            if(normal_ids[i] >= 0)
+                normals[i]= obj.normals[normal_ids[i]];
+        data.normals(normals);
+    }
+    
+    for(int i= 0; i +2 < n; i+= 3)
+        data.triangle(indices[i], indices[i +1], indices[i +2]);
+    
+    data.materials(triangle_materials);
+    if(!cache_filename.empty())
+        write_mesh_cache(cache_filename.c_str(), CACHE_INDEXED_MESH, data, filename, obj);
+    
+    auto cpu_stop= std::chrono::high_resolution_clock::now();
+    int cpu_time= std::chrono::duration_cast<std::chrono::milliseconds>(cpu_stop - cpu_start).count();
+    printf("mesh '%s': %d triangles, %d vertices, cpu %dms\n", filename, data.triangle_count(), data.vertex_count(), cpu_time);
     
     return data;
 }
@@ -261,75 +935,185 @@ int write_mesh( const Mesh& mesh, const char *filename )
 }
 
 
-MaterialLib read_materials( const char *filename )
+//! compare le mot cle d'une ligne, de longueur length, a key.
+static inline
+bool is_key( const char *text, const int length, const char *key )
 {
-    MaterialLib materials;
-    
-    FILE *in= fopen(filename, "rt");
-    if(in == NULL)
+    return int(strlen(key)) == length && strncmp(text, key, length) == 0;
+}
+
+//! lit une couleur r g b, ou une seule valeur pour les 3 composantes, renvoie faux s'il n'y a pas de nombre.
+static
+bool parse_color( const char *text, Color& color )
+{
+    float r, g, b;
+    if(!parse_float(text, r))
+        return false;
+    if(!parse_float(text, g))
     {
-        printf("[error] loading materials '%s'...\n", filename);
-        return materials;
+        color= Color(r);
+        return true;
     }
+    if(!parse_float(text, b))
+        return false;
     
-    printf("loading materials '%s'...\n", filename);
-    
-    Material *material= NULL;
-    char tmp[1024];
-    char line_buffer[1024];
-    bool error= true;
-    for(;;)
+    color= Color(r, g, b);
+    return true;
+}
+
+/*! renvoie le nom de la texture d'une ligne map_xx, sans ses options : -bm 0.5, -o u v w, -clamp on, etc.
+    une option est suivie de nombres, ou de on / off.
+ */
+static
+std::string parse_map_name( const char *text, const char *end )
+{
+    text= skip_spaces(text);
+    while(text < end && *text == '-')
     {
-        // charge une ligne du fichier
-        if(fgets(line_buffer, sizeof(line_buffer), in) == NULL)
+        // saute le nom de l'option
+        const char *p= text;
+        while(p < end && !is_separator(*p))
+            p++;
+        
+        // et ses parametres
+        for(;;)
         {
-            error= false;       // fin du fichier, pas d'erreur detectee
-            break;
+            p= skip_spaces(p);
+            const char *next= p;
+            float value;
+            if(parse_float(next, value) && is_separator(*next))
+                p= next;
+            else if(strncmp(p, "on", 2) == 0 && is_separator(p[2]))
+                p= p + 2;
+            else if(strncmp(p, "off", 3) == 0 && is_separator(p[3]))
+                p= p + 3;
+            else
+                break;
         }
-        
-        // force la fin de la ligne, au cas ou
-        line_buffer[sizeof(line_buffer) -1]= 0;
+        text= p;
+    }
+    
+    return parse_name(text, end);
+}
+
+bool read_mtl_data( const char *filename, MtlData& data )
+{
+    static const struct { const char *key; std::string MtlMaterial::*filename; } maps[]= {
+        { "map_Kd", &MtlMaterial::diffuse_filename },
+        { "map_Ks", &MtlMaterial::specular_filename },
+        { "map_Ke", &MtlMaterial::emission_filename },
+        { "map_Ns", &MtlMaterial::ns_filename },
+        { "map_Pr", &MtlMaterial::roughness_filename },
+        { "map_Pm", &MtlMaterial::metallic_filename },
+        { "map_bump", &MtlMaterial::normal_filename },
+        { "map_Bump", &MtlMaterial::normal_filename },
+        { "bump", &MtlMaterial::normal_filename },
+        { "norm", &MtlMaterial::normal_filename },
+    };
+    
+    std::vector<char> buffer;
+    if(!read_file(filename, buffer))
+        return false;
+    
+    const char *end= buffer.data() + buffer.size() -1;  // sans le 0 final
+    MtlMaterial *material= NULL;
+    for(const char *next= buffer.data(); next < end; )
+    {
+        const char *line= next;
+        const char *line_end= (const char *) memchr(line, '\n', end - line);
+        if(line_end == NULL)
+            line_end= end;
+        next= line_end +1;
         
         // saute les espaces en debut de ligne
-        char *line= line_buffer;
-        while(*line && isspace(*line))
+        while(line < line_end && isspace((unsigned char) *line))
             line++;
         
-        if(line[0] == 'n')
+        // isole le mot cle
+        const char *p= line;
+        while(p < line_end && !is_separator(*p))
+            p++;
+        int length= int(p - line);
+        if(length == 0 || line[0] == '#')
+            continue;
+        
+        if(is_key(line, length, "newmtl"))
         {
-            if(sscanf(line, "newmtl %[^\r\n]", tmp) == 1)
-            {
-                materials.names.push_back( tmp );
-                materials.data.push_back( Material() );
-                material= &materials.data.back();
-            }
+            data.materials.push_back( MtlMaterial() );
+            material= &data.materials.back();
+            material->name= parse_name(p, line_end);
+            data.ids[material->name]= int(data.materials.size()) -1;
+            continue;
         }
         
         if(material == NULL)
             continue;
         
-        if(line[0] == 'K')
+        if(is_key(line, length, "Kd"))
+            parse_color(p, material->diffuse);
+        else if(is_key(line, length, "Ks"))
+            parse_color(p, material->specular);
+        else if(is_key(line, length, "Ke"))
+            parse_color(p, material->emission);
+        else if(is_key(line, length, "Ns"))         // Ns, puissance / concentration du reflet, modele blinn phong
+            parse_float(p, material->ns);
+        else if(is_key(line, length, "Pr"))
+            parse_float(p, material->roughness);
+        else if(is_key(line, length, "Pm"))
+            parse_float(p, material->metallic);
+        else
         {
-            float r, g, b;
-            if(sscanf(line, "Kd %f %f %f", &r, &g, &b) == 3)
-                material->diffuse= Color(r, g, b);
-            else if(sscanf(line, "Ks %f %f %f", &r, &g, &b) == 3)
-                material->specular= Color(r, g, b);
-            else if(sscanf(line, "Ke %f %f %f", &r, &g, &b) == 3)
-                material->emission= Color(r, g, b);
+            for(unsigned int k= 0; k < sizeof(maps) / sizeof(maps[0]); k++)
+                if(is_key(line, length, maps[k].key))
+                {
+                    material->*maps[k].filename= parse_map_name(p, line_end);
+                    break;
+                }
         }
+    }
+    
+    return true;
+}
+
+MaterialLib read_materials( const char *filename )
+{
+    MaterialLib materials;
+    
+    MtlData mtl;
+    if(!read_mtl_data(filename, mtl))
+    {
+        printf("[error] loading materials '%s'...\n", filename);
+        return materials;
+    }
+    
+    printf("loading materials '%s'...\n", filename);
+    
+    materials.names.reserve(mtl.materials.size());
+    materials.data.reserve(mtl.materials.size());
+    int ignored= 0;
+    for(int i= 0; i < int(mtl.materials.size()); i++)
+    {
+        const MtlMaterial& m= mtl.materials[i];
         
-        else if(line[0] == 'N')
-        {
-            float n;
-            if(sscanf(line, "Ns %f", &n) == 1)          // Ns, puissance / concentration du reflet, modele blinn phong
-                material->ns= n;
-        }
+        // Material ne represente ni les textures, ni les parametres pbr, cf read_mtl_data()
+        if(!m.diffuse_filename.empty() || !m.specular_filename.empty() || !m.emission_filename.empty() || !m.ns_filename.empty()
+        || !m.roughness_filename.empty() || !m.metallic_filename.empty() || !m.normal_filename.empty()
+        || m.roughness != 1 || m.metallic != 0)
+            ignored++;
+        
+        Material material;
+        material.diffuse= m.diffuse;
+        material.specular= m.specular;
+        material.emission= m.emission;
+        material.ns= m.ns;
+        
+        materials.names.push_back(m.name);
+        materials.data.push_back(material);
     }
+    materials.ids= std::move(mtl.ids);
     
-    fclose(in);
-    if(error)
-        printf("[error] parsing line :\n%s\n", line_buffer);
+    if(ignored)
+        printf("[warning] %d materials use textures or pbr parameters (map_xx, norm, bump, Pr, Pm), ignored by read_materials(), cf read_mtl_data()\n", ignored);
     
     return materials;
 }
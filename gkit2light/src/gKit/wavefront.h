@@ -2,6 +2,10 @@
 #ifndef _OBJ_H
 #define _OBJ_H
 
+#include <string>
+#include <vector>
+#include <unordered_map>
+
 #include "mesh.h"
 
 
@@ -11,9 +15,17 @@
 //! \file 
 //! charge un fichier wavefront .obj et construit un mesh.
 
-//! charge un fichier wavefront .obj et renvoie un mesh compose de triangles non indexes. utiliser glDrawArrays pour l'afficher. a detruire avec Mesh::release( ).
+/*! charge un fichier wavefront .obj et renvoie un mesh compose de triangles non indexes. utiliser glDrawArrays pour l'afficher. a detruire avec Mesh::release( ).
+    si les caches sont actives, cf mesh_cache_directory(), le mesh est enregistre dans un fichier cache, filename.mesh, relu lors du prochain chargement.
+ */
 Mesh read_mesh( const char *filename );
 
+/*! charge un fichier wavefront .obj et renvoie un mesh compose de triangles indexes. utiliser glDrawElements pour l'afficher. a detruire avec Mesh::release( ).
+    les sommets qui partagent la meme position, les memes coordonnees de texture et la meme normale dans le fichier ne sont stockes qu'une fois.
+    si les caches sont actives, cf mesh_cache_directory(), le mesh est enregistre dans un fichier cache, filename.imesh.
+ */
+Mesh read_indexed_mesh( const char *filename );
+
 //! enregistre un mesh dans un fichier .obj.
 int write_mesh( const Mesh& mesh, const char *filename );
 
@@ -22,10 +34,83 @@ struct MaterialLib
 {
     std::vector<std::string> names;
     std::vector<Material> data;
+    std::unordered_map<std::string, int> ids;   //!< indice de chaque matiere, retrouve a partir de son nom
 };
 
-//! charge une description de matieres, utilise par read_mesh.
+//! charge une description de matieres, utilise par read_mesh. les textures et les parametres pbr ne sont pas conserves, cf read_mtl_data().
 MaterialLib read_materials( const char *filename );
 
+
+/*! matiere decrite dans un fichier .mtl, cf read_mtl_data().
+    les noms des textures sont conserves tels qu'ils sont dans le fichier, sans les options, ils sont relatifs au fichier .mtl.
+ */
+struct MtlMaterial
+{
+    std::string name;                   //!< newmtl
+    Color diffuse;                      //!< Kd
+    Color specular;                     //!< Ks
+    Color emission;                     //!< Ke
+    float ns;                           //!< Ns, exposant pour les reflets blinn-phong
+    float roughness;                    //!< Pr, extension pbr
+    float metallic;                     //!< Pm, extension pbr
+    
+    std::string diffuse_filename;       //!< map_Kd
+    std::string specular_filename;      //!< map_Ks
+    std::string emission_filename;      //!< map_Ke
+    std::string ns_filename;            //!< map_Ns
+    std::string roughness_filename;     //!< map_Pr
+    std::string metallic_filename;      //!< map_Pm
+    std::string normal_filename;        //!< norm, bump ou map_bump
+    
+    MtlMaterial( ) : name(), diffuse(0.8f, 0.8f, 0.8f), specular(Black()), emission(), ns(0), roughness(1), metallic(0),
+        diffuse_filename(), specular_filename(), emission_filename(), ns_filename(), roughness_filename(), metallic_filename(), normal_filename() {}
+};
+
+//! contenu d'un fichier .mtl.
+struct MtlData
+{
+    std::vector<MtlMaterial> materials;
+    std::unordered_map<std::string, int> ids;   //!< indice de chaque matiere, la derniere declaree si plusieurs matieres ont le meme nom
+};
+
+/*! charge un fichier .mtl, utilise par read_materials. renvoie faux si le fichier n'existe pas.
+    le fichier est lu en une seule passe, les lignes inconnues ou invalides sont ignorees.
+ */
+bool read_mtl_data( const char *filename, MtlData& data );
+
+
+//! commande d'un fichier .obj qui change la matiere des triangles suivants, cf ObjData.
+struct ObjCommand
+{
+    enum Type { FACE, MTLLIB, USEMTL };
+    
+    Type type;          //!< FACE : premiere face d'un bloc du fichier, permet de detecter les faces sans matiere.
+    int triangle;       //!< nombre de triangles decrits avant la commande.
+    std::string name;   //!< nom de la matiere ou du fichier de matieres.
+};
+
+/*! contenu d'un fichier .obj : attributs des sommets et triangles, sans interpretation des matieres.
+    les faces sont triangulees (0 1 2, 0 2 3, etc.) et les indices sont resolus, ils commencent a 0.
+    un triangle dont une position n'existe pas est ignore, un indice de texcoord ou de normale qui n'existe pas est remplace par -1.
+ */
+struct ObjData
+{
+    std::vector<vec3> positions;
+    std::vector<vec2> texcoords;
+    std::vector<vec3> normals;
+    
+    std::vector<int> position_indices;  //!< 3 indices par triangle
+    std::vector<int> texcoord_indices;  //!< 3 indices par triangle, -1 si le sommet n'a pas de coordonnees de texture
+    std::vector<int> normal_indices;    //!< 3 indices par triangle, -1 si le sommet n'a pas de normale
+    
+    std::vector<ObjCommand> commands;   //!< mtllib, usemtl, dans l'ordre du fichier
+};
+
+/*! charge un fichier .obj, utilise par read_mesh. renvoie faux si le fichier n'existe pas. 
+    si le fichier contient une erreur, data contient les lignes valides qui la precedent.
+    le fichier est decoupe en blocs de lignes, analyses en parallele, le resultat est identique a une lecture sequentielle.
+ */
+bool read_obj_data( const char *filename, ObjData& data );
+
 ///@}
 #endif
@@ -1,6 +1,10 @@
 
 #include <cfloat>
 #include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
 
 #include "app.h"
 
@@ -124,6 +128,330 @@ struct Source : public Triangle
     
     Source( ) : Triangle(), emission() {}
     Source( const TriangleData& data, const Color& color ) : Triangle(data), emission(color) {}
+    
+    //! renvoie l'aire du triangle.
+    float area( ) const { return length(cross(Point(b) - Point(a), Point(c) - Point(a))) / 2; }
+    
+    //! renvoie la normale geometrique du triangle, la source emet de ce cote.
+    Vector geometric_normal( ) const { return normalize(cross(Point(b) - Point(a), Point(c) - Point(a))); }
+    
+    //! renvoie le centre du triangle.
+    Point center( ) const { return Point((Vector(a) + Vector(b) + Vector(c)) / 3); }
+    
+    //! renvoie la puissance emise par la source, cf Color::power().
+    float power( ) const { return emission.power() * area() * float(M_PI); }
+    
+    //! renvoie un point uniforme sur le triangle, u1, u2 uniformes [0 1[.
+    Point sample( const float u1, const float u2 ) const
+    {
+        float r= std::sqrt(u1);
+        return point(1 - r, u2 * r);
+    }
+};
+
+/* choisit un element proportionnellement a son poids, en temps constant, cf "alias method"
+    "A Linear Algorithm For Generating Random Numbers With a Given Distribution", M. Vose, 1991
+*/
+struct AliasTable
+{
+    struct Entry
+    {
+        float threshold;    // probabilite de garder l'element, sinon alias
+        int alias;
+        float pdf;          // probabilite de choisir l'element
+    };
+    
+    std::vector<Entry> entries;
+    
+    void build( const std::vector<float>& weights )
+    {
+        int n= (int) weights.size();
+        entries.assign(n, Entry());
+        
+        double total= 0;
+        for(int i= 0; i < n; i++)
+            total+= weights[i];
+        if(total <= 0)
+            return;
+        
+        // repartit les elements en 2 groupes : poids inferieur ou superieur a la moyenne
+        std::vector<double> scaled(n);
+        std::vector<int> small;
+        std::vector<int> large;
+        for(int i= 0; i < n; i++)
+        {
+            entries[i]= { 1, i, float(weights[i] / total) };
+            scaled[i]= weights[i] * n / total;
+            if(scaled[i] < 1)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+        
+        // complete chaque petit element avec un grand
+        while(!small.empty() && !large.empty())
+        {
+            int s= small.back(); small.pop_back();
+            int l= large.back(); large.pop_back();
+            
+            entries[s].threshold= float(scaled[s]);
+            entries[s].alias= l;
+            
+            scaled[l]= (scaled[l] + scaled[s]) - 1;
+            if(scaled[l] < 1)
+                small.push_back(l);
+            else
+                large.push_back(l);
+        }
+        // les elements restants sont gardes, a la precision des calculs pres
+    }
+    
+    // renvoie l'indice d'un element, u uniforme [0 1[
+    int sample( const float u ) const
+    {
+        int n= (int) entries.size();
+        float x= u * n;
+        int i= std::min(int(x), n -1);
+        return (x - i < entries[i].threshold) ? i : entries[i].alias;
+    }
+    
+    float pdf( const int i ) const { return entries[i].pdf; }
+};
+
+
+/* arbre de sources de lumiere, choisit une source en fonction de sa contribution estimee au point eclaire, en O(log n).
+    chaque noeud conserve l'englobant, la puissance et le cone des normales de ses sources. 
+    cf "Importance Sampling of Many Lights with Adaptive Tree Splitting", A. Conty Estevez, C. Kulla, 2018
+*/
+struct LightTree
+{
+    struct Node
+    {
+        Point pmin, pmax;
+        Vector axis;        // direction moyenne des normales des sources
+        float cos_theta;    // cos de l'angle maximum entre axis et les normales des sources
+        float power;
+        int left, right;    // fils, -1 pour une feuille
+        int parent;
+        int source;         // source d'une feuille, -1 pour un noeud interne
+    };
+    
+    std::vector<Node> nodes;
+    std::vector<int> leaves;        // feuille de chaque source
+    
+    void build( const std::vector<Source>& sources )
+    {
+        nodes.clear();
+        leaves.assign(sources.size(), -1);
+        if(sources.empty())
+            return;
+        
+        std::vector<int> ids(sources.size());
+        for(int i= 0; i < (int) ids.size(); i++)
+            ids[i]= i;
+        
+        nodes.reserve(2 * sources.size());
+        build_node(sources, ids, 0, (int) ids.size(), -1);
+    }
+    
+    // estime la contribution des sources du noeud au point p, de normale n : puissance, orientation des sources et du point, distance
+    float importance( const Node& node, const Point& p, const Vector& n ) const
+    {
+        Point center= ::center(node.pmin, node.pmax);
+        float radius= distance(center, node.pmax);
+        Vector d= center - p;
+        float d2= dot(d, d);
+        if(d2 <= radius * radius)
+            return node.power;          // p est dans l'englobant, pas d'estimation
+        
+        float dist= std::sqrt(d2);
+        d= d / dist;
+        float theta_u= std::asin(std::min(1.f, radius / dist));        // demi angle apparent de l'englobant
+        
+        // angle entre la normale du point et l'englobant
+        float theta_i= std::max(0.f, std::acos(clamp(dot(n, d))) - theta_u);
+        if(theta_i >= float(M_PI) / 2)
+            return 0;
+        
+        // angle entre le cone des normales et la direction du point, les sources emettent du cote de leur normale
+        float theta= std::max(0.f, std::acos(clamp(dot(node.axis, -d))) - std::acos(clamp(node.cos_theta)) - theta_u);
+        if(theta >= float(M_PI) / 2)
+            return 0;
+        
+        return node.power * std::cos(theta_i) * std::cos(theta) / d2;
+    }
+    
+    // choisit une source pour eclairer le point p, de normale n, renvoie -1 si aucune source n'eclaire p, et la probabilite de la choisir
+    int sample( const Point& p, const Vector& n, float u, float& pdf ) const
+    {
+        pdf= 0;
+        if(nodes.empty())
+            return -1;
+        
+        float probability= 1;
+        int id= 0;
+        while(nodes[id].source < 0)
+        {
+            float left= importance(nodes[nodes[id].left], p, n);
+            float right= importance(nodes[nodes[id].right], p, n);
+            if(left + right <= 0)
+                return -1;
+            
+            // choisit un fils et reutilise u pour les niveaux suivants
+            float p_left= left / (left + right);
+            if(u < p_left)
+            {
+                u= std::min(u / p_left, 0.99999994f);
+                probability*= p_left;
+                id= nodes[id].left;
+            }
+            else
+            {
+                u= std::min((u - p_left) / (1 - p_left), 0.99999994f);
+                probability*= 1 - p_left;
+                id= nodes[id].right;
+            }
+        }
+        
+        pdf= probability;
+        return nodes[id].source;
+    }
+    
+    // renvoie la probabilite de choisir la source pour eclairer le point p, de normale n, cf sample()
+    float pdf( const Point& p, const Vector& n, const int source ) const
+    {
+        float probability= 1;
+        for(int id= leaves[source]; nodes[id].parent >= 0; id= nodes[id].parent)
+        {
+            const Node& parent= nodes[nodes[id].parent];
+            float left= importance(nodes[parent.left], p, n);
+            float right= importance(nodes[parent.right], p, n);
+            if(left + right <= 0)
+                return 0;
+            
+            probability*= (parent.left == id ? left : right) / (left + right);
+        }
+        
+        return probability;
+    }
+    
+    // renvoie vrai si le rayon touche une source, cf IS::direct()
+    bool intersect( const std::vector<Source>& sources, const Ray& ray ) const
+    {
+        if(nodes.empty())
+            return false;
+        
+        // les sources sont reparties en 2 moities a chaque noeud, cf build_node() : la profondeur de l'arbre est au plus log2(n) < 32,
+        // et la pile contient au plus 1 noeud par niveau, plus le dernier fils
+        Vector invd= Vector(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        int stack[stack_size];
+        int top= 0;
+        stack[top++]= 0;
+        while(top > 0)
+        {
+            const Node& node= nodes[stack[--top]];
+            if(!intersect_box(node, ray, invd))
+                continue;
+            
+            if(node.source >= 0)
+            {
+                float t, u, v;
+                if(sources[node.source].intersect(ray, ray.tmax, t, u, v))
+                    return true;
+            }
+            else
+            {
+                stack[top++]= node.left;
+                stack[top++]= node.right;
+            }
+        }
+        
+        return false;
+    }
+    
+protected:
+    static const int stack_size= 64;
+    
+    static float clamp( const float x ) { return std::max(-1.f, std::min(1.f, x)); }
+    static Point min_point( const Point& a, const Point& b ) { return Point(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)); }
+    static Point max_point( const Point& a, const Point& b ) { return Point(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)); }
+    
+    static bool intersect_box( const Node& node, const Ray& ray, const Vector& invd )
+    {
+        Point rmin= node.pmin;
+        Point rmax= node.pmax;
+        if(ray.d.x < 0) std::swap(rmin.x, rmax.x);
+        if(ray.d.y < 0) std::swap(rmin.y, rmax.y);
+        if(ray.d.z < 0) std::swap(rmin.z, rmax.z);
+        Vector dmin= (rmin - ray.o) * invd;
+        Vector dmax= (rmax - ray.o) * invd;
+        
+        float tmin= std::max(dmin.z, std::max(dmin.y, std::max(dmin.x, 0.f)));
+        float tmax= std::min(dmax.z, std::min(dmax.y, std::min(dmax.x, ray.tmax)));
+        return (tmin <= tmax);
+    }
+    
+    int build_node( const std::vector<Source>& sources, std::vector<int>& ids, const int begin, const int end, const int parent )
+    {
+        int id= (int) nodes.size();
+        nodes.push_back(Node());
+        
+        // englobant, puissance et normales des sources
+        Point pmin= Point(FLT_MAX, FLT_MAX, FLT_MAX);
+        Point pmax= Point(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        Point cmin= pmin;
+        Point cmax= pmax;
+        Vector axis= Vector(0, 0, 0);
+        float power= 0;
+        for(int i= begin; i < end; i++)
+        {
+            const Source& source= sources[ids[i]];
+            pmin= min_point(pmin, min_point(Point(source.a), min_point(Point(source.b), Point(source.c))));
+            pmax= max_point(pmax, max_point(Point(source.a), max_point(Point(source.b), Point(source.c))));
+            cmin= min_point(cmin, source.center());
+            cmax= max_point(cmax, source.center());
+            
+            axis= axis + source.geometric_normal() * source.power();
+            power+= source.power();
+        }
+        
+        float l= length(axis);
+        axis= (l > 0) ? axis / l : Vector(0, 0, 1);
+        float cos_theta= 1;
+        for(int i= begin; i < end; i++)
+            cos_theta= std::min(cos_theta, dot(axis, sources[ids[i]].geometric_normal()));
+        
+        Node node;
+        node.pmin= pmin;
+        node.pmax= pmax;
+        node.axis= axis;
+        node.cos_theta= (l > 0) ? cos_theta : -1;
+        node.power= power;
+        node.left= -1;
+        node.right= -1;
+        node.parent= parent;
+        node.source= -1;
+        
+        if(end - begin == 1)
+        {
+            node.source= ids[begin];
+            leaves[ids[begin]]= id;
+            nodes[id]= node;
+            return id;
+        }
+        
+        // repartit les sources en 2 moities, le long du plus grand axe de l'englobant des centres
+        Vector extent= cmax - cmin;
+        int axis_id= (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+        int middle= (begin + end) / 2;
+        std::nth_element(ids.begin() + begin, ids.begin() + middle, ids.begin() + end,
+            [&]( const int a, const int b ) { return sources[a].center()(axis_id) < sources[b].center()(axis_id); });
+        
+        node.left= build_node(sources, ids, begin, middle, id);
+        node.right= build_node(sources, ids, middle, end, id);
+        nodes[id]= node;
+        return id;
+    }
 };
 
 
@@ -369,6 +697,29 @@ struct IS : public App
         else if(mode == 0)
             draw(m_mesh, m_camera);
         
+        // change la strategie de choix des sources
+        if(key_state('l'))
+        {
+            clear_key_state('l');
+            m_sampling= Sampling((m_sampling +1) % 3);
+            const char *names[]= { "uniform", "alias", "light tree" };
+            printf("light sampling: %s\n", names[m_sampling]);
+        }
+        
+        // calcule l'eclairage direct du point de vue courant
+        if(key_state('d'))
+        {
+            clear_key_state('d');
+            
+            auto start= std::chrono::high_resolution_clock::now();
+            Image image= render_direct(window_width(), window_height(), 16);
+            auto stop= std::chrono::high_resolution_clock::now();
+            int cpu= std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
+            printf("direct lighting %dms\n", cpu);
+            
+            write_image_hdr(image, "direct.hdr");
+        }
+        
         //
         if(key_state('s'))
         {
@@ -405,19 +756,128 @@ struct IS : public App
         }
 
         printf("%d sources.\n", (int) m_sources.size());
+        
+        // choix des sources proportionnel a leur puissance, ou en fonction du point eclaire
+        std::vector<float> power(m_sources.size());
+        for(size_t i= 0; i < m_sources.size(); i++)
+            power[i]= m_sources[i].power();
+        m_alias.build(power);
+        m_light_tree.build(m_sources);
+        printf("light tree %d nodes.\n", (int) m_light_tree.nodes.size());
+        
         return (int) m_sources.size();
     }
 
+    // renvoie vrai si le rayon touche une source, parcourt les englobants de l'arbre des sources
     bool direct( const Ray& ray )
     {
-        for(size_t i= 0; i < m_sources.size(); i++)
+        return m_light_tree.intersect(m_sources, ray);
+    }
+    
+    // choisit une source pour eclairer le point p, de normale n, et renvoie la probabilite de la choisir, cf m_sampling
+    int sample_source( const Point& p, const Vector& n, const float u, float& pdf ) const
+    {
+        pdf= 0;
+        if(m_sources.empty())
+            return -1;
+        
+        if(m_sampling == SAMPLING_UNIFORM)
         {
-            float t, u, v;
-            if(m_sources[i].intersect(ray, ray.tmax, t, u, v))
-                return true;
+            int id= std::min(int(u * m_sources.size()), int(m_sources.size()) -1);
+            pdf= 1.f / float(m_sources.size());
+            return id;
         }
+        else if(m_sampling == SAMPLING_ALIAS)
+        {
+            int id= m_alias.sample(u);
+            pdf= m_alias.pdf(id);
+            return id;
+        }
+        else
+            return m_light_tree.sample(p, n, u, pdf);
+    }
+    
+    // estime l'eclairage direct du point p, de normale n et de matiere diffuse, avec samples points sur les sources
+    Color direct_lighting( const Point& p, const Vector& n, const Color& diffuse, const int samples, std::default_random_engine& rng )
+    {
+        std::uniform_real_distribution<float> uniform(0, 1);
         
-        return false;
+        Color color= Black();
+        for(int i= 0; i < samples; i++)
+        {
+            float pdf;
+            int id= sample_source(p, n, uniform(rng), pdf);
+            if(id < 0 || pdf <= 0)
+                continue;
+            
+            const Source& source= m_sources[id];
+            Point q= source.sample(uniform(rng), uniform(rng));
+            Vector qn= source.geometric_normal();
+            Vector l= q - p;
+            float d2= dot(l, l);
+            l= l / std::sqrt(d2);
+            
+            float cos_theta= dot(n, l);
+            float cos_theta_q= dot(qn, -l);
+            if(cos_theta <= 0 || cos_theta_q <= 0)
+                continue;
+            
+            // le point sur la source est decale vers p, pour ne pas toucher la source
+            Ray shadow(p + n * 0.001f, q + qn * 0.001f);
+            Hit hit;
+            if(intersect(shadow, hit))
+                continue;
+            
+            // pdf du point : choix de la source, puis point uniforme sur son aire
+            float pdf_q= pdf / source.area();
+            color= color + source.emission * diffuse / float(M_PI) * cos_theta * cos_theta_q / d2 / pdf_q;
+        }
+        
+        return color / float(samples);
+    }
+    
+    // calcule l'eclairage direct de l'image, avec la strategie de choix des sources m_sampling
+    Image render_direct( const int width, const int height, const int samples )
+    {
+        Point d0;
+        Vector dx0, dy0;
+        m_camera.frame(width, height, 0, 45, d0, dx0, dy0);
+        
+        Point d1;
+        Vector dx1, dy1;
+        m_camera.frame(width, height, 1, 45, d1, dx1, dy1);
+        
+        Image image(width, height);
+        
+    #pragma omp parallel for schedule(dynamic, 1)
+        for(int y= 0; y < height; y++)
+        {
+            std::default_random_engine rng(y);
+            for(int x= 0; x < width; x++)
+            {
+                Point o= d0 + x*dx0 + y*dy0;
+                Point e= d1 + x*dx1 + y*dy1;
+                
+                Ray ray(o, e);
+                Hit hit;
+                if(intersect(ray, hit))
+                {
+                    const Material& material= m_mesh.triangle_material(hit.object_id);
+                    // normale geometrique, si le mesh n'a pas de normales
+                    const Triangle& triangle= m_triangles[hit.object_id];
+                    Vector n= hit.n;
+                    if(length2(n) == 0)
+                        n= cross(Point(triangle.b) - Point(triangle.a), Point(triangle.c) - Point(triangle.a));
+                    n= normalize(n);
+                    if(dot(n, ray.d) > 0)
+                        n= -n;
+                    
+                    image(x, y)= Color(material.emission + direct_lighting(hit.p, n, material.diffuse, samples, rng), 1);
+                }
+            }
+        }
+        
+        return image;
     }
 
 
@@ -461,6 +921,12 @@ protected:
 
     std::vector<Triangle> m_triangles;
     std::vector<Source> m_sources;
+    
+    // choix des sources de lumiere, cf sample_source()
+    enum Sampling { SAMPLING_UNIFORM= 0, SAMPLING_ALIAS, SAMPLING_TREE };
+    Sampling m_sampling= SAMPLING_TREE;
+    AliasTable m_alias;
+    LightTree m_light_tree;
 
     Image m_hitp;
     Image m_hitn;
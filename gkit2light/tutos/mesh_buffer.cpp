@@ -129,3 +129,89 @@ MeshBuffer buffers( const MeshData& data )
     
     return mesh;
 }
+
+
+MeshBuffer read_mesh_buffer( const char *filename )
+{
+    // projette le cache en memoire, s'il est active, s'il existe et si les fichiers .obj et .mtl n'ont pas ete modifies
+    std::string cache_filename= mesh_cache_filename(filename, ".buffer");
+    if(!cache_filename.empty())
+    {
+        MeshBuffer mesh;
+        MeshCache cache(cache_filename.c_str(), CACHE_MESH_BUFFER);
+        if(cache && cache.block_count() == 8 && cache.read(5, mesh.material_groups) && read_material_cache(cache, 6, mesh.materials))
+        {
+            auto mapped= [&]( const int id )
+            {
+                MappedBuffer buffer;
+                buffer.data= cache.block(id);
+                buffer.size= cache.block_size(id);
+                return buffer;
+            };
+            
+            mesh.mapped= cache.file;
+            mesh.mapped_positions= mapped(0);
+            mesh.mapped_texcoords= mapped(1);
+            mesh.mapped_normals= mapped(2);
+            mesh.mapped_material_indices= mapped(3);
+            mesh.mapped_indices= mapped(4);
+            
+            printf("[cache] mapped '%s'\n", cache_filename.c_str());
+            printf("buffers : %d vertices, %d indices, %d groups\n", mesh.vertex_count(), mesh.index_count(), (int) mesh.material_groups.size());
+            return mesh;
+        }
+    }
+    
+    MeshData data= read_mesh_data(filename);
+    if(data.positions.size() == 0)
+        return MeshBuffer();
+    
+    // recalcule les normales des sommets, si necessaire
+    if(data.normals.size() == 0)
+    {
+        normals(data);
+        
+        printf("normals : %d positions, %d texcoords, %d normals, %d triangles\n", 
+            (int) data.positions.size(), (int) data.texcoords.size(), (int) data.normals.size(), (int) data.material_indices.size());
+    }
+    
+    MeshBuffer mesh= buffers(data);
+    if(cache_filename.empty())
+        return mesh;
+    
+    // enregistre les buffers, et les noms des fichiers .obj et .mtl utilises pour les construire
+    MeshCacheWriter cache;
+    cache.dependency(filename);
+    for(int i= 0; i < int(data.material_filenames.size()); i++)
+        cache.dependency(data.material_filenames[i]);
+    
+    cache.block(mesh.positions);
+    cache.block(mesh.texcoords);
+    cache.block(mesh.normals);
+    cache.block(mesh.material_indices);
+    cache.block(mesh.indices);
+    cache.block(mesh.material_groups);
+    write_material_cache(cache, mesh.materials);
+    cache.write(cache_filename.c_str(), CACHE_MESH_BUFFER);
+    
+    return mesh;
+}
+
+
+void bounds( const MeshBuffer& mesh, Point& pmin, Point& pmax )
+{
+    const vec3 *positions= (const vec3 *) mesh.vertex_buffer();
+    int n= mesh.vertex_count();
+    if(n < 1)
+        return;
+    
+    pmin= Point(positions[0]);
+    pmax= pmin;
+    
+    for(int i= 1; i < n; i++)
+    {
+        vec3 p= positions[i];
+        pmin= Point( std::min(pmin.x, p.x), std::min(pmin.y, p.y), std::min(pmin.z, p.z) );
+        pmax= Point( std::max(pmax.x, p.x), std::max(pmax.y, p.y), std::max(pmax.z, p.z) );
+    }
+}
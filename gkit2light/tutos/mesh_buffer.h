@@ -3,6 +3,8 @@
 #ifndef _MESH_BUFFER_H
 #define _MESH_BUFFER_H
 
+#include <memory>
+
 #include "mesh_data.h"
 
 
@@ -17,7 +19,19 @@ struct MeshGroup
 };
 
 
-//! representation d'un objet.
+//! buffer dans un fichier cache projete en memoire, cf read_mesh_buffer().
+struct MappedBuffer
+{
+    const void *data;
+    size_t size;                                //!< taille en octets
+    
+    MappedBuffer( ) : data(nullptr), size(0) {}
+};
+
+/*! representation d'un objet. 
+    les buffers sont stockes dans les vecteurs, ou directement dans le fichier cache projete en memoire, cf read_mesh_buffer(),
+    dans ce cas, les vecteurs positions, texcoords, normals, material_indices et indices sont vides, utiliser les fonctions xxx_buffer().
+ */
 struct MeshBuffer
 {
     std::vector<vec3> positions;                //!< attribut position
@@ -30,26 +44,46 @@ struct MeshBuffer
     std::vector<MaterialData> materials;        //!< ensemble de matieres
     std::vector<MeshGroup> material_groups;     //!< sequence de triangles groupes par matiere
     
-    const void *vertex_buffer( ) const { return positions.data(); }
-    size_t vertex_buffer_size( ) const { return positions.size() * sizeof(vec3); }
+    std::shared_ptr<MappedFile> mapped;         //!< fichier cache, si les buffers sont projetes en memoire
+    MappedBuffer mapped_positions;
+    MappedBuffer mapped_texcoords;
+    MappedBuffer mapped_normals;
+    MappedBuffer mapped_material_indices;
+    MappedBuffer mapped_indices;
     
-    const void *texcoord_buffer( ) const { return texcoords.data(); }
-    size_t texcoord_buffer_size( ) const { return texcoords.size() * sizeof(vec2); }
+    int vertex_count( ) const { return int(vertex_buffer_size() / sizeof(vec3)); }
+    int index_count( ) const { return int(index_buffer_size() / sizeof(int)); }
     
-    const void *normal_buffer( ) const { return normals.data(); }
-    size_t normal_buffer_size( ) const { return normals.size() * sizeof(vec3); }
+    const void *vertex_buffer( ) const { return mapped ? mapped_positions.data : positions.data(); }
+    size_t vertex_buffer_size( ) const { return mapped ? mapped_positions.size : positions.size() * sizeof(vec3); }
+    
+    const void *texcoord_buffer( ) const { return mapped ? mapped_texcoords.data : texcoords.data(); }
+    size_t texcoord_buffer_size( ) const { return mapped ? mapped_texcoords.size : texcoords.size() * sizeof(vec2); }
+    
+    const void *normal_buffer( ) const { return mapped ? mapped_normals.data : normals.data(); }
+    size_t normal_buffer_size( ) const { return mapped ? mapped_normals.size : normals.size() * sizeof(vec3); }
 
-    const void *index_buffer( ) const { return indices.data(); }
-    size_t index_buffer_size( ) const { return indices.size() * sizeof(int); }
+    const void *index_buffer( ) const { return mapped ? mapped_indices.data : indices.data(); }
+    size_t index_buffer_size( ) const { return mapped ? mapped_indices.size : indices.size() * sizeof(int); }
     const void *index_buffer_offset( const int first ) const { return (const void *) (first * sizeof(int)); }
     
-    const void *material_buffer( ) const { return material_indices.data(); }
-    size_t material_buffer_size( ) const { return material_indices.size() * sizeof(int); }
+    const void *material_buffer( ) const { return mapped ? mapped_material_indices.data : material_indices.data(); }
+    size_t material_buffer_size( ) const { return mapped ? mapped_material_indices.size : material_indices.size() * sizeof(int); }
 };
 
 
 //! construction a partir des donnees d'un maillage.
 MeshBuffer buffers( const MeshData& data );
 
+/*! charge un fichier wavefront .obj et construit les buffers, recalcule les normales si necessaire, cf read_mesh_data(), normals() et buffers().
+    si les caches sont actives, cf mesh_cache_directory(), les buffers sont enregistres dans un fichier cache, filename.buffer. 
+    lors du prochain chargement, le cache est projete en memoire, les buffers ne sont ni analyses, ni copies, 
+    vertex_buffer(), index_buffer(), etc. renvoient directement leur adresse dans le fichier.
+ */
+MeshBuffer read_mesh_buffer( const char *filename );
+
+//! renvoie l'englobant.
+void bounds( const MeshBuffer& mesh, Point& pmin, Point& pmax );
+
 
 #endif
@@ -1,12 +1,14 @@
 //! \file mesh_data.cpp
 
 #include <cstdio>
+#include <cstring>
 #include <ctype.h>
 #include <climits>
 
 #include <algorithm>
 #include <map>
 
+#include "wavefront.h"
 #include "material_data.h"
 #include "mesh_data.h"
 
@@ -38,95 +40,194 @@ std::string pathname( const std::string& filename )
 }
 
 
-MeshData read_mesh_data( const char *filename )
+//! renvoie un bloc de cache contenant des chaines de caracteres, terminees par un 0.
+static
+std::vector<unsigned char> strings_block( const std::vector<std::string>& strings )
 {
-    FILE *in= fopen(filename, "rt");
-    if(in == NULL)
+    std::vector<unsigned char> block;
+    for(int i= 0; i < int(strings.size()); i++)
     {
-        printf("[error] loading mesh '%s'...\n", filename);
-        return MeshData();
+        block.insert(block.end(), strings[i].begin(), strings[i].end());
+        block.push_back(0);
+    }
+    return block;
+}
+
+//! relit les chaines de caracteres d'un bloc de cache, cf strings_block().
+static
+std::vector<std::string> read_strings( const MeshCache& cache, const int id )
+{
+    std::vector<std::string> strings;
+    const char *text= (const char *) cache.block(id);
+    const char *end= text + cache.block_size(id);
+    while(text < end)
+    {
+        const char *next= std::find(text, end, 0);
+        strings.push_back( std::string(text, next) );
+        text= next +1;
+    }
+    return strings;
+}
+
+//! partie des matieres enregistree directement dans le cache, les noms des textures sont dans un 2ieme bloc.
+struct MaterialCacheData
+{
+    Color diffuse;
+    Color diffuse_texture_color;
+    Color specular;
+    Color emission;
+    float ns;
+    float roughness;
+    float metallic;
+};
+
+//! nombre de noms de textures enregistres par matiere, cf write_material_cache().
+static const int material_cache_filenames= 7;
+
+int write_material_cache( MeshCacheWriter& cache, const std::vector<MaterialData>& materials )
+{
+    std::vector<unsigned char> colors(materials.size() * sizeof(MaterialCacheData));
+    std::vector<std::string> filenames;
+    for(int i= 0; i < int(materials.size()); i++)
+    {
+        const MaterialData& material= materials[i];
+        MaterialCacheData data= { material.diffuse, material.diffuse_texture_color, material.specular, material.emission, material.ns, 
+            material.roughness, material.metallic };
+        memcpy(colors.data() + i * sizeof(MaterialCacheData), &data, sizeof(data));
+        
+        filenames.push_back(material.diffuse_filename);
+        filenames.push_back(material.specular_filename);
+        filenames.push_back(material.emission_filename);
+        filenames.push_back(material.ns_filename);
+        filenames.push_back(material.roughness_filename);
+        filenames.push_back(material.metallic_filename);
+        filenames.push_back(material.normal_filename);
     }
     
-    printf("loading mesh '%s'...\n", filename);
+    int id= cache.block(std::move(colors));
+    cache.block(strings_block(filenames));
+    return id;
+}
+
+bool read_material_cache( const MeshCache& cache, const int id, std::vector<MaterialData>& materials )
+{
+    std::vector<MaterialCacheData> data;
+    if(id +1 >= cache.block_count() || !cache.read(id, data))
+        return false;
+    
+    std::vector<std::string> filenames= read_strings(cache, id +1);
+    if(filenames.size() != material_cache_filenames * data.size())
+        return false;
     
+    materials.resize(data.size());
+    for(int i= 0; i < int(data.size()); i++)
+    {
+        materials[i].diffuse= data[i].diffuse;
+        materials[i].diffuse_texture_color= data[i].diffuse_texture_color;
+        materials[i].specular= data[i].specular;
+        materials[i].emission= data[i].emission;
+        materials[i].ns= data[i].ns;
+        materials[i].roughness= data[i].roughness;
+        materials[i].metallic= data[i].metallic;
+        
+        const std::string *names= filenames.data() + material_cache_filenames * i;
+        materials[i].diffuse_filename= names[0];
+        materials[i].specular_filename= names[1];
+        materials[i].emission_filename= names[2];
+        materials[i].ns_filename= names[3];
+        materials[i].roughness_filename= names[4];
+        materials[i].metallic_filename= names[5];
+        materials[i].normal_filename= names[6];
+    }
+    return true;
+}
+
+
+//! relit les donnees enregistrees par write_mesh_data_cache().
+static
+bool read_mesh_data_cache( const char *filename, MeshData& data )
+{
+    MeshCache cache(filename, CACHE_MESH_DATA);
+    if(!cache || cache.block_count() != 10)
+        return false;
+    
+    if(!cache.read(0, data.positions) || !cache.read(1, data.texcoords) || !cache.read(2, data.normals)
+    || !cache.read(3, data.position_indices) || !cache.read(4, data.texcoord_indices) || !cache.read(5, data.normal_indices)
+    || !cache.read(6, data.material_indices) || !read_material_cache(cache, 7, data.materials))
+    {
+        data= MeshData();
+        return false;
+    }
+    
+    data.material_filenames= read_strings(cache, 9);
+    printf("[cache] read '%s'\n", filename);
+    return true;
+}
+
+//! enregistre les donnees, et les noms des fichiers .obj et .mtl utilises pour les construire, cf read_mesh_data_cache().
+static
+bool write_mesh_data_cache( const char *filename, const MeshData& data, const char *obj_filename )
+{
+    MeshCacheWriter cache;
+    cache.dependency(obj_filename);
+    for(int i= 0; i < int(data.material_filenames.size()); i++)
+        cache.dependency(data.material_filenames[i]);
+    
+    cache.block(data.positions);
+    cache.block(data.texcoords);
+    cache.block(data.normals);
+    cache.block(data.position_indices);
+    cache.block(data.texcoord_indices);
+    cache.block(data.normal_indices);
+    cache.block(data.material_indices);
+    write_material_cache(cache, data.materials);
+    cache.block(strings_block(data.material_filenames));
+    return cache.write(filename, CACHE_MESH_DATA);
+}
+
+
+MeshData read_mesh_data( const char *filename )
+{
     MeshData data;
+    
+    // relit le cache, s'il est active, s'il existe et si les fichiers .obj et .mtl n'ont pas ete modifies
+    std::string cache_filename= mesh_cache_filename(filename, ".data");
+    if(!cache_filename.empty() && read_mesh_data_cache(cache_filename.c_str(), data))
+    {
+        printf("  %d positions, %d texcoords, %d normals, %d triangles\n", 
+            (int) data.positions.size(), (int) data.texcoords.size(), (int) data.normals.size(), (int) data.material_indices.size());
+        return data;
+    }
+    
+    // analyse le fichier en parallele, cf read_obj_data()
+    ObjData obj;
+    if(!read_obj_data(filename, obj))
+        return MeshData();
+    
+    data.positions.swap(obj.positions);
+    data.texcoords.swap(obj.texcoords);
+    data.normals.swap(obj.normals);
+    data.position_indices.swap(obj.position_indices);
+    data.texcoord_indices.swap(obj.texcoord_indices);
+    data.normal_indices.swap(obj.normal_indices);
+    
+    int triangles= int(data.position_indices.size() / 3);
+    data.material_indices.reserve(triangles);
+    
     MaterialDataLib materials;
     int default_material_id= -1;
     int material_id= -1;
-    
-    std::vector<int> idp;
-    std::vector<int> idt;
-    std::vector<int> idn;
-    
-    char tmp[1024];
-    char line_buffer[1024];
-    bool error= true;
-    for(;;)
+    for(int i= 0; i <= int(obj.commands.size()); i++)
     {
-        // charge une ligne du fichier
-        if(fgets(line_buffer, sizeof(line_buffer), in) == NULL)
-        {
-            error= false;       // fin du fichier, pas d'erreur detectee
+        // matiere des triangles qui precedent la commande
+        int end= (i < int(obj.commands.size())) ? obj.commands[i].triangle : triangles;
+        data.material_indices.resize(end, material_id);
+        if(i == int(obj.commands.size()))
             break;
-        }
-        
-        // force la fin de la ligne, au cas ou
-        line_buffer[sizeof(line_buffer) -1]= 0;
-        
-        // saute les espaces en debut de ligne
-        char *line= line_buffer;
-        while(*line && isspace(*line))
-            line++;
-        
-        if(line[0] == 'v')
-        {
-            float x, y, z;
-            if(line[1] == ' ')          // position x y z
-            {
-                if(sscanf(line, "v %f %f %f", &x, &y, &z) != 3)
-                    break;
-                data.positions.push_back( vec3(x, y, z) );
-            }
-            else if(line[1] == 'n')     // normal x y z
-            {
-                if(sscanf(line, "vn %f %f %f", &x, &y, &z) != 3)
-                    break;
-                data.normals.push_back( vec3(x, y, z) );
-            }
-            else if(line[1] == 't')     // texcoord x y
-            {
-                if(sscanf(line, "vt %f %f", &x, &y) != 2)
-                    break;
-                data.texcoords.push_back( vec2(x, y) );
-            }
-        }
         
-        else if(line[0] == 'f')         // triangle a b c, les sommets sont numerotes a partir de 1 ou de la fin du tableau (< 0)
+        const ObjCommand& command= obj.commands[i];
+        if(command.type == ObjCommand::FACE)
         {
-            idp.clear();
-            idt.clear();
-            idn.clear();
-            
-            int next;
-            for(line= line +1; ; line= line + next)
-            {
-                idp.push_back(0); 
-                idt.push_back(0); 
-                idn.push_back(0);         // 0: invalid index
-                
-                next= 0;
-                if(sscanf(line, " %d/%d/%d %n", &idp.back(), &idt.back(), &idn.back(), &next) == 3) 
-                    continue;
-                else if(sscanf(line, " %d/%d %n", &idp.back(), &idt.back(), &next) == 2)
-                    continue;
-                else if(sscanf(line, " %d//%d %n", &idp.back(), &idn.back(), &next) == 2)
-                    continue;
-                else if(sscanf(line, " %d %n", &idp.back(), &next) == 1)
-                    continue;
-                else if(next == 0)      // fin de ligne
-                    break;
-            }
-            
             // force une matiere par defaut, si necessaire
             if(material_id == -1)
             {
@@ -140,71 +241,38 @@ MeshData read_mesh_data( const char *filename )
                 material_id= default_material_id;
                 printf("usemtl default\n");
             }
-            
-            // triangule la face, construit les triangles 0 1 2, 0 2 3, 0 3 4, etc
-            for(int v= 2; v +1 < (int) idp.size(); v++)
-            {
-                int idv[3]= { 0, v -1, v };
-                for(int i= 0; i < 3; i++)
-                {
-                    int k= idv[i];
-                    int p= (idp[k] < 0) ? (int) data.positions.size() + idp[k] : idp[k] -1;
-                    int t= (idt[k] < 0) ? (int) data.texcoords.size() + idt[k] : idt[k] -1;
-                    int n= (idn[k] < 0) ? (int) data.normals.size()   + idn[k] : idn[k] -1;
-                    
-                    if(p < 0 || p >= (int) data.positions.size()) 
-                        break; // error
-                    
-                    // conserve les indices du sommet
-                    data.position_indices.push_back(p);
-                    data.texcoord_indices.push_back(t);
-                    data.normal_indices.push_back(n);
-                }
-                
-                // matiere du triangle...
-                data.material_indices.push_back(material_id);
-            }
         }
         
-        else if(line[0] == 'm')
+        else if(command.type == ObjCommand::MTLLIB)
         {
-           if(sscanf(line, "mtllib %[^\r\n]", tmp) == 1)
-           {
-                materials= read_material_data( std::string(pathname(filename) + tmp).c_str() );
-                data.materials= materials.data;
-           }
+            data.material_filenames.push_back( pathname(filename) + command.name );
+            materials= read_material_data( data.material_filenames.back().c_str() );
+            data.materials= materials.data;
         }
         
-        else if(line[0] == 'u')
+        else if(command.type == ObjCommand::USEMTL)
         {
-           if(sscanf(line, "usemtl %[^\r\n]", tmp) == 1)
-           {
-                material_id= -1;
-                for(unsigned int i= 0; i < (unsigned int) materials.names.size(); i++)
-                    if(materials.names[i] == tmp)
-                        material_id= i;
-                
-                if(material_id == -1)
+            auto found= materials.ids.find(command.name);
+            material_id= (found != materials.ids.end()) ? found->second : -1;
+            
+            if(material_id == -1)
+            {
+                // force une matiere par defaut, si necessaire
+                if(default_material_id == -1)
                 {
-                    // force une matiere par defaut, si necessaire
-                    if(default_material_id == -1)
-                    {
-                        // creer une matiere par defaut
-                        default_material_id= data.materials.size();
-                        data.materials.push_back( MaterialData() );
-                    }
-                    
-                    material_id= default_material_id;
+                    // creer une matiere par defaut
+                    default_material_id= data.materials.size();
+                    data.materials.push_back( MaterialData() );
                 }
-           }
+                
+                material_id= default_material_id;
+            }
         }
     }
     
-    fclose(in);
+    if(!cache_filename.empty())
+        write_mesh_data_cache(cache_filename.c_str(), data, filename);
     
-    if(error)
-        printf("loading mesh '%s'...\n[error]\n%s\n\n", filename, line_buffer);
-
     printf("  %d positions, %d texcoords, %d normals, %d triangles\n", 
         (int) data.positions.size(), (int) data.texcoords.size(), (int) data.normals.size(), (int) data.material_indices.size());
     
@@ -228,8 +296,8 @@ MaterialDataLib read_material_data( const char *filename )
 {
     MaterialDataLib materials;
     
-    FILE *in= fopen(filename, "rt");
-    if(in == NULL)
+    MtlData mtl;
+    if(!read_mtl_data(filename, mtl))
     {
         printf("[error] loading materials '%s'...\n", filename);
         return materials;
@@ -237,76 +305,37 @@ MaterialDataLib read_material_data( const char *filename )
     
     printf("loading materials '%s'...\n", filename);
     
-    MaterialData *material= NULL;
     std::string path= pathname(filename);
-    
-    char tmp[1024];
-    char line_buffer[1024];
-    bool error= true;
-    for(;;)
+    materials.names.reserve(mtl.materials.size());
+    materials.data.reserve(mtl.materials.size());
+    for(int i= 0; i < int(mtl.materials.size()); i++)
     {
-        // charge une ligne du fichier
-        if(fgets(line_buffer, sizeof(line_buffer), in) == NULL)
-        {
-            error= false;       // fin du fichier, pas d'erreur detectee
-            break;
-        }
+        const MtlMaterial& m= mtl.materials[i];
         
-        // force la fin de la ligne, au cas ou
-        line_buffer[sizeof(line_buffer) -1]= 0;
+        MaterialData material;
+        material.diffuse= m.diffuse;
+        material.specular= m.specular;
+        material.emission= m.emission;
+        material.ns= m.ns;
+        material.roughness= m.roughness;
+        material.metallic= m.metallic;
         
-        // saute les espaces en debut de ligne
-        char *line= line_buffer;
-        while(*line && isspace(*line))
-            line++;
+        // les noms des textures sont relatifs au fichier .mtl
+        auto texture= [&]( const std::string& name ) { return name.empty() ? name : normalize_path(path + name); };
+        material.diffuse_filename= texture(m.diffuse_filename);
+        material.specular_filename= texture(m.specular_filename);
+        material.emission_filename= texture(m.emission_filename);
+        material.roughness_filename= texture(m.roughness_filename);
+        material.metallic_filename= texture(m.metallic_filename);
+        material.normal_filename= texture(m.normal_filename);
         
-        if(line[0] == 'n')
-        {
-            if(sscanf(line, "newmtl %[^\r\n]", tmp) == 1)
-            {
-                materials.names.push_back( tmp );
-                materials.data.push_back( MaterialData() );
-                material= &materials.data.back();
-            }
-        }
-        
-        if(material == NULL)
-            continue;
+        // texture de l'exposant, map_Ns, ou map_Ks comme dans les anciennes versions
+        material.ns_filename= texture(m.ns_filename.empty() ? m.specular_filename : m.ns_filename);
         
-        if(line[0] == 'K')
-        {
-            float r, g, b;
-            if(sscanf(line, "Kd %f %f %f", &r, &g, &b) == 3)
-                material->diffuse= Color(r, g, b);
-            else if(sscanf(line, "Ks %f %f %f", &r, &g, &b) == 3)
-                material->specular= Color(r, g, b);
-            else if(sscanf(line, "Ke %f %f %f", &r, &g, &b) == 3)
-                material->emission= Color(r, g, b);
-        }
-        
-        else if(line[0] == 'N')
-        {
-            float n;
-            if(sscanf(line, "Ns %f", &n) == 1)          // Ns, puissance / concentration du reflet, modele blinn phong
-                material->ns= n;
-        }
-        
-        else if(line[0] == 'm')
-        {
-            if(sscanf(line, "map_Kd %[^\r\n]", tmp) == 1)
-                material->diffuse_filename= normalize_path(path + tmp);
-            
-            if(sscanf(line, "map_Ks %[^\r\n]", tmp) == 1)
-                material->ns_filename= normalize_path(path + tmp);
-            
-            //~ if(sscanf(line, "map_bump %[^\r\n]", tmp) == 1)
-                //~ material->normal_filename= tmp;
-        }
+        materials.names.push_back(m.name);
+        materials.data.push_back(material);
     }
-    
-    fclose(in);
-    if(error)
-        printf("[error] parsing line :\n%s\n", line_buffer);
+    materials.ids= std::move(mtl.ids);
     
     return materials;
 }
@@ -5,10 +5,12 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 #include "glcore.h"
 #include "vec.h"
 #include "color.h"
+#include "mesh_cache.h"
 
 
 //! representation d'une matiere texturee.
@@ -21,18 +23,26 @@ struct MaterialData
     GLuint diffuse_texture;             //!< texture diffuse
     
     Color specular;                     //!< couleur du reflet
+    std::string specular_filename;      //!< nom de la texture du reflet, map_Ks
 
     Color emission;                     //!< pour une source de lumiere
+    std::string emission_filename;      //!< nom de la texture d'emission, map_Ke
     float ns;                           //!< exposant pour les reflets blinn-phong
     
-    std::string ns_filename;            //!< nom de la texture exposant
+    std::string ns_filename;            //!< nom de la texture exposant, map_Ns, ou map_Ks s'il n'y a pas de map_Ns
     GLuint ns_texture;                  //!< texture exposant
     
-    // normal texture... \todo
+    float roughness;                    //!< Pr, extension pbr
+    float metallic;                     //!< Pm, extension pbr
+    std::string roughness_filename;     //!< nom de la texture roughness, map_Pr
+    std::string metallic_filename;      //!< nom de la texture metallic, map_Pm
+    
+    std::string normal_filename;        //!< nom de la texture de normales, norm, bump ou map_bump
     
     MaterialData( ) : diffuse(0.8f, 0.8f, 0.8f), diffuse_texture_color(1, 1, 1), diffuse_filename(), diffuse_texture(0), 
-        specular(Black()), emission(), 
-        ns(0), ns_filename(), ns_texture(0) {}
+        specular(Black()), specular_filename(), emission(), emission_filename(), 
+        ns(0), ns_filename(), ns_texture(0), 
+        roughness(1), metallic(0), roughness_filename(), metallic_filename(), normal_filename() {}
 };
 
 //! ensemble de matieres texturees.
@@ -40,6 +50,7 @@ struct MaterialDataLib
 {
     std::vector<std::string> names;
     std::vector<MaterialData> data;
+    std::unordered_map<std::string, int> ids;   //!< indice de chaque matiere, retrouve a partir de son nom
 };
 
 
@@ -55,6 +66,8 @@ struct MeshData
     
     std::vector<MaterialData> materials;
     std::vector<int> material_indices;
+    
+    std::vector<std::string> material_filenames;        //!< fichiers .mtl lus par read_mesh_data()
 };
 
 /*! renvoie le chemin d'acces a un fichier. le chemin est toujours termine par /
@@ -65,12 +78,20 @@ struct MeshData
  */
 std::string pathname( const std::string& filename );
 
-//! charge un fichier wavefront .obj et renvoie les donnees.
+/*! charge un fichier wavefront .obj et renvoie les donnees. 
+    si les caches sont actives, cf mesh_cache_directory(), les donnees sont enregistrees dans un fichier cache, filename.data, 
+    relu directement lors du prochain chargement, tant que les fichiers .obj et .mtl ne sont pas modifies.
+ */
 MeshData read_mesh_data( const char *filename );
 
-//! charge un ensemble de matieres texturees.
+//! charge un ensemble de matieres texturees, les noms des textures sont relatifs au repertoire courant.
 MaterialDataLib read_material_data( const char *filename );
 
+//! ajoute les matieres dans un fichier cache, dans 2 blocs, renvoie l'indice du premier bloc.
+int write_material_cache( MeshCacheWriter& cache, const std::vector<MaterialData>& materials );
+//! relit les matieres ajoutees par write_material_cache() dans les blocs id et id+1 d'un fichier cache.
+bool read_material_cache( const MeshCache& cache, const int id, std::vector<MaterialData>& materials );
+
 //! renvoie l'englobant.
 void bounds( const MeshData& data, Point& pmin, Point& pmax );
 
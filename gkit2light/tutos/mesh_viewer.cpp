@@ -22,31 +22,19 @@ public:
     
     int init( )
     {
-        // lit les donnees
-        MeshData data= read_mesh_data(m_filename);
-        if(data.positions.size() == 0)
+        // lit les donnees, recalcule les normales si necessaire, et construit les buffers, ou relit le cache
+        m_mesh= read_mesh_buffer(m_filename);
+        if(m_mesh.vertex_count() == 0)
             return -1;
         
         // calcule l'englobant 
         Point pmin, pmax;
-        bounds(data, pmin, pmax);
+        bounds(m_mesh, pmin, pmax);
         m_camera.lookat(pmin, pmax);
         
-        // recalcule les normales des sommets, si necessaire
-        if(data.normals.size() == 0)
-        {
-            normals(data);
-            
-            printf("normals : %d positions, %d texcoords, %d normals, %d triangles\n", 
-                (int) data.positions.size(), (int) data.texcoords.size(), (int) data.normals.size(), (int) data.material_indices.size());
-        }
-        
-        // construit les buffers
-        m_mesh= buffers(data);
-        
         // conserve le nombre de sommets et d'indices
-        m_vertex_count= m_mesh.positions.size();
-        m_index_count= m_mesh.indices.size();
+        m_vertex_count= m_mesh.vertex_count();
+        m_index_count= m_mesh.index_count();
         
         // construit les buffers openGL
         size_t size= m_mesh.vertex_buffer_size() + m_mesh.texcoord_buffer_size() + m_mesh.normal_buffer_size();